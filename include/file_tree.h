@@ -0,0 +1,34 @@
+#ifndef FILE_TREE_H
+#define FILE_TREE_H
+
+#include <stdbool.h>
+#include <pthread.h>
+#include "constants.h"
+#include "inode.h"
+#include "merkle.h"
+
+#define FILE_TREE_SLOTS (NUMVOLUMES * INODES_PER_VOLUME) // One tree per inode of the filesystem
+#define FILE_TREE_ROOT_XATTR "user.encryptfs.root"     // Extended attribute holding the root of a file in hex
+
+// Merkle tree over the data blocks of one file in file order, leaf i is the leaf hash of block i.
+// Its root is kept in the inode. The volume trees still cover every block and check the root
+// when the tree is loaded, after that reads and writes of the file only take the lock of its tree.
+typedef struct file_tree
+{
+    pthread_mutex_t lock; // Held while the tree or the inode root is used
+    int inode_index;      // Inode the tree belongs to
+    MerkleTree *tree;     // MAX_DATABLOCKS leaves, NULL until the file is used
+} file_tree_t;
+
+// Function prototypes for per file merkle trees
+void file_trees_enable(bool enabled);
+bool file_trees_enabled(void);
+file_tree_t *open_file_tree(int inode_index, inode *node, bool adopt);
+void close_file_tree(file_tree_t *file_tree);
+void update_file_tree(file_tree_t *file_tree, inode *node, const int *positions, unsigned char (*block_hashes)[SHA256_DIGEST_LENGTH], int count);
+void rebuild_file_tree(file_tree_t *file_tree, inode *node);
+bool read_file_blocks_checked(file_tree_t *file_tree, const inode *node, int first, int count, void *buf);
+void forget_file_tree(int inode_index);
+void free_file_trees(void);
+
+#endif // FILE_TREE_H
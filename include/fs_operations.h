@@ -38,6 +38,12 @@ int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset
 int fs_rename(const char *from, const char *to);
 //  rm or delete
 int fs_unlink(const char *path);
+// read the root of a file merkle tree
+int fs_getxattr(const char *path, const char *name, char *value, size_t size);
+// take or delete a snapshot of the mounted filesystem
+int fs_setxattr(const char *path, const char *name, const char *value, size_t size, int flags);
+// start background work once mounted
+void *fs_init(struct fuse_conn_info *conn);
 // clean up and destroy the file system
 // upload if remote
 void fs_destroy();
@@ -0,0 +1,28 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Every algorithm produces 32 byte digests, so Merkle tree files keep the same layout
+#define HASH_DIGEST_LENGTH 32
+
+// Integrity hash of a filesystem, chosen at mkfs time and recorded in the superblock
+typedef enum hash_algorithm
+{
+    HASH_SHA256 = 0,  // OpenSSL SHA-256, the default and what older superblocks used
+    HASH_BLAKE2B = 1, // libsodium crypto_generichash (BLAKE2b-256)
+    HASH_BLAKE3 = 2,  // BLAKE3, only when built with BLAKE3=1
+    HASH_ALGORITHM_COUNT
+} hash_algorithm;
+
+// Function prototypes for the integrity hash
+bool hash_algorithm_available(hash_algorithm algorithm);
+bool set_hash_algorithm(hash_algorithm algorithm);
+hash_algorithm get_hash_algorithm(void);
+const char *hash_algorithm_name(hash_algorithm algorithm);
+int parse_hash_algorithm(const char *name);
+void hash_digest(const void *input, size_t len, unsigned char *output);
+void hash_digest_many(const unsigned char *const *inputs, size_t len, int count, unsigned char *const *outputs);
+
+#endif // HASH_H
@@ -15,6 +15,10 @@
 #define AES_GCM_NONCE_SIZE 12
 #define AES_GCM_TAG_SIZE 16
 
+#ifndef SHA256_DIGEST_LENGTH
+#define SHA256_DIGEST_LENGTH 32
+#endif
+
 // Define the inode structure
 typedef struct inode
 {
@@ -38,12 +42,16 @@ typedef struct inode
     int num_children;               // The number of children in the directory
     char type[MAX_TYPE_LENGTH];     // The type of the file
     int num_links;                  // The number of links to the file
+    // Fields below are missing from inodes of older filesystems, see inode_record_size
+    int has_file_tree;                             // 1 if file_root covers the data blocks of the file
+    unsigned char file_root[SHA256_DIGEST_LENGTH]; // Root of the merkle tree over the blocks in file order
 } inode;
 
 // Function prototypes for inode operations
 void read_inode(int inode_index, inode *inode_buf);
 void write_inode(int inode_index, const inode *inode_buf);
 void init_inode(inode *node, const char *path, mode_t mode);
+size_t inode_record_size(void);
 
 int allocate_inode_bmp(bitmap_t *bmp, char *volume_id);
 int find_inode_index_by_path(const char *target_path);
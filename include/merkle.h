@@ -3,53 +3,237 @@
 
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdint.h>
 
 // Define the SHA256 digest length if not defined
 #ifndef SHA256_DIGEST_LENGTH
 #define SHA256_DIGEST_LENGTH 32
 #endif
 
-// Merkle tree node structure
+// Binary on-disk format of the Merkle tree file
+#define MERKLE_FILE_MAGIC "EFSMRKL" // 7 chars + NUL fills the 8 byte magic
+#define MERKLE_FILE_VERSION 2
+#define MERKLE_FILE_V1_HEADER_SIZE 32 // version 1 headers end after flags and imply fan-out 2
+#define MERKLE_MAX_LEVELS 32 // enough levels for any int leaf count
+
+// Children per interior node, picked at mkfs time and recorded in the superblock
+#define MERKLE_DEFAULT_FANOUT 2
+#define MERKLE_MAX_FANOUT 16
+
+// What a leaf hash covers, recorded in the superblock
+#define MERKLE_LEAF_PLAINTEXT 0 // Decrypted block, used by older superblocks
+#define MERKLE_LEAF_RECORD 1    // Stored nonce and GCM tag, checked without decrypting or the key
+
+// Parallel tree construction
+#define MERKLE_MAX_THREADS 16            // Upper bound on worker threads
+#define MERKLE_PARALLEL_MIN_LEAVES 4096  // Smaller trees are built on the calling thread
+
+// Volume trees are loaded on first access, the least recently used are evicted above this count
+#define MERKLE_MAX_RESIDENT_TREES 4
+
+// A tree mapped from its file keeps its top levels in memory and pages the levels below in from
+// the file on access, dropping the least recently used pages beyond a fixed budget per tree
+#define MERKLE_DEFAULT_PINNED_LEVELS 10                 // Levels from the root that are never dropped
+#define MERKLE_DEFAULT_CACHE_SIZE (4 * 1024 * 1024)     // Bytes of lower level pages kept per tree
+#define MERKLE_PAGE_SPAN (64 * 1024)                    // Unit of paging, what the kernel maps around a fault
+#define MERKLE_PAGE_LOG 256                             // Units read by lock-free readers until a locked access lists them
+
+// Header of a binary Merkle tree file. It is followed by node_count raw
+// digests of digest_size bytes, stored level by level starting with the
+// leaves and ending with the root. A level holds ceil(previous / fanout)
+// nodes, each hashing its up to fanout children concatenated. A last node
+// with a single child is promoted and repeated in the level above. A node
+// whose subtree holds no written block is the empty (all zero) digest on every
+// level, so empty subtrees are never hashed and are left as holes in the file.
+typedef struct merkle_file_header
+{
+    char magic[8];        // MERKLE_FILE_MAGIC
+    uint32_t version;     // MERKLE_FILE_VERSION
+    uint32_t digest_size; // Size of each stored digest in bytes
+    uint32_t leaf_count;  // Number of leaves (data blocks) in the tree
+    uint32_t level_count; // Number of levels including leaves and root
+    uint32_t node_count;  // Number of digests following the header
+    uint32_t flags;       // MERKLE_FILE_* flags
+    uint32_t fanout;         // Children per interior node, since version 2
+    uint32_t hash_algorithm; // hash_algorithm of the digests, since version 2
+} merkle_file_header_t;
+
+#define MERKLE_FILE_DIRTY 0x1 // Nodes were updated in place since the last checkpoint
+
+// Merkle tree node structure, nodes live in one array ordered level by level.
+// A node is exactly one digest of the tree file, leaf i is block i of the volume.
+// Aligned so a hash can be copied as atomic 8-byte words, see load_merkle_hash.
 typedef struct MerkleNode
 {
-    int block_index;           // Index of the block in the volume for searching purposes
-    int min_index;             // Minimum index in the subtree
-    int max_index;             // Maximum index in the subtree
-    char hash[65];             // Hash stored in this node
-    struct MerkleNode *left;   // Pointer to left child
-    struct MerkleNode *right;  // Pointer to right child
-    struct MerkleNode *parent; // Pointer to parent node
+    unsigned char hash[SHA256_DIGEST_LENGTH] __attribute__((aligned(8))); // Hash stored in this node
 } MerkleNode;
 
+// Storage of one tree in a single anonymous mapping: the node array, unless the nodes are read
+// from the mapped tree file, then the dirty list and the dirty and verified bitmaps. Pages are
+// only backed by memory once written and the whole tree is released with one munmap.
+typedef struct merkle_arena
+{
+    unsigned char *base; // Start of the mapping, NULL if nothing is reserved
+    size_t size;         // Reserved bytes
+} merkle_arena_t;
+
+// Page of a mapped tree in the least recently used list
+typedef struct merkle_page
+{
+    long page; // Address of the unit divided by MERKLE_PAGE_SPAN
+    int prev;  // More recently used entry, -1 at the head
+    int next;  // Less recently used entry, -1 at the tail
+    int chain; // Next entry of the same hash bucket, or of the free list
+} merkle_page_t;
+
+// Lower level pages of a mapped tree that are in memory, most recently used first. Its size
+// follows the page budget and not the size of the tree.
+typedef struct merkle_page_lru
+{
+    merkle_page_t *entries; // Tracked pages, capacity of them
+    int *buckets;           // Hash buckets of entries, twice capacity
+    int capacity;           // Allocated entries
+    int count;              // Entries in use
+    int free;               // First unused entry, -1 if all are in use
+    int head;               // Most recently used entry
+    int tail;               // Least recently used entry
+} merkle_page_lru_t;
+
+// Root of a tree as published by its last writer. Lock-free readers verify against it, a writer
+// publishes a new version after every update and the old one is freed once no reader holds it.
+typedef struct merkle_version
+{
+    unsigned char root[SHA256_DIGEST_LENGTH]; // Root hash when the version was published
+    uint64_t generation;                      // Counts the versions of the tree
+} merkle_version_t;
+
 // Merkle tree structure
+// Node pos on level l is nodes[level_offset[l] + pos], its parent is pos / fanout on
+// level l + 1 and its siblings share that parent on level l.
 typedef struct
 {
-    MerkleNode *root; // Root node of the Merkle tree
-    int depth;        // Depth of the tree (optional)
+    MerkleNode *nodes;                   // All nodes, leaves first and root last
+    unsigned char *map;                  // Mapped tree file the nodes live in, NULL if they are in the arena
+    size_t map_size;                     // Length of the mapping
+    merkle_arena_t arena;                // Node array and per node bookkeeping of this tree
+    merkle_page_lru_t pages;             // Lower level pages of the mapping in memory
+    long page_log[MERKLE_PAGE_LOG];      // Units read by lock-free readers, added to pages under merkle_lock
+    uint64_t page_log_state;             // Log entries reserved in the high half, written in the low half
+    size_t data_offset;                  // File offset of the first node, after the header
+    int fanout;                          // Children per interior node
+    int num_leaves;                      // Number of leaves (data blocks)
+    int level_count;                     // Number of levels including leaves and root
+    int level_size[MERKLE_MAX_LEVELS];   // Number of nodes on each level
+    int level_offset[MERKLE_MAX_LEVELS]; // Index of the first node of each level
+    int node_count;                      // Number of nodes, same as slots in the tree file
+    int *dirty;                          // Node indices updated since the last sync, room for every node
+    unsigned char *dirty_map;            // Bitmap of the nodes listed in dirty
+    int dirty_count;                     // Number of entries in dirty
+    int fd;                              // Tree file kept open for in-place updates, -1 if not written yet
+    bool file_dirty;                     // MERKLE_FILE_DIRTY is set in the file header
+    unsigned long last_access;           // Access clock value of the last lookup, for eviction
+    unsigned char *verified_map;         // Bitmap of nodes already checked up to the root
+    int volume;                          // Volume the tree belongs to, -1 for other trees
+    merkle_version_t *version;           // Last published version, NULL until the tree is published
 } MerkleTree;
 
+// Looks up a node of an older version of a tree by index, false if it is the same as in the live tree
+typedef bool (*merkle_node_reader_t)(void *ctx, int index, unsigned char *hash);
+
+// Compact multi-proof file for a set of leaves of one volume tree. The header is followed by
+// index_count leaf indices (uint32_t, ascending), index_count leaf digests and hash_count
+// sibling digests. A sibling shared by several paths is stored once, and nodes the verifier
+// computes from the proven leaves are not stored at all.
+#define MERKLE_PROOF_MAGIC "EFSPROF" // 7 chars + NUL fills the 8 byte magic
+#define MERKLE_PROOF_VERSION 1
+
+typedef struct merkle_proof_header
+{
+    char magic[8];           // MERKLE_PROOF_MAGIC
+    uint32_t version;        // MERKLE_PROOF_VERSION
+    uint32_t digest_size;    // Size of each stored digest in bytes
+    uint32_t hash_algorithm; // hash_algorithm of the digests
+    uint32_t fanout;         // Children per interior node of the tree
+    uint32_t leaf_count;     // Number of leaves of the tree
+    uint32_t index_count;    // Number of proven leaves
+    uint32_t hash_count;     // Number of sibling digests, in the order verification uses them
+    uint32_t volume;         // Volume the tree belongs to
+} merkle_proof_header_t;
+
+// Multi-proof in memory, laid out like the proof file
+typedef struct
+{
+    merkle_proof_header_t header;                  // Counts and tree parameters
+    uint32_t *indices;                             // Proven leaf indices, ascending
+    unsigned char (*leaves)[SHA256_DIGEST_LENGTH]; // Digest of each proven leaf
+    unsigned char (*hashes)[SHA256_DIGEST_LENGTH]; // Sibling digests
+} MerkleProof;
+
 // Function prototypes for managing Merkle trees
-MerkleNode *create_merkle_node(const char *hash, MerkleNode *left, MerkleNode *right, int block_index);
-void compute_hash(const char *input, char *output);
-bool compare_hashes(const char *hash1, const char *hash2);
-void update_merkle_node(MerkleNode *node, const char *new_hash);
-MerkleTree *build_merkle_tree(char **block_hashes, int num_blocks);
-bool verify_merkle_path(MerkleNode *leaf_node, const char *expected_root_hash, char decrytped_hash[65]);
+void compute_hash(const void *input, size_t len, unsigned char *output);
+bool compare_hashes(const unsigned char *hash1, const unsigned char *hash2);
+MerkleNode *merkle_node_at(MerkleTree *tree, int level, int pos);
+unsigned char *merkle_root_hash(MerkleTree *tree);
+int merkle_child_count(MerkleTree *tree, int level, int pos);
+void update_merkle_node(MerkleTree *tree, int block_index, const unsigned char *new_hash);
+void update_merkle_leaves(MerkleTree *tree, const int *block_indices, unsigned char (*block_hashes)[SHA256_DIGEST_LENGTH], int count);
+MerkleTree *build_merkle_tree(unsigned char **block_hashes, int num_blocks, int fanout);
+MerkleTree *create_empty_merkle_tree(int num_leaves, int fanout);
+bool merkle_node_is_empty(const unsigned char *hash);
+bool verify_merkle_path(MerkleTree *tree, int block_index, const unsigned char *expected_root_hash, const unsigned char *block_hash);
+bool verify_merkle_range(MerkleTree *tree, int first, int count, unsigned char (*leaf_hashes)[SHA256_DIGEST_LENGTH], const unsigned char *expected_root_hash);
 void save_merkle_tree_to_file(MerkleTree *tree, const char *file_path);
 MerkleTree *load_merkle_tree_from_file(const char *file_path);
+int merkle_level_sizes(int num_leaves, int fanout, int *sizes);
+void mark_merkle_path_dirty(MerkleTree *tree, int block_index);
+void sync_merkle_tree(MerkleTree *tree, const char *file_path);
+void checkpoint_merkle_tree(MerkleTree *tree, const char *file_path);
+void free_merkle_tree(MerkleTree *tree);
+void merkle_tree_footprint(MerkleTree *tree, size_t *reserved, size_t *resident);
+void merkle_set_residency(int pinned_levels, size_t cache_size);
+int merkle_worker_count(void);
+void merkle_parallel_for(int count, void (*fn)(void *arg, int i), void *arg);
+void hash_to_hex(const unsigned char *bin, char *hex, size_t len);
+void hex_to_hash(const char *hex, unsigned char *bin, size_t len);
+
+// Multi-proof functions
+MerkleProof *create_merkle_multiproof(MerkleTree *tree, const int *block_indices, int count);
+bool verify_merkle_multiproof(const MerkleProof *proof, unsigned char (*leaf_hashes)[SHA256_DIGEST_LENGTH], const unsigned char *expected_root_hash);
+bool save_merkle_proof(const MerkleProof *proof, const char *file_path);
+MerkleProof *load_merkle_proof(const char *file_path);
+void free_merkle_proof(MerkleProof *proof);
 
 // Block management related functions
 int get_number_of_blocks(char *volume_path);
-void get_block_hash(int block_index, char *hash);
-void generate_random_hash(char *hash, size_t size);
+void get_block_hash(int block_index, unsigned char *hash);
+void compute_record_leaf(const unsigned char *nonce, const unsigned char *tag, unsigned char *hash);
 
 // Merkle tree volume operations
+int merkle_fanout(void);
 MerkleTree *initialize_merkle_tree_for_volume(char *volume_path);
+MerkleTree *rebuild_merkle_tree_for_volume(int volume_index);
+MerkleTree *load_merkle_tree_for_volume(int volume_index);
+void load_merkle_trees(int volume_count);
+void rebuild_merkle_trees(int volume_count);
+void evict_merkle_trees(int max_resident);
+void free_merkle_trees(void);
+void report_merkle_memory(void);
+void publish_merkle_tree(int volume_index, MerkleTree *tree);
 MerkleTree *get_merkle_tree_for_volume(char *volume_id);
-MerkleNode *find_leaf_node(MerkleNode *node, int block_index);
 MerkleNode *find_leaf_node_in_tree(MerkleTree *tree, int block_index);
 void update_merkle_node_for_block(char *volume_id, int block_index, const void *block_data);
-void get_root_hash(char *volume_id, char *root_hash);
+void update_merkle_nodes_for_blocks(const int *block_indices, unsigned char (*block_hashes)[SHA256_DIGEST_LENGTH], int count);
+void mark_volume_tree_dirty(int volume_index);
+void get_root_hash(char *volume_id, unsigned char *root_hash);
+void set_volume_root(int volume_index);
+void reject_volume_tree(int volume_index);
+bool volume_tree_rejected(int volume_index);
+bool verify_root_of_roots(void);
 bool verify_block_integrity(int block_index);
+bool verify_block_leaf(int block_index, const unsigned char *block_hash);
+bool read_block_leaf(int block_index, unsigned char *block_hash);
+bool verify_block_range(int block_index, int count, unsigned char (*block_hashes)[SHA256_DIGEST_LENGTH]);
+bool verify_snapshot_leaf(int block_index, const unsigned char *block_hash, const unsigned char *expected_root_hash, merkle_node_reader_t read_node, void *ctx);
+void get_volume_roots(unsigned char (*volume_roots)[SHA256_DIGEST_LENGTH], unsigned char *root_of_roots);
 
 #endif // MERKLE_H
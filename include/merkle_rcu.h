@@ -0,0 +1,28 @@
+#ifndef MERKLE_RCU_H
+#define MERKLE_RCU_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define MERKLE_RCU_MAX_READERS 64 // Threads that can read without locking at once, others take merkle_lock
+
+// Memory a writer unpublished while lock-free readers may still use it. It is released once every
+// reader that started before it was retired has finished.
+typedef struct merkle_retired
+{
+    void *ptr;                               // Unpublished memory
+    size_t size;                             // Passed to release with ptr
+    void (*release)(void *ptr, size_t size); // Frees ptr
+    uint64_t epoch;                          // Readers from this epoch on cannot see ptr
+    struct merkle_retired *next;             // Next older retired memory
+} merkle_retired_t;
+
+// Function prototypes for deferred reclamation of merkle trees
+bool merkle_rcu_read_begin(void);
+void merkle_rcu_read_end(void);
+void merkle_rcu_retire(void *ptr, size_t size, void (*release)(void *ptr, size_t size));
+void merkle_rcu_reclaim(void);
+void merkle_rcu_synchronize(void);
+
+#endif // MERKLE_RCU_H
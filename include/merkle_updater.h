@@ -0,0 +1,30 @@
+#ifndef MERKLE_UPDATER_H
+#define MERKLE_UPDATER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "merkle.h"
+
+#define MERKLE_UPDATE_QUEUE_SIZE 4096   // Blocks with a queued leaf, writers wait while it is full
+#define MERKLE_UPDATE_BATCH 1024        // Queued blocks that start a batch before the lag runs out
+#define MERKLE_UPDATE_DEFAULT_LAG_MS 0  // Longest time a leaf stays queued, 0 updates the trees on write
+
+// Leaf of a written block waiting for the updater thread. A block written again while it is queued
+// keeps one entry with the newer digest, so each batch updates a leaf once.
+typedef struct merkle_update
+{
+    int block_index;                            // Block index across volumes, -1 for a free slot
+    uint64_t seq;                               // Write that queued the digest, increases with every write
+    unsigned char digest[SHA256_DIGEST_LENGTH]; // Leaf hash of the block as last written
+} merkle_update_t;
+
+// Function prototypes for the background merkle updater
+void merkle_updater_start(unsigned int lag_ms);
+void merkle_updater_stop(void);
+void merkle_updater_queue(const int *block_indices, unsigned char (*block_hashes)[SHA256_DIGEST_LENGTH], int count, bool in_background);
+bool merkle_updater_lookup(int block_index, unsigned char *digest);
+void merkle_updater_wait(int block_index, int count);
+bool merkle_updater_pending(int volume_index);
+void merkle_updater_flush(void);
+
+#endif // MERKLE_UPDATER_H
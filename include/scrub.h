@@ -0,0 +1,32 @@
+#ifndef SCRUB_H
+#define SCRUB_H
+
+#include <stdint.h>
+
+#define SCRUB_PROGRESS_PATH "scrub_progress.bin" // Progress file, next to the volume files
+#define SCRUB_PROGRESS_MAGIC "EFSSCRB"           // 7 chars + NUL fills the 8 byte magic
+#define SCRUB_CHECKPOINT_BLOCKS 16               // Progress is saved after this many blocks
+#define SCRUB_PASS_INTERVAL 3600                 // Seconds between the end of a pass and the next
+#define SCRUB_XATTR "user.encryptfs.scrub"       // Root attribute, reads the progress and takes "pause" or "resume"
+
+// Position and results of the scrubber, saved so a pass continues after a remount
+typedef struct scrub_progress
+{
+    char magic[8];           // SCRUB_PROGRESS_MAGIC
+    uint32_t volume;         // Volume being scrubbed
+    uint32_t block;          // Next block of that volume
+    uint32_t paused;         // Scrubbing was paused and stays paused after a remount
+    uint32_t passes;         // Completed passes over all volumes
+    uint64_t blocks_checked; // Blocks verified in the current pass
+    uint64_t errors;         // Blocks that failed verification in the current pass
+    uint64_t last_errors;    // Blocks that failed verification in the last completed pass
+} scrub_progress_t;
+
+// Function prototypes for the background scrubber
+void scrub_start(uint64_t bytes_per_sec);
+void scrub_stop(void);
+void scrub_pause(void);
+void scrub_resume(void);
+void scrub_get_progress(scrub_progress_t *progress);
+
+#endif // SCRUB_H
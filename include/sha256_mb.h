@@ -0,0 +1,19 @@
+#ifndef SHA256_MB_H
+#define SHA256_MB_H
+
+#include <stddef.h>
+
+// Define the SHA256 digest length if not defined
+#ifndef SHA256_DIGEST_LENGTH
+#define SHA256_DIGEST_LENGTH 32
+#endif
+
+#define SHA256_MB_LANES 8 // Messages hashed together by the AVX2 kernel
+
+// Function prototypes for multi-buffer SHA-256
+// Hash count independent messages of the same length, outputs[i] receives the digest of inputs[i]
+void sha256_mb(const unsigned char *const *inputs, size_t len, int count, unsigned char *const *outputs);
+// Name of the kernel picked for this CPU
+const char *sha256_mb_kernel_name(void);
+
+#endif // SHA256_MB_H
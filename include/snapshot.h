@@ -0,0 +1,51 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "constants.h"
+
+#ifndef SHA256_DIGEST_LENGTH
+#define SHA256_DIGEST_LENGTH 32
+#endif
+
+#define MAX_SNAPSHOTS 8                            // Slots of the snapshot table in the superblock
+#define SNAPSHOT_PATH_FORMAT "snapshot_%u_%d.bin"  // Preserved nodes and blocks of one snapshot and volume
+#define SNAPSHOT_XATTR "user.encryptfs.snapshot"   // Set on the root of a mount to "create" or "delete <id>"
+
+// Kinds of records in a snapshot file
+#define SNAPSHOT_NODE 0  // Followed by one digest, the node as it was when the snapshot was taken
+#define SNAPSHOT_BLOCK 1 // Followed by the nonce, ciphertext and tag of a block as it was stored
+
+// Entry of the snapshot table in the superblock. Taking a snapshot only records the roots, the
+// live tree and volume stay in place. The first time a node or block changes afterwards, its old
+// value is appended to the file of the newest snapshot, so a snapshot holds only what changed.
+// Older snapshots read through the files of newer ones before falling back to the live volume.
+typedef struct snapshot_info
+{
+    uint32_t id;                                                 // 0 marks a free slot, ids only increase
+    uint32_t volume_count;                                       // Volumes that existed when it was taken
+    int64_t created;                                             // Time it was taken
+    unsigned char root_of_roots[SHA256_DIGEST_LENGTH];           // Root of roots when it was taken
+    unsigned char volume_roots[NUMVOLUMES][SHA256_DIGEST_LENGTH]; // Volume roots when it was taken
+} snapshot_info_t;
+
+// Header of one preserved value in a snapshot file
+typedef struct snapshot_record
+{
+    uint32_t type;  // SNAPSHOT_NODE or SNAPSHOT_BLOCK
+    uint32_t index; // Node index in the volume tree or block index within the volume
+} snapshot_record_t;
+
+// Function prototypes for snapshots
+int snapshot_create(void);
+bool snapshot_delete(uint32_t id);
+const snapshot_info_t *snapshot_find(uint32_t id);
+void snapshot_write_begin(void);
+void snapshot_write_end(void);
+void snapshot_preserve_node(int volume, int index, const unsigned char *hash);
+void snapshot_preserve_block(int block_index);
+bool snapshot_read_block(uint32_t id, int block_index, void *buf);
+void snapshot_close(void);
+
+#endif // SNAPSHOT_H
@@ -2,8 +2,10 @@
 #define VOLUME_H
 
 #include <sys/types.h>
+#include <stdbool.h>
 #include "constants.h"
 #include "merkle.h"
+#include "snapshot.h"
 
 typedef enum volume_type
 {
@@ -31,8 +33,26 @@ typedef struct superblock
     int inode_size;                    // Size of an inode in bytes
     volume_type vtype;                 // Type of volume
     volume_info_t volumes[NUMVOLUMES]; // Array of volume_info_t structures, Maximum defined in constants
+    int merkle_roots_valid;            // Set once the roots below were recorded, older superblocks lack them
+    unsigned char volume_roots[NUMVOLUMES][SHA256_DIGEST_LENGTH]; // Root hash of each volume Merkle tree
+    unsigned char root_of_roots[SHA256_DIGEST_LENGTH];            // Root of the Merkle tree over volume_roots, unkeyed like
+                                                                  // the rest of the superblock, see verify_root_of_roots
+    int merkle_fanout;                 // Children per node of the volume trees, 0 in older superblocks means 2
+    int hash_algorithm;                // hash_algorithm of blocks and trees, 0 (SHA-256) in older superblocks
+    int merkle_leaf_format;            // MERKLE_LEAF_* content of the leaf hashes
+    uint32_t snapshot_next_id;                // Id of the next snapshot, 0 in older superblocks means 1
+    snapshot_info_t snapshots[MAX_SNAPSHOTS]; // Snapshot table, empty in older superblocks
 } superblock_t;
 
+// Per volume files kept open for the life of the mount and accessed with pread and pwrite
+typedef enum volume_file_kind
+{
+    VOLUME_DATA_FILE,   // volume_N.bin, the encrypted blocks
+    VOLUME_INODES_FILE, // inodes_N.bin, the encrypted inodes
+    VOLUME_BITMAP_FILE, // bmp_N.bin, the inode and block bitmaps
+    VOLUME_FILE_KINDS
+} volume_file_kind;
+
 extern superblock_t sb; // Global superblock for the file system mounted
 
 extern char superblock_path[MAX_PATH_LENGTH]; // Path to the file storing the superblock
@@ -43,8 +63,21 @@ void load_or_create_superblock(const char *path, superblock_t *sb);
 void init_superblock_local(superblock_t *sb);
 void create_volume_files_local(int i, superblock_t *sb);
 void read_volume_block(int block_index, void *buf);
+bool read_volume_record(int block_index, unsigned char *nonce, unsigned char *encrypted_data);
+bool read_volume_block_checked(int block_index, void *buf);
+void read_volume_blocks(int block_index, int count, void *buf);
+bool read_volume_blocks_checked(int block_index, int count, void *buf);
+bool read_volume_blocks_hashed(int block_index, int count, void *buf, unsigned char (*block_hashes)[SHA256_DIGEST_LENGTH]);
 void read_volume_block_no_check(int block_index, void *buf);
+bool read_volume_block_tag(int block_index, unsigned char *nonce, unsigned char *tag);
 void write_volume_block(int block_index, const void *buf, size_t buf_size);
+void write_volume_block_no_update(int block_index, const void *buf, size_t buf_size, unsigned char *block_hash);
 void load_or_create_remote_superblock(const char *path, superblock_t *sb);
+void write_superblock(superblock_t *sb);
+void write_superblock_roots(superblock_t *sb);
+bool lock_superblock(const char *path);
+int volume_file_fd(int volume_index, volume_file_kind kind);
+void close_volume_files(void);
+void volume_mmap_reads_enable(bool enabled);
 
 #endif // VOLUME_H
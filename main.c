@@ -21,6 +21,8 @@
 #include "inode.h"
 #include "volume.h"
 #include "crypto.h"
+#include "hash.h"
+#include "snapshot.h"
 #include <sodium/crypto_aead_aes256gcm.h>
 #include <sodium.h>
 #include "cloud_storage.h"
@@ -29,6 +31,62 @@ void add_inode_to_directory(int dir_inode_index, int file_inode_index)
 {
 }
 
+// Parse a block list like "0-15" or "1,4,8-9" into a new array, returns the number of blocks or -1
+static int parse_block_list(const char *spec, int **blocks)
+{
+    int count = 0;
+    int capacity = 16;
+    *blocks = malloc(capacity * sizeof(int));
+    const char *p = spec;
+    while (*blocks && *p)
+    {
+        char *end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p || first < 0)
+        {
+            break;
+        }
+        if (*end == '-')
+        {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first)
+            {
+                break;
+            }
+        }
+        for (long b = first; b <= last; b++)
+        {
+            if (count == capacity)
+            {
+                capacity *= 2;
+                int *grown = realloc(*blocks, capacity * sizeof(int));
+                if (!grown)
+                {
+                    free(*blocks);
+                    *blocks = NULL;
+                    return -1;
+                }
+                *blocks = grown;
+            }
+            (*blocks)[count++] = (int)b;
+        }
+        if (*end == '\0')
+        {
+            return count;
+        }
+        if (*end != ',')
+        {
+            break;
+        }
+        p = end + 1;
+    }
+    free(*blocks);
+    *blocks = NULL;
+    return -1;
+}
+
 int main(int argc, char *argv[])
 {
     printf("main: starting the file system\n");
@@ -51,6 +109,11 @@ int main(int argc, char *argv[])
     {
         printf("Usage: %s <mountpoint> <superblock_path> <key>\n", argv[0]);
         printf("Usage for random keygen: %s keygen <key_path>\n", argv[0]);
+        printf("Usage for filesystem creation: %s mkfs <superblock_path> <key> [merkle_fanout] [sha256|blake2b|blake3]\n", argv[0]);
+        printf("Usage for merkle tree rebuild: %s rebuild <superblock_path> <key>\n", argv[0]);
+        printf("Usage for merkle proof export: %s proof <superblock_path> <volume> <blocks e.g. 0-15,20> <proof_path>\n", argv[0]);
+        printf("Usage for merkle proof check: %s verifyproof <proof_path> <root_hex|superblock_path>\n", argv[0]);
+        printf("Usage for snapshots: %s snapshot <superblock_path> create|list|delete <id>|export <id> <volume> <image_path> <key>\n", argv[0]);
         return 1;
     }
 
@@ -65,6 +128,261 @@ int main(int argc, char *argv[])
         return 0;
     }
 
+    if (strcmp(argv[1], "mkfs") == 0)
+    {
+        if (argc < 4)
+        {
+            printf("Usage: %s mkfs <superblock_path> <key> [merkle_fanout] [sha256|blake2b|blake3]\n", argv[0]);
+            return 1;
+        }
+        // the root inode is encrypted with the key while the filesystem is created
+        extern unsigned char key[crypto_aead_aes256gcm_KEYBYTES];
+        if (load_key(key, argv[3]) != 0)
+        {
+            return 1;
+        }
+        // the fan-out of the merkle trees is fixed when the filesystem is created
+        sb.merkle_fanout = argc > 4 ? atoi(argv[4]) : MERKLE_DEFAULT_FANOUT;
+        if (sb.merkle_fanout < 2 || sb.merkle_fanout > MERKLE_MAX_FANOUT)
+        {
+            printf("Merkle fan-out must be between 2 and %d\n", MERKLE_MAX_FANOUT);
+            return 1;
+        }
+        // so is the integrity hash of blocks and tree nodes
+        sb.hash_algorithm = argc > 5 ? parse_hash_algorithm(argv[5]) : HASH_SHA256;
+        if (sb.hash_algorithm < 0 || !hash_algorithm_available(sb.hash_algorithm))
+        {
+            printf("Hash algorithm %s is not available\n", argv[5]);
+            return 1;
+        }
+        if (access(argv[2], F_OK) == 0)
+        {
+            printf("Superblock %s already exists\n", argv[2]);
+            return 1;
+        }
+        extern char superblock_path[MAX_PATH_LENGTH];
+        strcpy(superblock_path, argv[2]);
+        load_or_create_superblock(superblock_path, &sb);
+        return 0;
+    }
+
+    if (strcmp(argv[1], "rebuild") == 0)
+    {
+        if (argc < 4)
+        {
+            printf("Usage: %s rebuild <superblock_path> <key>\n", argv[0]);
+            return 1;
+        }
+        // recompute every volume tree from the stored blocks, e.g. after a crash
+        extern unsigned char key[crypto_aead_aes256gcm_KEYBYTES];
+        load_key(key, argv[3]);
+        extern char superblock_path[MAX_PATH_LENGTH];
+        strcpy(superblock_path, argv[2]);
+        load_or_create_superblock(superblock_path, &sb);
+        if (get_hash_algorithm() != sb.hash_algorithm)
+        {
+            printf("Hash algorithm %s is not available\n", hash_algorithm_name(sb.hash_algorithm));
+            return 1;
+        }
+        rebuild_merkle_trees(sb.volume_count);
+        return 0;
+    }
+
+    if (strcmp(argv[1], "proof") == 0)
+    {
+        if (argc < 6)
+        {
+            printf("Usage: %s proof <superblock_path> <volume> <blocks> <proof_path>\n", argv[0]);
+            return 1;
+        }
+        // one proof covers the listed blocks of one volume tree, indices are within the volume
+        if (access(argv[2], F_OK) != 0)
+        {
+            printf("Superblock %s not found\n", argv[2]);
+            return 1;
+        }
+        extern char superblock_path[MAX_PATH_LENGTH];
+        strcpy(superblock_path, argv[2]);
+        load_or_create_superblock(superblock_path, &sb);
+        if (get_hash_algorithm() != sb.hash_algorithm)
+        {
+            printf("Hash algorithm %s is not available\n", hash_algorithm_name(sb.hash_algorithm));
+            return 1;
+        }
+
+        int volume = atoi(argv[3]);
+        if (volume < 0 || volume >= sb.volume_count)
+        {
+            printf("Volume %s does not exist\n", argv[3]);
+            return 1;
+        }
+        int *blocks;
+        int count = parse_block_list(argv[4], &blocks);
+        if (count <= 0)
+        {
+            printf("Invalid block list %s\n", argv[4]);
+            return 1;
+        }
+
+        MerkleProof *proof = create_merkle_multiproof(get_merkle_tree_for_volume(argv[3]), blocks, count);
+        free(blocks);
+        if (!proof)
+        {
+            printf("Unable to create a proof for blocks %s of volume %d\n", argv[4], volume);
+            return 1;
+        }
+        proof->header.volume = volume;
+        bool saved = save_merkle_proof(proof, argv[5]);
+        printf("Proof for %u blocks with %u hashes written to %s\n", proof->header.index_count,
+               proof->header.hash_count, argv[5]);
+        free_merkle_proof(proof);
+        return saved ? 0 : 1;
+    }
+
+    if (strcmp(argv[1], "verifyproof") == 0)
+    {
+        if (argc < 4)
+        {
+            printf("Usage: %s verifyproof <proof_path> <root_hex|superblock_path>\n", argv[0]);
+            return 1;
+        }
+        MerkleProof *proof = load_merkle_proof(argv[2]);
+        if (!proof)
+        {
+            return 1;
+        }
+
+        // the root is given in hex, or taken from the volume roots recorded in a superblock
+        unsigned char root_hash[SHA256_DIGEST_LENGTH];
+        if (strlen(argv[3]) == 2 * SHA256_DIGEST_LENGTH && strspn(argv[3], "0123456789abcdefABCDEF") == 2 * SHA256_DIGEST_LENGTH)
+        {
+            hex_to_hash(argv[3], root_hash, SHA256_DIGEST_LENGTH);
+        }
+        else if (access(argv[3], F_OK) == 0)
+        {
+            extern char superblock_path[MAX_PATH_LENGTH];
+            strcpy(superblock_path, argv[3]);
+            load_or_create_superblock(superblock_path, &sb);
+            if (!verify_root_of_roots() || proof->header.volume >= (uint32_t)sb.volume_count)
+            {
+                printf("Superblock %s has no verified root for volume %u\n", argv[3], proof->header.volume);
+                free_merkle_proof(proof);
+                return 1;
+            }
+            memcpy(root_hash, sb.volume_roots[proof->header.volume], SHA256_DIGEST_LENGTH);
+        }
+        else
+        {
+            printf("%s is neither a root hash nor a superblock\n", argv[3]);
+            free_merkle_proof(proof);
+            return 1;
+        }
+
+        if (!set_hash_algorithm(proof->header.hash_algorithm))
+        {
+            printf("Hash algorithm %s is not available\n", hash_algorithm_name(proof->header.hash_algorithm));
+            free_merkle_proof(proof);
+            return 1;
+        }
+        bool verified = verify_merkle_multiproof(proof, NULL, root_hash);
+        printf("Proof for %u blocks of volume %u: %s\n", proof->header.index_count, proof->header.volume,
+               verified ? "Verified" : "Not Verified");
+        free_merkle_proof(proof);
+        return verified ? 0 : 1;
+    }
+
+    if (strcmp(argv[1], "snapshot") == 0)
+    {
+        if (argc < 4 || access(argv[2], F_OK) != 0)
+        {
+            printf("Usage: %s snapshot <superblock_path> create|list|delete <id>|export <id> <volume> <image_path> <key>\n", argv[0]);
+            return 1;
+        }
+        // a mounted filesystem rewrites the snapshot table from memory, so it takes and deletes its
+        // snapshots itself. Listing and export also work while it is mounted.
+        extern char superblock_path[MAX_PATH_LENGTH];
+        strcpy(superblock_path, argv[2]);
+        if ((strcmp(argv[3], "create") == 0 || strcmp(argv[3], "delete") == 0) && !lock_superblock(superblock_path))
+        {
+            printf("Superblock %s is in use by a mount, run: setfattr -n %s -v \"%s%s%s\" <mountpoint>\n", argv[2], SNAPSHOT_XATTR,
+                   argv[3], argc > 4 ? " " : "", argc > 4 ? argv[4] : "");
+            return 1;
+        }
+        load_or_create_superblock(superblock_path, &sb);
+
+        if (strcmp(argv[3], "create") == 0)
+        {
+            int id = snapshot_create();
+            if (id < 0)
+            {
+                return 1;
+            }
+            printf("Snapshot %d created\n", id);
+            return 0;
+        }
+
+        if (strcmp(argv[3], "list") == 0)
+        {
+            for (int s = 0; s < MAX_SNAPSHOTS; s++)
+            {
+                if (sb.snapshots[s].id)
+                {
+                    char root_hex[2 * SHA256_DIGEST_LENGTH + 1];
+                    hash_to_hex(sb.snapshots[s].root_of_roots, root_hex, SHA256_DIGEST_LENGTH);
+                    time_t created = (time_t)sb.snapshots[s].created;
+                    char created_text[32];
+                    strftime(created_text, sizeof(created_text), "%Y-%m-%d %H:%M:%S", localtime(&created));
+                    printf("%u  %s  %u volumes  %s\n", sb.snapshots[s].id, created_text, sb.snapshots[s].volume_count, root_hex);
+                }
+            }
+            return 0;
+        }
+
+        if (strcmp(argv[3], "delete") == 0 && argc > 4)
+        {
+            return snapshot_delete(strtoul(argv[4], NULL, 10)) ? 0 : 1;
+        }
+
+        if (strcmp(argv[3], "export") == 0 && argc > 7)
+        {
+            // the decrypted blocks of one volume as they were when the snapshot was taken
+            extern unsigned char key[crypto_aead_aes256gcm_KEYBYTES];
+            load_key(key, argv[7]);
+            uint32_t id = strtoul(argv[4], NULL, 10);
+            int volume = atoi(argv[5]);
+            const snapshot_info_t *info = snapshot_find(id);
+            if (!info || volume < 0 || volume >= (int)info->volume_count)
+            {
+                printf("Volume %s is not in snapshot %s\n", argv[5], argv[4]);
+                return 1;
+            }
+            FILE *image = fopen(argv[6], "wb");
+            if (!image)
+            {
+                printf("Unable to create %s\n", argv[6]);
+                return 1;
+            }
+            int failed = 0;
+            unsigned char block[BLOCK_SIZE];
+            for (int b = 0; b < DATA_BLOCKS_PER_VOLUME; b++)
+            {
+                if (!snapshot_read_block(id, volume * DATA_BLOCKS_PER_VOLUME + b, block))
+                {
+                    memset(block, 0, BLOCK_SIZE);
+                    failed++;
+                }
+                fwrite(block, BLOCK_SIZE, 1, image);
+            }
+            fclose(image);
+            snapshot_close();
+            printf("Volume %d of snapshot %u written to %s, %d blocks not verified\n", volume, id, argv[6], failed);
+            return failed ? 1 : 0;
+        }
+
+        printf("Unknown snapshot command %s\n", argv[3]);
+        return 1;
+    }
+
     // last argument is the key
 
     extern unsigned char key[crypto_aead_aes256gcm_KEYBYTES];
@@ -111,6 +429,17 @@ int main(int argc, char *argv[])
     {
         // Attempt to load the superblock, or create a new one if it doesn't exist
         load_or_create_superblock(superblock_path, &sb);
+        if (!lock_superblock(superblock_path))
+        {
+            printf("Superblock %s is already in use\n", superblock_path);
+            return 1;
+        }
+    }
+
+    if (get_hash_algorithm() != sb.hash_algorithm)
+    {
+        printf("Hash algorithm %s is not available\n", hash_algorithm_name(sb.hash_algorithm));
+        return 1;
     }
 
     printf("main: superblock loaded, mounting\n");
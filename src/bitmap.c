@@ -1,6 +1,9 @@
 // File: bitmap.c
 #include "bitmap.h"
+#include "volume.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include <string.h>
 #include <stdbool.h>
 
@@ -8,13 +11,10 @@
 void read_bitmap(char *volume_id, bitmap_t *bmp)
 {
     printf("bitmap: Reading bitmap for %s\n", volume_id);
-    char bmp_filename[256];
-    sprintf(bmp_filename, "bmp_%s.bin", volume_id);
-    FILE *file = fopen(bmp_filename, "rb");
-    if (file)
+    int fd = volume_file_fd(atoi(volume_id), VOLUME_BITMAP_FILE);
+    if (fd >= 0)
     {
-        fread(bmp, sizeof(bitmap_t), 1, file);
-        fclose(file);
+        pread(fd, bmp, sizeof(bitmap_t), 0);
     }
     else
     {
@@ -26,13 +26,10 @@ void read_bitmap(char *volume_id, bitmap_t *bmp)
 void write_bitmap(char *volume_id, const bitmap_t *bmp)
 {
     printf("bitmap: Writing bitmap for %s\n", volume_id);
-    char bmp_filename[256];
-    sprintf(bmp_filename, "bmp_%s.bin", volume_id);
-    FILE *file = fopen(bmp_filename, "wb");
-    if (file)
+    int fd = volume_file_fd(atoi(volume_id), VOLUME_BITMAP_FILE);
+    if (fd >= 0)
     {
-        fwrite(bmp, sizeof(bitmap_t), 1, file);
-        fclose(file);
+        pwrite(fd, bmp, sizeof(bitmap_t), 0);
     }
     else
     {
@@ -0,0 +1,204 @@
+// File: file_tree.c
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "file_tree.h"
+#include "volume.h"
+
+static file_tree_t file_trees[FILE_TREE_SLOTS];
+static pthread_once_t file_trees_once = PTHREAD_ONCE_INIT;
+static bool trees_enabled = false;
+
+static void init_file_trees(void)
+{
+    for (int i = 0; i < FILE_TREE_SLOTS; i++)
+    {
+        pthread_mutex_init(&file_trees[i].lock, NULL);
+        file_trees[i].inode_index = i;
+        file_trees[i].tree = NULL;
+    }
+}
+
+static file_tree_t *file_tree_slot(int inode_index)
+{
+    if (inode_index < 0 || inode_index >= FILE_TREE_SLOTS)
+    {
+        return NULL;
+    }
+    pthread_once(&file_trees_once, init_file_trees);
+    return &file_trees[inode_index];
+}
+
+// Files written while file trees are enabled get one. A file that has a tree keeps it up to date
+// either way, so its root never falls behind its blocks.
+void file_trees_enable(bool enabled)
+{
+    if (enabled && inode_record_size() < sizeof(inode))
+    {
+        printf("file_tree: Inodes of this filesystem have no room for a file root, file trees stay off\n");
+        return;
+    }
+    trees_enabled = enabled;
+}
+
+bool file_trees_enabled(void)
+{
+    return trees_enabled;
+}
+
+// Tree over the blocks of a file built from the leaves of the volume trees. Each leaf is verified
+// up to its volume root, so the tree is as trustworthy as the volume trees.
+static MerkleTree *build_file_tree(int inode_index, const inode *node)
+{
+    MerkleTree *tree = create_empty_merkle_tree(MAX_DATABLOCKS, merkle_fanout());
+    if (!tree)
+    {
+        return NULL;
+    }
+
+    int positions[MAX_DATABLOCKS];
+    unsigned char block_hashes[MAX_DATABLOCKS][SHA256_DIGEST_LENGTH];
+    int count = MIN(node->num_datablocks, MAX_DATABLOCKS);
+    for (int i = 0; i < count; i++)
+    {
+        if (!read_block_leaf(node->datablocks[i], block_hashes[i]))
+        {
+            printf("file_tree: Block %d of inode %d does not verify against its volume tree\n", i, inode_index);
+            free_merkle_tree(tree);
+            return NULL;
+        }
+        positions[i] = i;
+    }
+    update_merkle_leaves(tree, positions, block_hashes, count);
+    return tree;
+}
+
+static bool file_tree_matches(const file_tree_t *file_tree, const inode *node)
+{
+    return file_tree->tree && compare_hashes(merkle_root_hash(file_tree->tree), node->file_root);
+}
+
+// Lock the tree of a file, loading it on first use, and bring node up to date with it. A file
+// without a tree gets one when adopt is set and file trees are enabled, its root is then taken from
+// the volume trees and the caller writes the inode. NULL if the file has no tree or its root does
+// not match the volume trees, the caller then verifies against the volume trees alone.
+file_tree_t *open_file_tree(int inode_index, inode *node, bool adopt)
+{
+    file_tree_t *file_tree = file_tree_slot(inode_index);
+    bool adopting = !node->has_file_tree;
+    if (!file_tree || node->is_directory || (adopting && !(adopt && trees_enabled)))
+    {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&file_tree->lock);
+    if (!adopting)
+    {
+        if (file_tree_matches(file_tree, node))
+        {
+            return file_tree;
+        }
+        // a write may have changed the inode since the caller read it
+        read_inode(inode_index, node);
+        if (!node->has_file_tree)
+        {
+            pthread_mutex_unlock(&file_tree->lock);
+            return NULL;
+        }
+        if (file_tree_matches(file_tree, node))
+        {
+            return file_tree;
+        }
+    }
+
+    free_merkle_tree(file_tree->tree);
+    file_tree->tree = build_file_tree(inode_index, node);
+    if (file_tree->tree && adopting)
+    {
+        printf("file_tree: Inode %d now has a file tree\n", inode_index);
+        node->has_file_tree = 1;
+        memcpy(node->file_root, merkle_root_hash(file_tree->tree), SHA256_DIGEST_LENGTH);
+    }
+    else if (file_tree->tree && !file_tree_matches(file_tree, node))
+    {
+        printf("file_tree: Root of inode %d does not match its volume trees\n", inode_index);
+        free_merkle_tree(file_tree->tree);
+        file_tree->tree = NULL;
+    }
+
+    if (!file_tree->tree)
+    {
+        pthread_mutex_unlock(&file_tree->lock);
+        return NULL;
+    }
+    return file_tree;
+}
+
+void close_file_tree(file_tree_t *file_tree)
+{
+    if (file_tree)
+    {
+        pthread_mutex_unlock(&file_tree->lock);
+    }
+}
+
+// Set the leaves of written blocks and keep the new root in node, the caller writes the inode
+void update_file_tree(file_tree_t *file_tree, inode *node, const int *positions, unsigned char (*block_hashes)[SHA256_DIGEST_LENGTH], int count)
+{
+    update_merkle_leaves(file_tree->tree, positions, block_hashes, count);
+    memcpy(node->file_root, merkle_root_hash(file_tree->tree), SHA256_DIGEST_LENGTH);
+}
+
+// Build the tree again after blocks were added or freed without it, e.g. by truncate. The old
+// tree is kept if a block does not verify against its volume tree.
+void rebuild_file_tree(file_tree_t *file_tree, inode *node)
+{
+    MerkleTree *tree = build_file_tree(file_tree->inode_index, node);
+    if (!tree)
+    {
+        return;
+    }
+    free_merkle_tree(file_tree->tree);
+    file_tree->tree = tree;
+    memcpy(node->file_root, merkle_root_hash(tree), SHA256_DIGEST_LENGTH);
+}
+
+// Read count blocks of a file from block first, stored next to each other in one volume, and
+// verify their leaves against the root in node instead of the volume tree
+bool read_file_blocks_checked(file_tree_t *file_tree, const inode *node, int first, int count, void *buf)
+{
+    unsigned char(*block_hashes)[SHA256_DIGEST_LENGTH] = malloc(count * SHA256_DIGEST_LENGTH);
+    if (!block_hashes)
+    {
+        return false;
+    }
+
+    bool verified = read_volume_blocks_hashed(node->datablocks[first], count, buf, block_hashes) &&
+                    verify_merkle_range(file_tree->tree, first, count, block_hashes, node->file_root);
+    free(block_hashes);
+    return verified;
+}
+
+// Drop the tree of a deleted file, its inode may be reused by another file
+void forget_file_tree(int inode_index)
+{
+    file_tree_t *file_tree = file_tree_slot(inode_index);
+    if (!file_tree)
+    {
+        return;
+    }
+    pthread_mutex_lock(&file_tree->lock);
+    free_merkle_tree(file_tree->tree);
+    file_tree->tree = NULL;
+    pthread_mutex_unlock(&file_tree->lock);
+}
+
+void free_file_trees(void)
+{
+    for (int i = 0; i < FILE_TREE_SLOTS; i++)
+    {
+        forget_file_tree(i);
+    }
+}
@@ -12,6 +12,10 @@
 #include "fs_operations.h"
 #include "volume.h"
 #include "cloud_storage.h"
+#include "scrub.h"
+#include "snapshot.h"
+#include "merkle_updater.h"
+#include "file_tree.h"
 
 // function pointer type def for allocation functions
 typedef int (*alloc_func)(bitmap_t *bmp, char *volume_id);
@@ -62,7 +66,7 @@ int manage_volume_allocation(superblock_t *sb, char *volume_id, void *bmp, alloc
             create_volume_files_local(volume_num, sb);
             sprintf(volume_id_new, "%d", volume_num);
             bitmap_t bmp_new;
-            memset(&bmp_new, 0, sizeof(bmp));
+            memset(&bmp_new, 0, sizeof(bmp_new));
             //  set inode 0 as used data node 0 as used to avoid overwriting root inode
             set_bit(bmp_new.inode_bmp, 0);     // never used for expansion safety 0*(volid) = 0
             set_bit(bmp_new.datablock_bmp, 0); // never used for expansion safety
@@ -70,13 +74,7 @@ int manage_volume_allocation(superblock_t *sb, char *volume_id, void *bmp, alloc
             inode_index = funcPoint(&bmp_new, volume_id_new);
             printf("fs_op: dynamic_alloc: inode_index: %d\n", inode_index);
             //  store superblock
-            extern char superblock_path[MAX_PATH_LENGTH];
-            FILE *file = fopen(superblock_path, "wb+");
-            if (file)
-            {
-                fwrite(sb, sizeof(superblock_t), 1, file);
-                fclose(file);
-            }
+            write_superblock(sb);
             if (inode_index != -1)
             {
                 strcpy(volume_id, volume_id_new);
@@ -118,6 +116,7 @@ int fs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
     // Initialize the new inode
     inode new_inode;
     init_inode(&new_inode, path, mode);
+    new_inode.has_file_tree = file_trees_enabled() && !new_inode.is_directory; // the empty root is all zero
 
     // Write the new inode to the inode file
     write_inode(inode_index, &new_inode);
@@ -160,6 +159,9 @@ int fs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_
         return -EISDIR; // Is a directory, not a file
     }
 
+    // a file with a merkle tree of its own is verified against it instead of the volume trees
+    file_tree_t *file_tree = open_file_tree(inode_index, &file_inode, false);
+
     size_t bytes_read = 0;
     size_t remaining = size;
     off_t pos = offset;
@@ -169,24 +171,67 @@ int fs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_
     {
         int block_index = pos / BLOCK_SIZE;
         off_t block_offset = pos % BLOCK_SIZE;
-        size_t bytes_to_read = BLOCK_SIZE - block_offset < remaining ? BLOCK_SIZE - block_offset : remaining;
 
         if (block_index >= file_inode.num_datablocks)
         {
             break; // Trying to read beyond the last data block
         }
 
-        char block_data[BLOCK_SIZE];
+        // blocks stored next to each other in one volume are read and verified as one run
+        int last_block = (pos + remaining - 1) / BLOCK_SIZE;
+        int run = 1;
+        while (block_index + run <= last_block && block_index + run < file_inode.num_datablocks &&
+               file_inode.datablocks[block_index + run] == file_inode.datablocks[block_index] + run &&
+               (file_inode.datablocks[block_index] + run) % DATA_BLOCKS_PER_VOLUME != 0)
+        {
+            run++;
+        }
+
+        char *run_data = malloc(run * BLOCK_SIZE);
+        if (!run_data)
+        {
+            close_file_tree(file_tree);
+            return bytes_read > 0 ? (int)bytes_read : -ENOMEM;
+        }
+
+        if (file_tree)
+        {
+            if (!read_file_blocks_checked(file_tree, &file_inode, block_index, run, run_data))
+            {
+                printf("fs_op: read: Integrity check failed for blocks %d to %d of inode %d\n", block_index,
+                       block_index + run - 1, inode_index);
+            }
+        }
         //  determine volume_id based on file_inode.datablocks[block_index]
-        read_volume_block(file_inode.datablocks[block_index], block_data);
+        else if (run == 1)
+        {
+            read_volume_block(file_inode.datablocks[block_index], run_data);
+        }
+        else
+        {
+            read_volume_blocks(file_inode.datablocks[block_index], run, run_data);
+        }
+
+        // a volume whose tree was refused when it was loaded has nothing its blocks verify against
+        if (volume_tree_rejected(file_inode.datablocks[block_index] / DATA_BLOCKS_PER_VOLUME))
+        {
+            printf("fs_op: read: Volume %d of inode %d has no trusted merkle tree\n",
+                   file_inode.datablocks[block_index] / DATA_BLOCKS_PER_VOLUME, inode_index);
+            free(run_data);
+            close_file_tree(file_tree);
+            return bytes_read > 0 ? (int)bytes_read : -EIO;
+        }
 
-        memcpy(buf + bytes_read, block_data + block_offset, bytes_to_read);
+        size_t bytes_to_read = run * BLOCK_SIZE - block_offset < remaining ? run * BLOCK_SIZE - block_offset : remaining;
+        memcpy(buf + bytes_read, run_data + block_offset, bytes_to_read);
+        free(run_data);
 
         bytes_read += bytes_to_read;
         remaining -= bytes_to_read;
         pos += bytes_to_read;
     }
 
+    close_file_tree(file_tree);
     return bytes_read;
 }
 
@@ -215,6 +260,27 @@ int fs_write(const char *path, const char *buf, size_t size, off_t offset, struc
     size_t bytes_written = 0;
     off_t pos = offset;
 
+    // merkle leaves of the written blocks are queued together after the loop
+    int max_blocks = (offset % BLOCK_SIZE + size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int *written_blocks = malloc(max_blocks * sizeof(int));
+    int *written_positions = malloc(max_blocks * sizeof(int));
+    unsigned char(*written_hashes)[SHA256_DIGEST_LENGTH] = malloc(max_blocks * sizeof(*written_hashes));
+    int num_written = 0;
+    if (max_blocks > 0 && (!written_blocks || !written_positions || !written_hashes))
+    {
+        free(written_blocks);
+        free(written_positions);
+        free(written_hashes);
+        return -ENOMEM;
+    }
+
+    // the tree of the file stays locked until its root is in the written inode, so writes to
+    // other files do not wait for it. Reads of the file verify against its tree, so the volume
+    // leaves are left to the updater thread and the write does not wait for merkle_lock.
+    file_tree_t *file_tree = open_file_tree(inode_index, &file_inode, true);
+
+    // a snapshot waits until the written blocks and their merkle leaves agree again
+    snapshot_write_begin();
     char volume_id_datablocks[9] = "0";
     while (bytes_written < size)
     {
@@ -235,7 +301,21 @@ int fs_write(const char *path, const char *buf, size_t size, off_t offset, struc
             allocate_new_block = 1;
 
             if (new_block_index == -1)
+            {
+                merkle_updater_queue(written_blocks, written_hashes, num_written, file_tree != NULL);
+                snapshot_write_end();
+                if (file_tree)
+                {
+                    // the blocks written so far changed, the file root has to follow them
+                    update_file_tree(file_tree, &file_inode, written_positions, written_hashes, num_written);
+                    write_inode(inode_index, &file_inode);
+                    close_file_tree(file_tree);
+                }
+                free(written_blocks);
+                free(written_positions);
+                free(written_hashes);
                 return -ENOSPC; // No space left
+            }
 
             // datablock index is stored as volume_id * DATA_BLOCKS_PER_VOLUME + block_index it is handled in write and read functions
             file_inode.datablocks[block_index] = new_block_index + DATA_BLOCKS_PER_VOLUME * atoi(volume_id_datablocks);
@@ -252,12 +332,24 @@ int fs_write(const char *path, const char *buf, size_t size, off_t offset, struc
 
         // Copy data to block
         memcpy(block_data + block_offset, buf + bytes_written, bytes_to_write);
-        write_volume_block(file_inode.datablocks[block_index], block_data, BLOCK_SIZE);
+        write_volume_block_no_update(file_inode.datablocks[block_index], block_data, BLOCK_SIZE, written_hashes[num_written]);
+        written_blocks[num_written] = file_inode.datablocks[block_index];
+        written_positions[num_written++] = block_index;
 
         bytes_written += bytes_to_write;
         pos += bytes_to_write;
     }
 
+    merkle_updater_queue(written_blocks, written_hashes, num_written, file_tree != NULL);
+    snapshot_write_end();
+    if (file_tree)
+    {
+        update_file_tree(file_tree, &file_inode, written_positions, written_hashes, num_written);
+    }
+    free(written_blocks);
+    free(written_positions);
+    free(written_hashes);
+
     // Update file size
     if (offset + size > file_inode.size)
     {
@@ -265,6 +357,7 @@ int fs_write(const char *path, const char *buf, size_t size, off_t offset, struc
     }
     printf("fs_op: write: file_inode.size: %ld\n", file_inode.size);
     write_inode(inode_index, &file_inode);
+    close_file_tree(file_tree);
 
     return bytes_written;
 }
@@ -292,6 +385,8 @@ int fs_truncate(const char *path, off_t newsize)
         return -EISDIR; // Cannot truncate a directory
     }
 
+    file_tree_t *file_tree = open_file_tree(inode_index, &file_inode, false);
+
     bitmap_t bmp;
     if (newsize < file_inode.size)
     {
@@ -320,7 +415,10 @@ int fs_truncate(const char *path, off_t newsize)
         {
             int new_block_index = manage_volume_allocation(&sb, volume_id, &bmp, allocate_data_block);
             if (new_block_index == -1)
+            {
+                close_file_tree(file_tree);
                 return -ENOSPC; // No space left for new blocks
+            }
 
             file_inode.datablocks[i] = new_block_index + DATA_BLOCKS_PER_VOLUME * atoi(volume_id);
             file_inode.num_datablocks += 1;
@@ -331,9 +429,16 @@ int fs_truncate(const char *path, off_t newsize)
         }
     }
 
+    // blocks were freed or added without the file tree, it is built again from the volume trees
+    if (file_tree)
+    {
+        rebuild_file_tree(file_tree, &file_inode);
+    }
+
     // Update the inode size and write back
     file_inode.size = newsize;
     write_inode(inode_index, &file_inode);
+    close_file_tree(file_tree);
 
     return 0; // Success
 }
@@ -519,6 +624,7 @@ int fs_unlink(const char *path)
     // Mark the inode as free
     memset(&target_inode, 0, sizeof(inode));
     write_inode(inode_index, &target_inode);
+    forget_file_tree(inode_index);
 
     // Note: doesn't handle updating the parent directory's children list.
     //  need to remove the inode from the parent's children list.
@@ -526,6 +632,162 @@ int fs_unlink(const char *path)
     return 0; // Success
 }
 
+// Copy an attribute value, a size of 0 only asks for its length
+static int xattr_value(const char *text, char *value, size_t size)
+{
+    size_t length = strlen(text);
+    if (size == 0)
+    {
+        return length;
+    }
+    if (size < length)
+    {
+        return -ERANGE;
+    }
+    memcpy(value, text, length);
+    return length;
+}
+
+// The root of the merkle tree of a file is a hash of its whole content. Loading the tree checks the
+// root against the volume trees, so reading the attribute also verifies it.
+// SCRUB_XATTR on the root reports the position and counts of the scrubber.
+int fs_getxattr(const char *path, const char *name, char *value, size_t size)
+{
+    printf("fs_op: getxattr\n");
+
+    if (strcmp(name, SCRUB_XATTR) == 0 && strcmp(path, "/") == 0)
+    {
+        scrub_progress_t progress;
+        scrub_get_progress(&progress);
+        char text[160];
+        snprintf(text, sizeof(text), "volume=%u block=%u passes=%u checked=%lu errors=%lu last_errors=%lu paused=%u",
+                 progress.volume, progress.block, progress.passes, (unsigned long)progress.blocks_checked,
+                 (unsigned long)progress.errors, (unsigned long)progress.last_errors, progress.paused);
+        return xattr_value(text, value, size);
+    }
+    if (strcmp(name, FILE_TREE_ROOT_XATTR) != 0)
+    {
+        return -ENODATA;
+    }
+
+    int inode_index = find_inode_index_by_path(path);
+    if (inode_index < 0)
+    {
+        return -ENOENT;
+    }
+
+    inode file_inode;
+    read_inode(inode_index, &file_inode);
+    file_tree_t *file_tree = open_file_tree(inode_index, &file_inode, false);
+    if (!file_tree)
+    {
+        return -ENODATA; // No tree, or its root does not match the volume trees
+    }
+    char root_hex[2 * SHA256_DIGEST_LENGTH + 1];
+    hash_to_hex(file_inode.file_root, root_hex, SHA256_DIGEST_LENGTH);
+    close_file_tree(file_tree);
+    return xattr_value(root_hex, value, size);
+}
+
+// A mounted filesystem takes and deletes its snapshots itself, "create" or "delete <id>" set as
+// SNAPSHOT_XATTR on the root. The offline commands are refused while it holds the superblock.
+// "pause" or "resume" set as SCRUB_XATTR on the root control the scrubber.
+int fs_setxattr(const char *path, const char *name, const char *value, size_t size, int flags)
+{
+    printf("fs_op: setxattr\n");
+    (void)flags;
+
+    if (strcmp(name, SNAPSHOT_XATTR) != 0 && strcmp(name, SCRUB_XATTR) != 0)
+    {
+        return -ENOTSUP;
+    }
+    char command[32];
+    if (strcmp(path, "/") != 0 || size >= sizeof(command))
+    {
+        return -EINVAL;
+    }
+    memcpy(command, value, size);
+    command[size] = '\0';
+
+    if (strcmp(name, SCRUB_XATTR) == 0)
+    {
+        if (strcmp(command, "pause") == 0)
+        {
+            scrub_pause();
+            return 0;
+        }
+        if (strcmp(command, "resume") == 0)
+        {
+            scrub_resume();
+            return 0;
+        }
+        return -EINVAL;
+    }
+    if (strcmp(command, "create") == 0)
+    {
+        return snapshot_create() > 0 ? 0 : -ENOSPC; // The snapshot table is full
+    }
+    if (strncmp(command, "delete ", 7) == 0)
+    {
+        return snapshot_delete(strtoul(command + 7, NULL, 10)) ? 0 : -ENOENT;
+    }
+    return -EINVAL;
+}
+
+// Start the background scrubber when ENCRYPTFS_SCRUB_RATE sets its bytes per second, it is off by default.
+// ENCRYPTFS_MERKLE_PINNED_LEVELS and ENCRYPTFS_MERKLE_CACHE_KB bound the memory of each merkle tree.
+// ENCRYPTFS_MERKLE_LAG_MS is how long written leaves may wait for the merkle updater, 0 turns it off.
+// ENCRYPTFS_FILE_TREES=1 gives files written from now on a merkle tree of their own.
+void *fs_init(struct fuse_conn_info *conn)
+{
+    printf("fs_op: init\n");
+
+    uint64_t rate = 0;
+    const char *rate_env = getenv("ENCRYPTFS_SCRUB_RATE");
+    if (rate_env)
+    {
+        rate = strtoull(rate_env, NULL, 10);
+    }
+    if (rate > 0)
+    {
+        scrub_start(rate);
+    }
+
+    // memory of each loaded merkle tree: its top levels and a budget of lower level pages
+    const char *pinned_env = getenv("ENCRYPTFS_MERKLE_PINNED_LEVELS");
+    const char *cache_env = getenv("ENCRYPTFS_MERKLE_CACHE_KB");
+    if (pinned_env || cache_env)
+    {
+        merkle_set_residency(pinned_env ? atoi(pinned_env) : MERKLE_DEFAULT_PINNED_LEVELS,
+                             cache_env ? strtoull(cache_env, NULL, 10) * 1024 : MERKLE_DEFAULT_CACHE_SIZE);
+    }
+
+    const char *file_trees_env = getenv("ENCRYPTFS_FILE_TREES");
+    if (file_trees_env)
+    {
+        file_trees_enable(atoi(file_trees_env) != 0);
+    }
+
+    // writes of files with a tree hand their volume leaves to the updater even without a lag
+    unsigned int lag_ms = MERKLE_UPDATE_DEFAULT_LAG_MS;
+    const char *lag_env = getenv("ENCRYPTFS_MERKLE_LAG_MS");
+    if (lag_env)
+    {
+        lag_ms = strtoul(lag_env, NULL, 10);
+    }
+    if (lag_ms > 0 || file_trees_enabled())
+    {
+        merkle_updater_start(lag_ms);
+    }
+
+    const char *mmap_env = getenv("ENCRYPTFS_MMAP_READS");
+    if (mmap_env)
+    {
+        volume_mmap_reads_enable(atoi(mmap_env) != 0);
+    }
+    return NULL;
+}
+
 void fs_destroy()
 {
     printf("fs_op: destroy\n");
@@ -535,6 +797,20 @@ void fs_destroy()
 
     extern char remote_superblock_path[MAX_PATH_LENGTH];
 
+    scrub_stop();
+    merkle_updater_stop();
+
+    // write back pending merkle updates before the files are uploaded
+    for (int i = 0; i < sb.volume_count; i++)
+    {
+        checkpoint_merkle_tree(sb.volumes[i].merkle_tree, sb.volumes[i].merkle_path);
+    }
+    report_merkle_memory();
+    free_file_trees();
+    free_merkle_trees();
+    snapshot_close();
+    close_volume_files();
+
     if (sb.vtype == GDRIVE)
     {
         printf("fs_op: destroy: uploading to remote\n");
@@ -604,5 +880,8 @@ const struct fuse_operations fs_operations = {
     .read = fs_read,
     .write = fs_write,
     .truncate = fs_truncate,
+    .getxattr = fs_getxattr,
+    .setxattr = fs_setxattr,
+    .init = fs_init,
     .destroy = fs_destroy,
 };
\ No newline at end of file
@@ -0,0 +1,107 @@
+// File: hash.c
+#include <stdio.h>
+#include <string.h>
+#include <openssl/sha.h>
+#include <sodium.h>
+#ifdef HAVE_BLAKE3
+#include <blake3.h>
+#endif
+
+#include "hash.h"
+#include "sha256_mb.h"
+
+static hash_algorithm current_algorithm = HASH_SHA256;
+
+static const char *hash_names[HASH_ALGORITHM_COUNT] = {"sha256", "blake2b", "blake3"};
+
+bool hash_algorithm_available(hash_algorithm algorithm)
+{
+    switch (algorithm)
+    {
+    case HASH_SHA256:
+    case HASH_BLAKE2B:
+        return true;
+    case HASH_BLAKE3:
+#ifdef HAVE_BLAKE3
+        return true;
+#else
+        return false;
+#endif
+    default:
+        return false;
+    }
+}
+
+// Select the hash used for blocks and tree nodes, the previous one stays when it is not available
+bool set_hash_algorithm(hash_algorithm algorithm)
+{
+    if (!hash_algorithm_available(algorithm))
+    {
+        printf("hash: Hash algorithm %d is not available in this build\n", algorithm);
+        return false;
+    }
+    current_algorithm = algorithm;
+    printf("hash: Using %s\n", hash_algorithm_name(algorithm));
+    return true;
+}
+
+hash_algorithm get_hash_algorithm(void)
+{
+    return current_algorithm;
+}
+
+const char *hash_algorithm_name(hash_algorithm algorithm)
+{
+    return algorithm >= 0 && algorithm < HASH_ALGORITHM_COUNT ? hash_names[algorithm] : "unknown";
+}
+
+// Algorithm with the given name, -1 if there is none
+int parse_hash_algorithm(const char *name)
+{
+    for (int i = 0; i < HASH_ALGORITHM_COUNT; i++)
+    {
+        if (strcmp(name, hash_names[i]) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void hash_digest(const void *input, size_t len, unsigned char *output)
+{
+    switch (current_algorithm)
+    {
+    case HASH_BLAKE2B:
+        crypto_generichash(output, HASH_DIGEST_LENGTH, input, len, NULL, 0);
+        break;
+#ifdef HAVE_BLAKE3
+    case HASH_BLAKE3:
+    {
+        // the library hashes the 1 KB chunks of a block in SIMD lanes
+        blake3_hasher hasher;
+        blake3_hasher_init(&hasher);
+        blake3_hasher_update(&hasher, input, len);
+        blake3_hasher_finalize(&hasher, output, HASH_DIGEST_LENGTH);
+        break;
+    }
+#endif
+    default:
+        SHA256((const unsigned char *)input, len, output);
+        break;
+    }
+}
+
+// Hash count independent messages of the same length, SHA-256 runs them through the multi-buffer kernel
+void hash_digest_many(const unsigned char *const *inputs, size_t len, int count, unsigned char *const *outputs)
+{
+    if (current_algorithm == HASH_SHA256)
+    {
+        sha256_mb(inputs, len, count, outputs);
+        return;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        hash_digest(inputs[i], len, outputs[i]);
+    }
+}
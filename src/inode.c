@@ -1,12 +1,22 @@
 // File: inode.c
 #include "inode.h"
 #include "crypto.h"
+#include "volume.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <libgen.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+
+// Bytes of an inode as stored, older filesystems store inodes without the file tree fields
+size_t inode_record_size(void)
+{
+    return sb.inode_size > 0 && (size_t)sb.inode_size < sizeof(inode) ? (size_t)sb.inode_size : sizeof(inode);
+}
+
 // Read an inode from file
 void read_inode(int inode_index, inode *inode_buf)
 {
@@ -21,27 +31,27 @@ void read_inode(int inode_index, inode *inode_buf)
     int inode_index_in_volume = inode_index % INODES_PER_VOLUME;
 
     printf("inode: Reading inode index in volume %d\n", inode_index_in_volume);
-    char inode_filename[256];
-    sprintf(inode_filename, "inodes_%s.bin", volume_id);
-    FILE *file = fopen(inode_filename, "rb");
-    if (file)
+    int fd = volume_file_fd(volume_id_int, VOLUME_INODES_FILE);
+    if (fd >= 0)
     {
+        size_t record_size = inode_record_size();
         unsigned char encrypted_data[sizeof(inode) + crypto_aead_aes256gcm_ABYTES];
         unsigned long long decrypted_len;
         unsigned char nonce[crypto_aead_aes256gcm_NPUBBYTES];
         extern unsigned char key[crypto_aead_aes256gcm_KEYBYTES];
-        fseek(file, inode_index_in_volume * (sizeof(inode) + sizeof(nonce) + crypto_aead_aes256gcm_ABYTES), SEEK_SET);
-        fread(nonce, sizeof(nonce), 1, file);
-        fread(encrypted_data, sizeof(encrypted_data), 1, file);
+        struct iovec record[2] = {{nonce, sizeof(nonce)}, {encrypted_data, record_size + crypto_aead_aes256gcm_ABYTES}};
+        preadv(fd, record, 2, (off_t)inode_index_in_volume * (record_size + sizeof(nonce) + crypto_aead_aes256gcm_ABYTES));
 
-        if (decrypt_aes_gcm((unsigned char *)inode_buf, &decrypted_len, encrypted_data, sizeof(encrypted_data), nonce, key) != 0)
+        if (decrypt_aes_gcm((unsigned char *)inode_buf, &decrypted_len, encrypted_data, record_size + crypto_aead_aes256gcm_ABYTES, nonce, key) != 0)
         {
             perror("Failed to decrypt inode");
-            fclose(file);
             return;
         }
-
-        fclose(file);
+        if (record_size < sizeof(inode))
+        {
+            // an older record ends with struct padding where the newer fields start
+            memset((char *)inode_buf + offsetof(inode, has_file_tree), 0, sizeof(inode) - offsetof(inode, has_file_tree));
+        }
     }
     else
     {
@@ -65,13 +75,11 @@ void write_inode(int inode_index, const inode *inode_buf)
 
     printf("inode: Writing inode in volume %d\n", volume_id_int);
 
-    char inode_filename[256];
-    sprintf(inode_filename, "inodes_%s.bin", volume_id);
-
     printf("inode: Writing inode %d\n", inode_index_in_volume);
-    FILE *file = fopen(inode_filename, "r+b");
-    if (file)
+    int fd = volume_file_fd(volume_id_int, VOLUME_INODES_FILE);
+    if (fd >= 0)
     {
+        size_t record_size = inode_record_size();
         unsigned char encrypted_data[sizeof(inode) + crypto_aead_aes256gcm_ABYTES];
         unsigned long long ciphertext_len;
         unsigned char nonce[crypto_aead_aes256gcm_NPUBBYTES];
@@ -80,21 +88,18 @@ void write_inode(int inode_index, const inode *inode_buf)
         printf("key %s\n", key);
 
         generate_nonce(nonce);
-        int retFlag = encrypt_aes_gcm(encrypted_data, &ciphertext_len, (unsigned char *)inode_buf, sizeof(inode), nonce, key);
+        int retFlag = encrypt_aes_gcm(encrypted_data, &ciphertext_len, (unsigned char *)inode_buf, record_size, nonce, key);
 
         printf("retFlag %d\n", retFlag);
 
-        if (encrypt_aes_gcm(encrypted_data, &ciphertext_len, (unsigned char *)inode_buf, sizeof(inode), nonce, key) != 0)
+        if (encrypt_aes_gcm(encrypted_data, &ciphertext_len, (unsigned char *)inode_buf, record_size, nonce, key) != 0)
         {
             perror("Failed to encrypt inode");
-            fclose(file);
             return;
         }
 
-        fseek(file, inode_index_in_volume * (sizeof(inode) + sizeof(nonce) + crypto_aead_aes256gcm_ABYTES), SEEK_SET);
-        fwrite(nonce, sizeof(nonce), 1, file);
-        fwrite(encrypted_data, ciphertext_len, 1, file);
-        fclose(file);
+        struct iovec record[2] = {{nonce, sizeof(nonce)}, {encrypted_data, ciphertext_len}};
+        pwritev(fd, record, 2, (off_t)inode_index_in_volume * (record_size + sizeof(nonce) + crypto_aead_aes256gcm_ABYTES));
     }
     else
     {
@@ -154,6 +159,10 @@ void init_inode(inode *node, const char *path, mode_t mode)
     // Initialize the file type and link count
     node->type[0] = '\0'; // Assuming the type needs to be determined elsewhere or is not applicable
     node->num_links = 1;  // A newly created file typically has one link
+
+    // the tree of an empty file has only empty nodes
+    node->has_file_tree = 0;
+    memset(node->file_root, 0, sizeof(node->file_root));
 }
 
 int allocate_inode_bmp(bitmap_t *bmp, char *volume_id)
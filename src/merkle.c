@@ -4,10 +4,26 @@
 #include <stdio.h>
 #include <openssl/sha.h>
 #include <math.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
 
 #include "merkle.h"
+#include "sha256_mb.h"
+#include "hash.h"
 #include "volume.h"
+#include "bitmap.h"
 #include "constants.h"
+#include "crypto.h"
+#include "snapshot.h"
+#include "merkle_updater.h"
+#include "merkle_rcu.h"
+
+// Volumes whose tree file has MERKLE_FILE_DIRTY set, lets writers skip merkle_lock once it is
+static int volume_files_dirty[NUMVOLUMES];
 
 void hash_to_hex(const unsigned char *bin, char *hex, size_t len)
 {
@@ -20,494 +36,2558 @@ void hash_to_hex(const unsigned char *bin, char *hex, size_t len)
     hex[2 * len] = '\0'; // null-terminate the string
 }
 
-MerkleNode *create_merkle_node(const char *hash, MerkleNode *left, MerkleNode *right, int block_index)
+void hex_to_hash(const char *hex, unsigned char *bin, size_t len)
 {
-    MerkleNode *node = malloc(sizeof(MerkleNode));
-    if (node)
+    for (size_t i = 0; i < len; ++i)
     {
-        strcpy(node->hash, hash);
-        node->left = left;
-        node->right = right;
-        node->parent = NULL;
-        node->block_index = block_index;
-        // Set min and max indices
-        node->min_index = (left ? left->min_index : block_index);
-        node->max_index = (right ? right->max_index : block_index);
+        unsigned char byte = 0;
+        for (int j = 0; j < 2; ++j)
+        {
+            char c = hex[2 * i + j];
+            byte <<= 4;
+            if (c >= '0' && c <= '9')
+                byte |= c - '0';
+            else if (c >= 'a' && c <= 'f')
+                byte |= c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F')
+                byte |= c - 'A' + 10;
+        }
+        bin[i] = byte;
     }
-    return node;
 }
 
-void compute_hash(const char *input, char *output)
+// Fill sizes with the number of nodes on each level, leaves first, and return the level count
+int merkle_level_sizes(int num_leaves, int fanout, int *sizes)
 {
-    unsigned char temp_hash[SHA256_DIGEST_LENGTH];
-    SHA256((const unsigned char *)input, strlen(input), temp_hash);
-    hash_to_hex(temp_hash, output, SHA256_DIGEST_LENGTH); // Convert binary hash to hex string
+    int levels = 0;
+    int n = num_leaves;
+    sizes[levels++] = n;
+    while (n > 1 && levels < MERKLE_MAX_LEVELS)
+    {
+        n = (n + fanout - 1) / fanout;
+        sizes[levels++] = n;
+    }
+    return levels;
 }
 
-bool compare_hashes(const char *hash1, const char *hash2)
-{
-    return strcmp(hash1, hash2) == 0; // Use strcmp for string comparison
-}
+// Arena regions are cache line aligned
+#define MERKLE_ARENA_ALIGN 64
 
-void update_merkle_node(MerkleNode *node, const char *new_hash)
+static size_t merkle_arena_align(size_t size)
 {
-    printf("merkle: Updating merkle node\n");
-    memcpy(node->hash, new_hash, 65);
-    printf("merkle: updated Node hash: %s\n", node->hash);
-    // Update the parent nodes
-    while (node->parent)
-    {
-        char concat_hash[130];
-        if (node->parent->left && node->parent->right)
-        {
-            memcpy(concat_hash, node->parent->left->hash, 65);
-            memcpy(concat_hash + 65, node->parent->right->hash, 65);
-        }
-        else
-        {
-            memcpy(concat_hash, node->hash, 65); // Single child scenario
-            memcpy(concat_hash + 65, node->hash, 65);
-        }
-        compute_hash(concat_hash, node->parent->hash);
-        node = node->parent;
-    }
+    return (size + MERKLE_ARENA_ALIGN - 1) & ~(size_t)(MERKLE_ARENA_ALIGN - 1);
 }
 
-MerkleTree *build_merkle_tree(char **block_hashes, int num_blocks)
+// Allocate a tree with num_leaves leaves. Its arena is reserved with room for the node array,
+// the nodes are placed there by merkle_tree_alloc_nodes unless they are read from a mapped file.
+static MerkleTree *merkle_tree_alloc(int num_leaves, int fanout)
 {
-    printf("merkle: Building merkle tree\n");
-
-    if (num_blocks == 0)
+    MerkleTree *tree = malloc(sizeof(MerkleTree));
+    if (!tree)
     {
         return NULL;
     }
 
-    MerkleNode **current_level = malloc(num_blocks * sizeof(MerkleNode *));
-    for (int i = 0; i < num_blocks; i++)
-    {
-        current_level[i] = create_merkle_node(block_hashes[i], NULL, NULL, i);
-    }
-
-    int num_nodes = num_blocks;
-    int depth = 0; // Initialize depth to zero
-
-    while (num_nodes > 1)
+    tree->num_leaves = num_leaves;
+    tree->fanout = fanout;
+    tree->level_count = merkle_level_sizes(num_leaves, fanout, tree->level_size);
+    tree->node_count = 0;
+    for (int l = 0; l < tree->level_count; l++)
     {
-        int next_level_size = (num_nodes + 1) / 2;
-        MerkleNode **next_level = malloc(next_level_size * sizeof(MerkleNode *));
-        depth++; // Each iteration represents building a new level in the tree
-
-        for (int i = 0; i < num_nodes / 2; i++)
-        {
-            char combined_hash[130];
-            memcpy(combined_hash, current_level[2 * i]->hash, 65);
-            memcpy(combined_hash + 65, current_level[2 * i + 1]->hash, 65);
-            char new_hash[65];
-            compute_hash(combined_hash, new_hash);
-            // block index is set to -1 for intermediate nodes
-            next_level[i] = create_merkle_node(new_hash, current_level[2 * i], current_level[2 * i + 1], -1);
-            current_level[2 * i]->parent = next_level[i];
-            current_level[2 * i + 1]->parent = next_level[i];
-        }
-
-        if (num_nodes % 2 == 1)
-        {
-            next_level[next_level_size - 1] = current_level[num_nodes - 1];
-            current_level[num_nodes - 1]->parent = next_level[next_level_size - 1];
-        }
-
-        free(current_level);
-        current_level = next_level;
-        num_nodes = next_level_size;
+        tree->level_offset[l] = tree->node_count;
+        tree->node_count += tree->level_size[l];
     }
 
-    MerkleTree *tree = malloc(sizeof(MerkleTree));
-    if (!tree)
+    size_t nodes_size = merkle_arena_align((size_t)tree->node_count * sizeof(MerkleNode));
+    size_t dirty_size = merkle_arena_align((size_t)tree->node_count * sizeof(int));
+    size_t bitmap_size = merkle_arena_align((tree->node_count + 7) / 8);
+    tree->arena.size = nodes_size + dirty_size + 2 * bitmap_size;
+    void *base = mmap(NULL, tree->arena.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED)
     {
-        free(current_level); // Ensure to free memory in case of allocation failure
+        free(tree);
         return NULL;
     }
-    tree->root = current_level[0];
-    tree->depth = depth; // Set the depth of the tree
-
-    free(current_level);
+    tree->arena.base = base;
+
+    tree->nodes = NULL;
+    tree->map = NULL;
+    tree->map_size = 0;
+    tree->data_offset = sizeof(merkle_file_header_t);
+
+    // the dedup bitmap keeps every node in the dirty list at most once, so it never grows
+    tree->dirty = (int *)(tree->arena.base + nodes_size);
+    tree->dirty_map = tree->arena.base + nodes_size + dirty_size;
+    tree->verified_map = tree->dirty_map + bitmap_size;
+    tree->dirty_count = 0;
+    tree->fd = -1;
+    tree->file_dirty = false;
+    tree->last_access = 0;
+    tree->volume = -1;
+    memset(&tree->pages, 0, sizeof(tree->pages));
+    tree->pages.free = -1;
+    tree->pages.head = -1;
+    tree->pages.tail = -1;
+    tree->page_log_state = 0;
+    tree->version = NULL;
     return tree;
 }
 
-bool verify_merkle_path(MerkleNode *leaf_node, const char *expected_root_hash, char decrypted_hash[65])
+// Place the node array at the start of the arena. Every node starts empty and pages are only
+// backed by memory once a node on them is written.
+static void merkle_tree_alloc_nodes(MerkleTree *tree)
 {
-    printf("merkle: Verifying merkle path\n");
-
-    MerkleNode *current = leaf_node;
-    char current_hash[65] = {0};
-    memcpy(current_hash, decrypted_hash, 65);
-
-    while (current->parent)
-    {
-        MerkleNode *sibling = (current == current->parent->left) ? current->parent->right : current->parent->left;
-        char concat_hash[130];
-        if (current == current->parent->left && sibling)
-        {
-            memcpy(concat_hash, current_hash, 65);
-            memcpy(concat_hash + 65, sibling->hash, 65);
-        }
-        else if (sibling)
-        {
-            memcpy(concat_hash, sibling->hash, 65);
-            memcpy(concat_hash + 65, current_hash, 65);
-        }
-        else
-        {
-            memcpy(concat_hash, current_hash, 65); // No sibling, single child case
-        }
-
-        compute_hash(concat_hash, current_hash);
-        current = current->parent;
-    }
-
-    printf("merkle: Computed root hash: %s\n", current_hash);
-    printf("merkle: Expected root hash: %s\n", expected_root_hash);
+    tree->nodes = (MerkleNode *)tree->arena.base;
+}
 
-    if (compare_hashes(current_hash, expected_root_hash))
-    {
-        printf("merkle: Root hash matches -> Verified\n");
-        return true;
-    }
-    else
-    {
-        printf("merkle: Root hash does not match -> Not Verified\n");
-    }
+// Residency of mapped trees, set at mount
+static int merkle_pinned_levels = MERKLE_DEFAULT_PINNED_LEVELS;
+static size_t merkle_cache_size = MERKLE_DEFAULT_CACHE_SIZE;
 
-    return compare_hashes(current_hash, expected_root_hash);
+// Top levels kept in memory and bytes of lower level pages kept per tree, trees already loaded
+// follow the new budget at their next access
+void merkle_set_residency(int pinned_levels, size_t cache_size)
+{
+    merkle_pinned_levels = pinned_levels > 0 ? pinned_levels : 1;
+    merkle_cache_size = cache_size;
+    printf("merkle: Pinning %d levels, caching %zu KB of lower levels per tree\n", merkle_pinned_levels, cache_size / 1024);
 }
 
-int get_number_of_blocks(char *volume_path)
+// Lower levels are paged in units of MERKLE_PAGE_SPAN aligned bytes of address space, the span
+// the kernel maps around a read fault, so every page it maps belongs to a unit of the list
+static long merkle_page_of(const unsigned char *address)
 {
-    return DATA_BLOCKS_PER_VOLUME;
+    return (uintptr_t)address / MERKLE_PAGE_SPAN;
 }
 
-// this function will have to decrypt the block and then compute the hash
-void get_block_hash(int block_index, char *hash)
+// First unit holding a pinned node. Units before it can be dropped, except the one with the header.
+static long merkle_first_pinned_page(MerkleTree *tree)
 {
-    printf("merkle: Getting block hash\n");
-
-    char block_data[BLOCK_SIZE];
-    read_volume_block_no_check(block_index, block_data);
-    compute_hash(block_data, hash);
-    printf("merkle: Block Hash: %s\n", hash);
+    int level = tree->level_count - merkle_pinned_levels;
+    return merkle_page_of((unsigned char *)&tree->nodes[tree->level_offset[level > 0 ? level : 0]]);
 }
 
-void generate_random_hash(char *hash, size_t size)
+// Read the pinned top levels of a mapped tree ahead of their first use. Paths through the lower
+// levels are random, so reading ahead of them would only fill memory.
+static void pin_merkle_levels(MerkleTree *tree)
 {
-    const char hex_chars[] = "0123456789abcdef";
-    for (size_t i = 0; i < size; i++)
+    unsigned char *pinned = (unsigned char *)(merkle_first_pinned_page(tree) * MERKLE_PAGE_SPAN);
+    if (pinned < tree->map)
     {
-        hash[i] = hex_chars[rand() % 15];
+        pinned = tree->map;
     }
+    madvise(tree->map, pinned - tree->map, MADV_RANDOM);
+    madvise(pinned, tree->map + tree->map_size - pinned, MADV_WILLNEED);
 }
 
-MerkleTree *initialize_merkle_tree_for_volume(char *volume_path)
+static int *merkle_page_bucket(merkle_page_lru_t *lru, long page)
 {
-    printf("merkle: Initializing merkle tree\n");
+    return &lru->buckets[(unsigned long)(page * 2654435761u) & (2 * lru->capacity - 1)];
+}
 
-    int num_blocks = get_number_of_blocks(volume_path);
-    char **block_hashes = malloc(num_blocks * sizeof(char *));
-    for (int i = 0; i < num_blocks; i++)
+static void unlink_merkle_page(merkle_page_lru_t *lru, int e)
+{
+    merkle_page_t *entry = &lru->entries[e];
+    if (entry->prev >= 0)
     {
-        block_hashes[i] = malloc(65);              // Assuming SHA-256 hash size
-        generate_random_hash(block_hashes[i], 65); // Fill with random data
-        block_hashes[i][65] = '\0';                // Null-terminate the string
+        lru->entries[entry->prev].next = entry->next;
     }
-
-    MerkleTree *tree = build_merkle_tree(block_hashes, num_blocks);
-
-    // Clean up hashes array
-    for (int i = 0; i < num_blocks; i++)
+    else
     {
-        free(block_hashes[i]);
+        lru->head = entry->next;
+    }
+    if (entry->next >= 0)
+    {
+        lru->entries[entry->next].prev = entry->prev;
+    }
+    else
+    {
+        lru->tail = entry->prev;
     }
-    free(block_hashes);
-
-    return tree;
 }
 
-void save_node(MerkleNode *node, FILE *file)
+static void push_merkle_page(merkle_page_lru_t *lru, int e)
 {
-    if (!node)
+    lru->entries[e].prev = -1;
+    lru->entries[e].next = lru->head;
+    if (lru->head >= 0)
     {
-        fprintf(file, "null\n"); // Marker for no node
-        return;
+        lru->entries[lru->head].prev = e;
     }
-    // Save current node's data
-    fprintf(file, "%s %d\n", node->hash, node->block_index);
+    lru->head = e;
+    if (lru->tail < 0)
+    {
+        lru->tail = e;
+    }
+}
 
-    // Recursively save left child
-    if (node->left)
+// Double the entries of the list, the buckets are rebuilt for the new capacity
+static bool grow_merkle_pages(merkle_page_lru_t *lru)
+{
+    int capacity = lru->capacity ? 2 * lru->capacity : 64;
+    merkle_page_t *entries = realloc(lru->entries, capacity * sizeof(merkle_page_t));
+    if (!entries)
     {
-        fprintf(file, "left\n"); // Indicate the start of a left child
-        save_node(node->left, file);
+        return false;
     }
-    else
+    lru->entries = entries;
+    int *buckets = malloc(2 * capacity * sizeof(int));
+    if (!buckets)
     {
-        fprintf(file, "null\n"); // No left child
+        return false;
     }
-
-    // Recursively save right child
-    if (node->right)
+    free(lru->buckets);
+    lru->buckets = buckets;
+    for (int b = 0; b < 2 * capacity; b++)
     {
-        fprintf(file, "right\n"); // Indicate the start of a right child
-        save_node(node->right, file);
+        buckets[b] = -1;
     }
-    else
+    int old_capacity = lru->capacity;
+    lru->capacity = capacity;
+    for (int e = lru->head; e >= 0; e = lru->entries[e].next)
+    {
+        int *bucket = merkle_page_bucket(lru, lru->entries[e].page);
+        lru->entries[e].chain = *bucket;
+        *bucket = e;
+    }
+    for (int e = capacity - 1; e >= old_capacity; e--)
     {
-        fprintf(file, "null\n"); // No right child
+        lru->entries[e].chain = lru->free;
+        lru->free = e;
     }
+    return true;
 }
 
-void save_merkle_tree_to_file(MerkleTree *tree, const char *file_path)
+// Move a page to the front of the list, adding it if it is not tracked yet
+static void touch_merkle_page(merkle_page_lru_t *lru, long page)
 {
-    printf("merkle: Saving merkle tree to file\n");
-
-    printf("merkle: File path: %s\n", file_path);
-
-    FILE *file = fopen(file_path, "wb");
-    if (!file)
+    if (lru->capacity)
+    {
+        for (int e = *merkle_page_bucket(lru, page); e >= 0; e = lru->entries[e].chain)
+        {
+            if (lru->entries[e].page == page)
+            {
+                unlink_merkle_page(lru, e);
+                push_merkle_page(lru, e);
+                return;
+            }
+        }
+    }
+    if (lru->free < 0 && !grow_merkle_pages(lru))
     {
-        fprintf(stderr, "Failed to open file for writing: %s\n", file_path);
         return;
     }
 
-    save_node(tree->root, file);
-    fclose(file);
-
-    printf("Merkle tree saved to file\n");
+    int e = lru->free;
+    lru->free = lru->entries[e].chain;
+    lru->entries[e].page = page;
+    int *bucket = merkle_page_bucket(lru, page);
+    lru->entries[e].chain = *bucket;
+    *bucket = e;
+    push_merkle_page(lru, e);
+    lru->count++;
 }
 
-MerkleNode *load_node(FILE *file)
+static void remove_merkle_page(merkle_page_lru_t *lru, int e)
 {
-    char line[128];
-    if (!fgets(line, sizeof(line), file) || strcmp(line, "null\n") == 0)
+    unlink_merkle_page(lru, e);
+    for (int *link = merkle_page_bucket(lru, lru->entries[e].page); *link >= 0; link = &lru->entries[*link].chain)
     {
-        return NULL; // No node to load
+        if (*link == e)
+        {
+            *link = lru->entries[e].chain;
+            break;
+        }
     }
+    lru->entries[e].chain = lru->free;
+    lru->free = e;
+    lru->count--;
+}
 
-    char hash[65];
-    int block_index;
-    if (sscanf(line, "%65s %d", hash, &block_index) != 2)
+// Forget every tracked page, used when the mapping changes
+static void reset_merkle_pages(merkle_page_lru_t *lru)
+{
+    free(lru->entries);
+    free(lru->buckets);
+    memset(lru, 0, sizeof(*lru));
+    lru->free = -1;
+    lru->head = -1;
+    lru->tail = -1;
+}
+
+// Pass each lower level unit holding the paths of leaves first to last with their siblings to
+// note, false if note refused one
+static bool visit_merkle_path_pages(MerkleTree *tree, int first, int last, bool (*note)(MerkleTree *tree, long page))
+{
+    if (!tree || !tree->map)
     {
-        fprintf(stderr, "Failed to read node data.\n");
-        return NULL;
+        return true;
     }
-
-    MerkleNode *node = create_merkle_node(hash, NULL, NULL, block_index);
-
-    // Load left child if present
-    if (fgets(line, sizeof(line), file) && strcmp(line, "left\n") == 0)
+    long header = merkle_page_of(tree->map);
+    long pinned = merkle_first_pinned_page(tree);
+    for (int l = 0; l < tree->level_count - 1; l++, first /= tree->fanout, last /= tree->fanout)
     {
-        node->left = load_node(file);
-        if (node->left)
+        int group_first = first - first % tree->fanout;
+        int group_last = MIN(last - last % tree->fanout + tree->fanout, tree->level_size[l]) - 1;
+        long first_page = merkle_page_of((unsigned char *)merkle_node_at(tree, l, group_first));
+        long last_page = merkle_page_of((unsigned char *)(merkle_node_at(tree, l, group_last) + 1) - 1);
+        for (long page = first_page > header ? first_page : header + 1; page <= last_page && page < pinned; page++)
         {
-            node->left->parent = node;
+            if (!note(tree, page))
+            {
+                return false;
+            }
         }
     }
+    return true;
+}
+
+static bool touch_tree_page(MerkleTree *tree, long page)
+{
+    touch_merkle_page(&tree->pages, page);
+    return true;
+}
+
+// Note the lower level units holding the paths of leaves first to last with their siblings
+static void page_merkle_path(MerkleTree *tree, int first, int last)
+{
+    visit_merkle_path_pages(tree, first, last, touch_tree_page);
+}
 
-    // Load right child if present
-    if (fgets(line, sizeof(line), file) && strcmp(line, "right\n") == 0)
+// Record a unit read by a lock-free reader for the next locked access, false if the log is full
+static bool log_merkle_page(MerkleTree *tree, long page)
+{
+    uint64_t state = __atomic_load_n(&tree->page_log_state, __ATOMIC_RELAXED);
+    do
     {
-        node->right = load_node(file);
-        if (node->right)
+        if ((state >> 32) >= MERKLE_PAGE_LOG)
         {
-            node->right->parent = node;
+            return false;
         }
-    }
+    } while (!__atomic_compare_exchange_n(&tree->page_log_state, &state, state + (1ULL << 32), true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+    tree->page_log[state >> 32] = page;
+    __atomic_add_fetch(&tree->page_log_state, 1, __ATOMIC_RELEASE);
+    return true;
+}
 
-    // Update min and max indices
-    if (node->left && node->right)
+// Move the units logged by lock-free readers into the list. Entries from a mapping the tree no
+// longer uses are skipped, and while a reader is still writing its entries they wait for the next call.
+static void drain_merkle_page_log(MerkleTree *tree)
+{
+    uint64_t state = __atomic_load_n(&tree->page_log_state, __ATOMIC_ACQUIRE);
+    uint32_t reserved = state >> 32;
+    if (reserved == 0 || reserved != (uint32_t)state)
     {
-        node->min_index = node->left->min_index;
-        node->max_index = node->right->max_index;
+        return;
     }
-    else if (node->left)
+    if (tree->map)
     {
-        node->min_index = node->left->min_index;
-        node->max_index = node->left->max_index;
+        long header = merkle_page_of(tree->map);
+        long pinned = merkle_first_pinned_page(tree);
+        for (uint32_t i = 0; i < reserved; i++)
+        {
+            if (tree->page_log[i] > header && tree->page_log[i] < pinned)
+            {
+                touch_merkle_page(&tree->pages, tree->page_log[i]);
+            }
+        }
     }
-    else if (node->right)
+    // entries reserved since the load stay for the next drain, a few are then listed twice
+    __atomic_compare_exchange_n(&tree->page_log_state, &state, 0, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+// The verified bitmap is shared with lock-free readers, so its bits are set and cleared atomically
+static bool is_merkle_node_verified(MerkleTree *tree, int index)
+{
+    return __atomic_load_n(&tree->verified_map[index / 8], __ATOMIC_SEQ_CST) & (1 << (index % 8));
+}
+
+static void mark_merkle_node_verified(MerkleTree *tree, int index)
+{
+    __atomic_fetch_or(&tree->verified_map[index / 8], 1 << (index % 8), __ATOMIC_SEQ_CST);
+}
+
+// A changed node has to be checked against the root again, its bit is cleared before it changes
+static void unmark_merkle_node_verified(MerkleTree *tree, int index)
+{
+    __atomic_fetch_and(&tree->verified_map[index / 8], ~(1 << (index % 8)), __ATOMIC_SEQ_CST);
+}
+
+// Lock-free readers walk the nodes of a published tree while a writer under merkle_lock rewrites
+// them in place. Both sides go through these two helpers, which copy a hash as relaxed atomic 8-byte
+// words, so the accesses race as atomics instead of plain loads and stores. A reader can still see
+// a mix of an old and a new hash, that never matches the published root and is checked again under
+// the lock. The node array is 8-byte aligned, MerkleNode is and so are the tree file headers.
+static void load_merkle_hash(unsigned char *hash, const unsigned char *node_hash)
+{
+    uint64_t words[SHA256_DIGEST_LENGTH / 8];
+    for (int i = 0; i < SHA256_DIGEST_LENGTH / 8; i++)
     {
-        node->min_index = node->right->min_index;
-        node->max_index = node->right->max_index;
+        words[i] = __atomic_load_n((const uint64_t *)node_hash + i, __ATOMIC_RELAXED);
     }
-    else
+    memcpy(hash, words, SHA256_DIGEST_LENGTH);
+}
+
+static void store_merkle_hash(unsigned char *node_hash, const unsigned char *hash)
+{
+    uint64_t words[SHA256_DIGEST_LENGTH / 8];
+    memcpy(words, hash, SHA256_DIGEST_LENGTH);
+    for (int i = 0; i < SHA256_DIGEST_LENGTH / 8; i++)
     {
-        node->min_index = node->max_index = block_index;
+        __atomic_store_n((uint64_t *)node_hash + i, words[i], __ATOMIC_RELAXED);
     }
-
-    return node;
 }
 
-MerkleTree *load_merkle_tree_from_file(const char *file_path)
+// Copy a verified node, false if it is not verified. The bit is checked again after the copy, so
+// a node that started to change or was dropped meanwhile is not trusted.
+static bool read_verified_merkle_node(MerkleTree *tree, int index, unsigned char *hash)
 {
-    printf("merkle: Loading merkle tree from file\n");
-    FILE *file = fopen(file_path, "rb");
-    if (!file)
+    if (!is_merkle_node_verified(tree, index))
     {
-        fprintf(stderr, "Failed to open file for reading: %s\n", file_path);
-        return NULL;
+        return false;
     }
+    load_merkle_hash(hash, tree->nodes[index].hash);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return is_merkle_node_verified(tree, index);
+}
 
-    MerkleTree *tree = malloc(sizeof(MerkleTree));
+// Nodes that are never dropped and read again from the file, the pinned levels of a mapped tree
+// and every node of a tree in the arena. Lock-free readers only mark these verified.
+static bool merkle_node_is_pinned(MerkleTree *tree, int index)
+{
+    return !tree->map || merkle_page_of((unsigned char *)&tree->nodes[index]) >= merkle_first_pinned_page(tree);
+}
 
-    if (!tree)
+// Release the arena page holding address when it is all zeros, it reads the same once touched again
+static void release_zero_arena_page(MerkleTree *tree, unsigned char *address)
+{
+    long page_size = sysconf(_SC_PAGESIZE);
+    uint64_t *page = (uint64_t *)((uintptr_t)address & ~(uintptr_t)(page_size - 1));
+    if ((unsigned char *)page < tree->arena.base || (unsigned char *)page + page_size > tree->arena.base + tree->arena.size)
     {
-        fclose(file);
-        return NULL;
+        return;
     }
+    for (size_t i = 0; i < page_size / sizeof(uint64_t); i++)
+    {
+        if (page[i])
+        {
+            return;
+        }
+    }
+    madvise(page, page_size, MADV_DONTNEED);
+}
 
-    tree->root = load_node(file);
-    fclose(file);
-
-    return tree;
+// Drop the least recently used lower level units beyond the budget. A dropped unit is read from
+// the tree file again on its next access, so its nodes have to be checked against the root again.
+// Units with nodes not synced yet stay.
+static void trim_merkle_pages(MerkleTree *tree)
+{
+    if (!tree || !tree->map)
+    {
+        return;
+    }
+    drain_merkle_page_log(tree);
+    merkle_page_lru_t *lru = &tree->pages;
+    int limit = merkle_cache_size / MERKLE_PAGE_SPAN;
+    for (int e = lru->tail, prev; e >= 0 && lru->count > limit; e = prev)
+    {
+        prev = lru->entries[e].prev;
+        unsigned char *start = (unsigned char *)(lru->entries[e].page * MERKLE_PAGE_SPAN);
+        long first = (start - (unsigned char *)tree->nodes) / (long)sizeof(MerkleNode);
+        long last = MIN((start + MERKLE_PAGE_SPAN - 1 - (unsigned char *)tree->nodes) / (long)sizeof(MerkleNode), tree->node_count - 1);
+
+        first = first > 0 ? first : 0;
+        bool dirty = false;
+        for (long i = first; i <= last && !dirty; i++)
+        {
+            dirty = tree->dirty_map[i / 8] & (1 << (i % 8));
+        }
+        if (!dirty)
+        {
+            // lock-free readers trust a verified node only while its bit is set, so it is cleared first
+            for (long i = first; i <= last; i++)
+            {
+                unmark_merkle_node_verified(tree, i);
+            }
+            madvise(start, MERKLE_PAGE_SPAN, MADV_DONTNEED);
+            // the bitmaps of the dropped nodes are clear, so their pages can go as well
+            release_zero_arena_page(tree, &tree->verified_map[first / 8]);
+            release_zero_arena_page(tree, &tree->verified_map[last / 8]);
+            release_zero_arena_page(tree, &tree->dirty_map[first / 8]);
+            release_zero_arena_page(tree, &tree->dirty_map[last / 8]);
+            remove_merkle_page(lru, e);
+        }
+    }
 }
 
-MerkleTree *get_merkle_tree_for_volume(char *volume_id)
+MerkleNode *merkle_node_at(MerkleTree *tree, int level, int pos)
 {
-    printf("merkle: Getting merkle tree for volume %s\n", volume_id);
-    extern superblock_t sb;
-    printf("merkle: Volume tree: %p\n", sb.volumes[atoi(volume_id)].merkle_tree);
-    // volume id is the index of the volume in the superblock
-    return sb.volumes[atoi(volume_id)].merkle_tree;
+    return &tree->nodes[tree->level_offset[level] + pos];
 }
 
-MerkleNode *find_leaf_node(MerkleNode *node, int block_index)
+// The root is the last node, on a level of its own
+unsigned char *merkle_root_hash(MerkleTree *tree)
 {
-    printf("merkle: Finding leaf node\n");
+    return tree->nodes[tree->node_count - 1].hash;
+}
 
-    printf("merkle: Node: %p\n", node);
+// Number of children of node pos on the level, the children are adjacent on the level below
+int merkle_child_count(MerkleTree *tree, int level, int pos)
+{
+    int children = tree->level_size[level - 1] - pos * tree->fanout;
+    return children < tree->fanout ? children : tree->fanout;
+}
 
-    printf("merkle: Block index: %d\n", block_index);
+// Hash with the algorithm chosen for the filesystem
+void compute_hash(const void *input, size_t len, unsigned char *output)
+{
+    hash_digest(input, len, output);
+}
 
-    printf("merkle: Node block index: %d %d %d \n", node->block_index, node->min_index, node->max_index);
+// Empty subtrees hash to the zero digest on every level
+bool merkle_node_is_empty(const unsigned char *hash)
+{
+    static const unsigned char empty[SHA256_DIGEST_LENGTH] = {0};
+    return memcmp(hash, empty, SHA256_DIGEST_LENGTH) == 0;
+}
 
-    if (!node || (block_index < node->min_index || block_index > node->max_index))
+// Hash of a node from its concatenated children: a single child is promoted and only empty
+// children give an empty node
+static void merkle_hash_children(const unsigned char *children, int count, unsigned char *output)
+{
+    if (count == 1)
     {
-        printf("Returning NULL\n");
-        return NULL;
+        memcpy(output, children, SHA256_DIGEST_LENGTH);
+        return;
     }
-
-    // Direct hit for leaf nodes
-    if (node->block_index == block_index)
+    for (int i = 0; i < count; i++)
     {
-        printf("merkle: Returning node\n");
-        return node;
+        if (!merkle_node_is_empty(children + i * SHA256_DIGEST_LENGTH))
+        {
+            compute_hash(children, count * SHA256_DIGEST_LENGTH, output);
+            return;
+        }
     }
+    memset(output, 0, SHA256_DIGEST_LENGTH);
+}
+
+bool compare_hashes(const unsigned char *hash1, const unsigned char *hash2)
+{
+    return memcmp(hash1, hash2, SHA256_DIGEST_LENGTH) == 0;
+}
+
+static void mark_merkle_node_dirty(MerkleTree *tree, int index);
+static void clear_merkle_dirty(MerkleTree *tree);
+static int compare_ints(const void *a, const void *b);
 
-    // Decide which subtree to search based on the range
-    MerkleNode *result = find_leaf_node(node->left, block_index);
-    if (result == NULL)
+// Keep the value of a volume tree node for the newest snapshot before it is overwritten
+static void preserve_merkle_node(MerkleTree *tree, int index)
+{
+    if (tree->volume >= 0)
     {
-        printf("merkle: Searching right\n");
-        result = find_leaf_node(node->right, block_index);
+        snapshot_preserve_node(tree->volume, index, tree->nodes[index].hash);
     }
-    printf("merkle: Returning result\n");
-    return result;
 }
 
-// Wrapper function to start the search from the tree root
-MerkleNode *find_leaf_node_in_tree(MerkleTree *tree, int block_index)
+// Recompute node pos on the level from its children on the level below
+static void recompute_merkle_node(MerkleTree *tree, int level, int pos)
 {
-    printf("merkle: Finding leaf node in tree\n");
+    MerkleNode *node = merkle_node_at(tree, level, pos);
+    MerkleNode *first = merkle_node_at(tree, level - 1, pos * tree->fanout);
+    // the children are adjacent in the node array
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    merkle_hash_children(first->hash, merkle_child_count(tree, level, pos), hash);
+    store_merkle_hash(node->hash, hash);
+}
 
-    if (!tree)
+// Hash count full nodes at once and store each digest in its node
+static void hash_merkle_nodes(const unsigned char **inputs, size_t len, int count, MerkleNode **nodes)
+{
+    unsigned char hashes[SHA256_MB_LANES][SHA256_DIGEST_LENGTH];
+    unsigned char *outputs[SHA256_MB_LANES];
+    for (int i = 0; i < count; i++)
     {
-        return NULL;
+        outputs[i] = hashes[i];
     }
-
-    MerkleNode *leaf = find_leaf_node(tree->root, block_index);
-    if (leaf)
+    hash_digest_many(inputs, len, count, outputs);
+    for (int i = 0; i < count; i++)
     {
-        printf("merkle: Leaf node found: %s\n", leaf->hash);
-        return leaf;
+        store_merkle_hash(nodes[i]->hash, hashes[i]);
     }
-    return NULL;
 }
 
-void update_merkle_node_for_block(char *volume_id, int block_index, const void *block_data)
+// Recompute the nodes at the given positions of one level, or count nodes from first when positions
+// is NULL, hashing the children of full nodes together
+static void recompute_merkle_level(MerkleTree *tree, int level, const int *positions, int first, int count)
 {
-    extern superblock_t sb;
-    printf("merkle: Updating merkle node for block\n");
-
-    MerkleTree *tree = get_merkle_tree_for_volume(volume_id);
-    MerkleNode *leaf_node = find_leaf_node_in_tree(tree, block_index);
-
-    printf("merkle: Leaf node found: %s\n", leaf_node->hash);
-    printf("merkle: Lead node block index %d\n", leaf_node->block_index);
-
-    if (leaf_node)
+    static const unsigned char empty_hash[SHA256_DIGEST_LENGTH];
+    const unsigned char *inputs[SHA256_MB_LANES];
+    MerkleNode *outputs[SHA256_MB_LANES];
+    size_t len = tree->fanout * SHA256_DIGEST_LENGTH;
+    int n = 0;
+    for (int i = 0; i < count; i++)
     {
-        char new_hash[65];
-        compute_hash(block_data, new_hash);
-        printf("merkle: New hash: %s\n", new_hash);
-        update_merkle_node(leaf_node, new_hash);
-        bool res = compare_hashes(leaf_node->hash, new_hash);
-        printf("merkle: Hash comparison result: %d\n", res);
-        if (res)
+        int pos = positions ? positions[i] : first + i;
+        const unsigned char *children = merkle_node_at(tree, level - 1, pos * tree->fanout)->hash;
+        int child_count = merkle_child_count(tree, level, pos);
+        bool empty = true;
+        for (int c = 0; c < child_count && empty; c++)
+        {
+            empty = merkle_node_is_empty(children + c * SHA256_DIGEST_LENGTH);
+        }
+        if (empty)
         {
-            printf("merkle: Hashes match (stored and computed for leaf)\n");
+            MerkleNode *node = merkle_node_at(tree, level, pos);
+            if (!merkle_node_is_empty(node->hash))
+            {
+                store_merkle_hash(node->hash, empty_hash); // Written only when it changes, empty pages stay untouched
+            }
+        }
+        else if (child_count == tree->fanout)
+        {
+            inputs[n] = children;
+            outputs[n] = merkle_node_at(tree, level, pos);
+            n++;
+            if (n == SHA256_MB_LANES)
+            {
+                hash_merkle_nodes(inputs, len, n, outputs);
+                n = 0;
+            }
         }
         else
         {
-            printf("merkle: Hashes do not match (stored and computed for leaf)\n");
+            recompute_merkle_node(tree, level, pos); // Last node of the level has fewer children
         }
     }
-
-    printf("merkle: Saving merkle tree to file\n");
-    // save the updated tree to file
-    save_merkle_tree_to_file(tree, sb.volumes[atoi(volume_id)].merkle_path);
+    hash_merkle_nodes(inputs, len, n, outputs);
 }
 
-void get_root_hash(char *volume_id, char *root_hash)
+void update_merkle_node(MerkleTree *tree, int block_index, const unsigned char *new_hash)
 {
-    MerkleTree *tree = get_merkle_tree_for_volume(volume_id);
-    if (tree)
-    {
-        memcpy(root_hash, tree->root->hash, 65);
-    }
-    else
+    printf("merkle: Updating merkle node %d\n", block_index);
+    preserve_merkle_node(tree, block_index);
+    unmark_merkle_node_verified(tree, block_index);
+    store_merkle_hash(tree->nodes[block_index].hash, new_hash);
+    // Update the parent nodes
+    int pos = block_index;
+    for (int l = 1; l < tree->level_count; l++)
     {
-        memset(root_hash, 0, 65);
+        pos /= tree->fanout;
+        preserve_merkle_node(tree, tree->level_offset[l] + pos);
+        unmark_merkle_node_verified(tree, tree->level_offset[l] + pos);
+        recompute_merkle_node(tree, l, pos);
     }
 }
 
-//  take decrypted block hash as functiton param
-bool verify_block_integrity(int block_index)
+// Update a set of leaves and recompute every affected interior node once, level by level
+void update_merkle_leaves(MerkleTree *tree, const int *block_indices, unsigned char (*block_hashes)[SHA256_DIGEST_LENGTH], int count)
 {
-    char volume_id[9] = "0";
-    int volume_id_int = block_index / DATA_BLOCKS_PER_VOLUME;
-    sprintf(volume_id, "%d", volume_id_int);
+    printf("merkle: Updating %d merkle leaves\n", count);
 
-    int block_index_in_volume = block_index % DATA_BLOCKS_PER_VOLUME;
-
-    printf("merkle: Verifying block integrity\n");
-    MerkleTree *tree = get_merkle_tree_for_volume(volume_id);
-    MerkleNode *leaf_node = find_leaf_node_in_tree(tree, block_index_in_volume);
-    printf("merkle: Leaf node found: %s\n", leaf_node->hash);
-    printf("merkle: Leaf node block index %d\n", leaf_node->block_index);
-    char expected_root_hash[65];
-    get_root_hash(volume_id, expected_root_hash);
-
-    printf("merkle: Expected root hash: %s\n", expected_root_hash);
-
-    // read the hash from the block
-    char decrypted_hash[65];
-
-    get_block_hash(block_index, decrypted_hash);
-
-    printf("merkle: Decrypted hash: %s\n", decrypted_hash);
-    printf("merkle: Leaf node: %s\n", leaf_node->hash);
+    if (count == 0)
+    {
+        return;
+    }
 
-    if (leaf_node)
+    int *positions = malloc(count * sizeof(int));
+    if (!positions)
     {
-        return verify_merkle_path(leaf_node, expected_root_hash, decrypted_hash);
+        return;
     }
-    return false;
-}
\ No newline at end of file
+    for (int i = 0; i < count; i++)
+    {
+        preserve_merkle_node(tree, block_indices[i]);
+        unmark_merkle_node_verified(tree, block_indices[i]);
+        store_merkle_hash(tree->nodes[block_indices[i]].hash, block_hashes[i]);
+        mark_merkle_node_dirty(tree, block_indices[i]);
+        positions[i] = block_indices[i];
+    }
+
+    // sorted positions make the parents of one level come out sorted and adjacent duplicates
+    qsort(positions, count, sizeof(int), compare_ints);
+    int n = count;
+    for (int l = 1; l < tree->level_count; l++)
+    {
+        int m = 0;
+        for (int i = 0; i < n; i++)
+        {
+            int parent = positions[i] / tree->fanout;
+            if (m == 0 || positions[m - 1] != parent)
+            {
+                positions[m++] = parent;
+            }
+        }
+        n = m;
+        for (int i = 0; i < n; i++)
+        {
+            preserve_merkle_node(tree, tree->level_offset[l] + positions[i]);
+            unmark_merkle_node_verified(tree, tree->level_offset[l] + positions[i]);
+        }
+        recompute_merkle_level(tree, l, positions, 0, n);
+        for (int i = 0; i < n; i++)
+        {
+            mark_merkle_node_dirty(tree, tree->level_offset[l] + positions[i]);
+        }
+    }
+
+    free(positions);
+}
+
+// Set on worker threads so nested parallel loops run inline instead of spawning more threads
+static __thread bool in_merkle_worker = false;
+
+typedef struct merkle_parallel_job
+{
+    void (*fn)(void *arg, int i); // Work item function
+    void *arg;                    // Shared argument of every work item
+    int count;                    // Number of work items
+    int next;                     // Next work item to hand out
+} merkle_parallel_job_t;
+
+static void *merkle_worker(void *arg)
+{
+    merkle_parallel_job_t *job = arg;
+    bool nested = in_merkle_worker;
+    in_merkle_worker = true;
+    for (int i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED); i < job->count;
+         i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED))
+    {
+        job->fn(job->arg, i);
+    }
+    in_merkle_worker = nested;
+    return NULL;
+}
+
+// Number of threads used for parallel tree work, one per online core
+int merkle_worker_count(void)
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores < 1)
+    {
+        return 1;
+    }
+    return cores > MERKLE_MAX_THREADS ? MERKLE_MAX_THREADS : (int)cores;
+}
+
+// Run fn(arg, i) for every i in [0, count) on a pool of worker threads, the caller works as well
+void merkle_parallel_for(int count, void (*fn)(void *arg, int i), void *arg)
+{
+    merkle_parallel_job_t job = {fn, arg, count, 0};
+    int threads = in_merkle_worker ? 1 : merkle_worker_count();
+    if (threads > count)
+    {
+        threads = count;
+    }
+
+    pthread_t workers[MERKLE_MAX_THREADS];
+    int started = 0;
+    for (; started < threads - 1; started++)
+    {
+        if (pthread_create(&workers[started], NULL, merkle_worker, &job) != 0)
+        {
+            break; // the remaining work runs on the threads we have
+        }
+    }
+    merkle_worker(&job);
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(workers[i], NULL);
+    }
+}
+
+typedef struct merkle_subtree_job
+{
+    MerkleTree *tree; // Tree being built
+    int top_level;    // Level of the subtree roots
+} merkle_subtree_job_t;
+
+// Build levels 1 to top_level of the subtree under node root on top_level
+static void build_merkle_subtree(void *arg, int root)
+{
+    merkle_subtree_job_t *job = arg;
+    for (int l = 1; l <= job->top_level; l++)
+    {
+        // the subtree covers fanout^(top_level - l) nodes of level l
+        long span = 1;
+        for (int i = l; i < job->top_level; i++)
+        {
+            span *= job->tree->fanout;
+        }
+        int first = root * span;
+        int last = (root + 1) * span < job->tree->level_size[l] ? (root + 1) * span : job->tree->level_size[l];
+        recompute_merkle_level(job->tree, l, NULL, first, last - first);
+    }
+}
+
+MerkleTree *build_merkle_tree(unsigned char **block_hashes, int num_blocks, int fanout)
+{
+    printf("merkle: Building merkle tree\n");
+
+    if (num_blocks == 0)
+    {
+        return NULL;
+    }
+
+    MerkleTree *tree = merkle_tree_alloc(num_blocks, fanout);
+    if (!tree)
+    {
+        return NULL;
+    }
+    merkle_tree_alloc_nodes(tree);
+
+    for (int i = 0; i < num_blocks; i++)
+    {
+        memcpy(tree->nodes[i].hash, block_hashes[i], SHA256_DIGEST_LENGTH);
+    }
+
+    // Lower levels are built as independent subtrees on the workers, the levels above are joined here
+    int join_level = 0;
+    int workers = merkle_worker_count();
+    if (num_blocks >= MERKLE_PARALLEL_MIN_LEAVES && workers > 1)
+    {
+        while (join_level + 1 < tree->level_count && tree->level_size[join_level + 1] >= 4 * workers)
+        {
+            join_level++;
+        }
+        merkle_subtree_job_t job = {tree, join_level};
+        merkle_parallel_for(tree->level_size[join_level], build_merkle_subtree, &job);
+    }
+
+    // Each iteration builds the next level of the tree
+    for (int l = join_level + 1; l < tree->level_count; l++)
+    {
+        recompute_merkle_level(tree, l, NULL, 0, tree->level_size[l]);
+    }
+
+    return tree;
+}
+
+// Check the hash computed for node pos on level against the root, walking its stored siblings upwards.
+// A lockless caller only marks nodes that are never dropped, see merkle_node_is_pinned.
+static bool verify_merkle_node_path(MerkleTree *tree, int level, int node_pos, const unsigned char *node_hash, const unsigned char *expected_root_hash, bool lockless)
+{
+    // the cache only holds for the root of this tree
+    unsigned char root_hash[SHA256_DIGEST_LENGTH];
+    load_merkle_hash(root_hash, merkle_root_hash(tree));
+    bool use_cache = compare_hashes(expected_root_hash, root_hash);
+
+    unsigned char path_hash[MERKLE_MAX_LEVELS][SHA256_DIGEST_LENGTH];
+    memcpy(path_hash[level], node_hash, SHA256_DIGEST_LENGTH);
+
+    unsigned char cached_hash[SHA256_DIGEST_LENGTH];
+    const unsigned char *trusted_hash = expected_root_hash;
+    int top = tree->level_count - 1;
+    int pos = node_pos;
+    for (int l = level; l < tree->level_count - 1; l++, pos /= tree->fanout)
+    {
+        if (use_cache && read_verified_merkle_node(tree, tree->level_offset[l] + pos, cached_hash))
+        {
+            printf("merkle: Verified node cache hit on level %d\n", l);
+            trusted_hash = cached_hash;
+            top = l;
+            break;
+        }
+
+        int first = pos - pos % tree->fanout;
+        int children = merkle_child_count(tree, l + 1, pos / tree->fanout);
+        if (children == 1)
+        {
+            memcpy(path_hash[l + 1], path_hash[l], SHA256_DIGEST_LENGTH); // No sibling, the hash is promoted unchanged
+            continue;
+        }
+
+        // the stored siblings with the computed hash in place of the node on the path
+        unsigned char concat_hash[MERKLE_MAX_FANOUT * SHA256_DIGEST_LENGTH];
+        for (int c = 0; c < children; c++)
+        {
+            load_merkle_hash(concat_hash + c * SHA256_DIGEST_LENGTH, merkle_node_at(tree, l, first + c)->hash);
+        }
+        memcpy(concat_hash + (pos - first) * SHA256_DIGEST_LENGTH, path_hash[l], SHA256_DIGEST_LENGTH);
+
+        merkle_hash_children(concat_hash, children, path_hash[l + 1]);
+    }
+
+    if (compare_hashes(path_hash[top], trusted_hash))
+    {
+        if (use_cache)
+        {
+            // every stored node that matched the computed path and every sibling hashed into it is now checked
+            pos = node_pos;
+            for (int l = level; l < top; l++, pos /= tree->fanout)
+            {
+                int first = pos - pos % tree->fanout;
+                int children = merkle_child_count(tree, l + 1, pos / tree->fanout);
+                for (int i = first; i < first + children; i++)
+                {
+                    int index = tree->level_offset[l] + i;
+                    unsigned char stored_hash[SHA256_DIGEST_LENGTH];
+                    load_merkle_hash(stored_hash, merkle_node_at(tree, l, i)->hash);
+                    if ((i != pos || compare_hashes(stored_hash, path_hash[l])) &&
+                        (!lockless || merkle_node_is_pinned(tree, index)))
+                    {
+                        mark_merkle_node_verified(tree, index);
+                    }
+                }
+            }
+        }
+        printf("merkle: Root hash matches -> Verified\n");
+        return true;
+    }
+    if (lockless)
+    {
+        printf("merkle: Published version does not match, verifying under the lock\n");
+        return false;
+    }
+
+    char computed_hex[2 * SHA256_DIGEST_LENGTH + 1];
+    char expected_hex[2 * SHA256_DIGEST_LENGTH + 1];
+    hash_to_hex(path_hash[top], computed_hex, SHA256_DIGEST_LENGTH);
+    hash_to_hex(trusted_hash, expected_hex, SHA256_DIGEST_LENGTH);
+    printf("merkle: Computed root hash: %s\n", computed_hex);
+    printf("merkle: Expected root hash: %s\n", expected_hex);
+    printf("merkle: Root hash does not match -> Not Verified\n");
+    return false;
+}
+
+// Tree of num_leaves never written blocks. Every node is empty, so nothing is hashed and no
+// node page is touched until a block is written.
+MerkleTree *create_empty_merkle_tree(int num_leaves, int fanout)
+{
+    printf("merkle: Creating empty merkle tree\n");
+
+    MerkleTree *tree = merkle_tree_alloc(num_leaves, fanout);
+    if (tree)
+    {
+        merkle_tree_alloc_nodes(tree);
+    }
+    return tree;
+}
+
+// Verify a block hash against the root. Nodes on a path that verified are remembered, so a later
+// verification stops at the first node already checked and only compares against it.
+bool verify_merkle_path(MerkleTree *tree, int block_index, const unsigned char *expected_root_hash, const unsigned char *block_hash)
+{
+    printf("merkle: Verifying merkle path\n");
+    return verify_merkle_node_path(tree, 0, block_index, block_hash, expected_root_hash, false);
+}
+
+// Verify count adjacent leaves from first. The subtree covering them is recomputed once from
+// the leaf hashes and the stored nodes at its edges, then its root is checked with one path.
+static bool verify_merkle_leaves(MerkleTree *tree, int first, int count, unsigned char (*leaf_hashes)[SHA256_DIGEST_LENGTH], const unsigned char *expected_root_hash, bool lockless)
+{
+    if (!tree || count <= 0 || first < 0 || first + count > tree->num_leaves)
+    {
+        return false;
+    }
+
+    unsigned char root_hash[SHA256_DIGEST_LENGTH];
+    load_merkle_hash(root_hash, merkle_root_hash(tree));
+    bool use_cache = compare_hashes(expected_root_hash, root_hash);
+    int fanout = tree->fanout;
+
+    // stored nodes that match the computed subtree and the edge siblings hashed into it,
+    // marked verified once the subtree root is checked
+    int max_marks = 2 * count + tree->level_count * 2 * fanout;
+    int *marks = use_cache ? malloc(max_marks * sizeof(int)) : NULL;
+    int mark_count = 0;
+
+    unsigned char(*level_hashes)[SHA256_DIGEST_LENGTH] = malloc(count * SHA256_DIGEST_LENGTH);
+    if (!level_hashes || (use_cache && !marks))
+    {
+        free(level_hashes);
+        free(marks);
+        return false;
+    }
+    memcpy(level_hashes, leaf_hashes, count * SHA256_DIGEST_LENGTH);
+
+    int l = 0;
+    int lo = first;
+    int n = count;
+    while (n > 1)
+    {
+        // a run of nodes that all match checked stored nodes needs no hashing above it
+        bool cached = use_cache;
+        for (int i = 0; i < n && cached; i++)
+        {
+            unsigned char cached_hash[SHA256_DIGEST_LENGTH];
+            cached = read_verified_merkle_node(tree, tree->level_offset[l] + lo + i, cached_hash) &&
+                     compare_hashes(cached_hash, level_hashes[i]);
+        }
+        if (cached)
+        {
+            printf("merkle: Verified node cache hit on level %d\n", l);
+            free(level_hashes);
+            free(marks);
+            return true;
+        }
+
+        int parent_lo = lo / fanout;
+        int parent_hi = (lo + n - 1) / fanout;
+        for (int p = parent_lo; p <= parent_hi; p++)
+        {
+            int child = p * fanout;
+            int children = merkle_child_count(tree, l + 1, p);
+            unsigned char concat_hash[MERKLE_MAX_FANOUT * SHA256_DIGEST_LENGTH];
+            for (int c = child; c < child + children; c++)
+            {
+                unsigned char *slot = concat_hash + (c - child) * SHA256_DIGEST_LENGTH;
+                unsigned char stored_hash[SHA256_DIGEST_LENGTH];
+                load_merkle_hash(stored_hash, merkle_node_at(tree, l, c)->hash);
+                bool in_range = c >= lo && c < lo + n;
+                memcpy(slot, in_range ? level_hashes[c - lo] : stored_hash, SHA256_DIGEST_LENGTH);
+                if (marks && (!in_range || compare_hashes(stored_hash, slot)) &&
+                    (!lockless || merkle_node_is_pinned(tree, tree->level_offset[l] + c)))
+                {
+                    marks[mark_count++] = tree->level_offset[l] + c;
+                }
+            }
+
+            // the children of parent p were copied out before its slot is overwritten
+            merkle_hash_children(concat_hash, children, level_hashes[p - parent_lo]);
+        }
+        lo = parent_lo;
+        n = parent_hi - parent_lo + 1;
+        l++;
+    }
+
+    bool verified = verify_merkle_node_path(tree, l, lo, level_hashes[0], expected_root_hash, lockless);
+    for (int i = 0; verified && i < mark_count; i++)
+    {
+        mark_merkle_node_verified(tree, marks[i]);
+    }
+
+    free(level_hashes);
+    free(marks);
+    return verified;
+}
+
+bool verify_merkle_range(MerkleTree *tree, int first, int count, unsigned char (*leaf_hashes)[SHA256_DIGEST_LENGTH], const unsigned char *expected_root_hash)
+{
+    printf("merkle: Verifying merkle range of %d leaves from %d\n", count, first);
+    return verify_merkle_leaves(tree, first, count, leaf_hashes, expected_root_hash, false);
+}
+
+void free_merkle_proof(MerkleProof *proof)
+{
+    if (!proof)
+    {
+        return;
+    }
+    free(proof->indices);
+    free(proof->leaves);
+    free(proof->hashes);
+    free(proof);
+}
+
+static MerkleProof *merkle_proof_alloc(uint32_t index_count, uint32_t hash_count)
+{
+    MerkleProof *proof = calloc(1, sizeof(MerkleProof));
+    if (!proof)
+    {
+        return NULL;
+    }
+    proof->indices = malloc((index_count ? index_count : 1) * sizeof(uint32_t));
+    proof->leaves = malloc((index_count ? index_count : 1) * SHA256_DIGEST_LENGTH);
+    proof->hashes = malloc((hash_count ? hash_count : 1) * SHA256_DIGEST_LENGTH);
+    if (!proof->indices || !proof->leaves || !proof->hashes)
+    {
+        free_merkle_proof(proof);
+        return NULL;
+    }
+    return proof;
+}
+
+// One proof for several leaves. The paths are walked together level by level, so a sibling
+// shared by several paths is stored once and nodes on a path are computed by the verifier.
+MerkleProof *create_merkle_multiproof(MerkleTree *tree, const int *block_indices, int count)
+{
+    printf("merkle: Creating multi-proof for %d blocks\n", count);
+
+    if (!tree || count <= 0)
+    {
+        return NULL;
+    }
+
+    int *positions = malloc(count * sizeof(int));
+    if (!positions)
+    {
+        return NULL;
+    }
+    memcpy(positions, block_indices, count * sizeof(int));
+    qsort(positions, count, sizeof(int), compare_ints);
+
+    int n = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (positions[i] < 0 || positions[i] >= tree->num_leaves)
+        {
+            printf("merkle: Block %d is not in the tree\n", positions[i]);
+            free(positions);
+            return NULL;
+        }
+        if (n == 0 || positions[n - 1] != positions[i])
+        {
+            positions[n++] = positions[i];
+        }
+    }
+
+    // no more siblings than fanout - 1 per path and level, and never more than the tree holds
+    size_t max_hashes = (size_t)n * (tree->fanout - 1) * (tree->level_count - 1);
+    if (max_hashes > (size_t)tree->node_count)
+    {
+        max_hashes = tree->node_count;
+    }
+    MerkleProof *proof = merkle_proof_alloc(n, max_hashes);
+    if (!proof)
+    {
+        free(positions);
+        return NULL;
+    }
+
+    merkle_proof_header_t *header = &proof->header;
+    memcpy(header->magic, MERKLE_PROOF_MAGIC, sizeof(header->magic));
+    header->version = MERKLE_PROOF_VERSION;
+    header->digest_size = SHA256_DIGEST_LENGTH;
+    header->hash_algorithm = get_hash_algorithm();
+    header->fanout = tree->fanout;
+    header->leaf_count = tree->num_leaves;
+    header->index_count = n;
+    for (int i = 0; i < n; i++)
+    {
+        proof->indices[i] = positions[i];
+        memcpy(proof->leaves[i], tree->nodes[positions[i]].hash, SHA256_DIGEST_LENGTH);
+    }
+
+    uint32_t h = 0;
+    for (int l = 0; l < tree->level_count - 1; l++)
+    {
+        // positions stay ascending, so the known children of a parent are adjacent
+        int next = 0;
+        for (int i = 0; i < n;)
+        {
+            int parent = positions[i] / tree->fanout;
+            int first = parent * tree->fanout;
+            int children = merkle_child_count(tree, l + 1, parent);
+            for (int c = first; c < first + children; c++)
+            {
+                if (i < n && positions[i] == c)
+                {
+                    i++;
+                    continue;
+                }
+                memcpy(proof->hashes[h++], merkle_node_at(tree, l, c)->hash, SHA256_DIGEST_LENGTH);
+            }
+            positions[next++] = parent;
+        }
+        n = next;
+    }
+    header->hash_count = h;
+
+    free(positions);
+    printf("merkle: Multi-proof holds %u hashes for %u blocks\n", header->hash_count, header->index_count);
+    return proof;
+}
+
+// Check a multi-proof against a root. leaf_hashes are the digests the caller computed for the
+// proven leaves, in the order of proof->indices, or NULL to check the digests in the proof.
+bool verify_merkle_multiproof(const MerkleProof *proof, unsigned char (*leaf_hashes)[SHA256_DIGEST_LENGTH], const unsigned char *expected_root_hash)
+{
+    printf("merkle: Verifying multi-proof\n");
+
+    const merkle_proof_header_t *header = &proof->header;
+    if (header->hash_algorithm != (uint32_t)get_hash_algorithm() || header->fanout < 2 ||
+        header->fanout > MERKLE_MAX_FANOUT || header->index_count == 0 || header->leaf_count == 0)
+    {
+        printf("merkle: Multi-proof does not match this filesystem -> Not Verified\n");
+        return false;
+    }
+
+    int fanout = header->fanout;
+    int n = header->index_count;
+    int sizes[MERKLE_MAX_LEVELS];
+    int levels = merkle_level_sizes(header->leaf_count, fanout, sizes);
+
+    int *positions = malloc(n * sizeof(int));
+    unsigned char(*level_hashes)[SHA256_DIGEST_LENGTH] = malloc(n * SHA256_DIGEST_LENGTH);
+    if (!positions || !level_hashes)
+    {
+        free(positions);
+        free(level_hashes);
+        return false;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        positions[i] = proof->indices[i];
+        memcpy(level_hashes[i], leaf_hashes ? leaf_hashes[i] : proof->leaves[i], SHA256_DIGEST_LENGTH);
+    }
+
+    bool valid = true;
+    for (int i = 0; i < n && valid; i++)
+    {
+        // the walk below relies on strictly ascending indices inside the tree
+        valid = proof->indices[i] < header->leaf_count && (i == 0 || proof->indices[i - 1] < proof->indices[i]);
+    }
+
+    uint32_t h = 0;
+    for (int l = 0; l < levels - 1 && valid; l++)
+    {
+        int next = 0;
+        for (int i = 0; i < n && valid;)
+        {
+            int parent = positions[i] / fanout;
+            int first = parent * fanout;
+            int children = sizes[l] - first < fanout ? sizes[l] - first : fanout;
+
+            unsigned char concat_hash[MERKLE_MAX_FANOUT * SHA256_DIGEST_LENGTH];
+            for (int c = first; c < first + children; c++)
+            {
+                unsigned char *slot = concat_hash + (c - first) * SHA256_DIGEST_LENGTH;
+                if (i < n && positions[i] == c)
+                {
+                    memcpy(slot, level_hashes[i++], SHA256_DIGEST_LENGTH);
+                }
+                else if (h < header->hash_count)
+                {
+                    memcpy(slot, proof->hashes[h++], SHA256_DIGEST_LENGTH);
+                }
+                else
+                {
+                    valid = false; // Proof ran out of siblings
+                    break;
+                }
+            }
+
+            // the parents replace their children, which were consumed above
+            merkle_hash_children(concat_hash, children, level_hashes[next]);
+            positions[next++] = parent;
+        }
+        n = next;
+    }
+
+    // every stored sibling must have been used, a longer proof was not made for this tree
+    valid = valid && n == 1 && h == header->hash_count && compare_hashes(level_hashes[0], expected_root_hash);
+
+    free(positions);
+    free(level_hashes);
+    printf("merkle: Multi-proof for %u blocks -> %s\n", header->index_count, valid ? "Verified" : "Not Verified");
+    return valid;
+}
+
+bool save_merkle_proof(const MerkleProof *proof, const char *file_path)
+{
+    printf("merkle: Saving multi-proof to %s\n", file_path);
+
+    FILE *file = fopen(file_path, "wb");
+    if (!file)
+    {
+        fprintf(stderr, "Failed to open file for writing: %s\n", file_path);
+        return false;
+    }
+
+    const merkle_proof_header_t *header = &proof->header;
+    bool ok = fwrite(header, sizeof(*header), 1, file) == 1 &&
+              fwrite(proof->indices, sizeof(uint32_t), header->index_count, file) == header->index_count &&
+              fwrite(proof->leaves, SHA256_DIGEST_LENGTH, header->index_count, file) == header->index_count &&
+              fwrite(proof->hashes, SHA256_DIGEST_LENGTH, header->hash_count, file) == header->hash_count;
+    if (fclose(file) != 0 || !ok)
+    {
+        fprintf(stderr, "Failed to write multi-proof file: %s\n", file_path);
+        return false;
+    }
+    return true;
+}
+
+MerkleProof *load_merkle_proof(const char *file_path)
+{
+    printf("merkle: Loading multi-proof from %s\n", file_path);
+
+    FILE *file = fopen(file_path, "rb");
+    if (!file)
+    {
+        fprintf(stderr, "Failed to open file for reading: %s\n", file_path);
+        return NULL;
+    }
+
+    merkle_proof_header_t header;
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, MERKLE_PROOF_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != MERKLE_PROOF_VERSION || header.digest_size != SHA256_DIGEST_LENGTH ||
+        header.index_count > header.leaf_count)
+    {
+        fprintf(stderr, "Not a multi-proof file: %s\n", file_path);
+        fclose(file);
+        return NULL;
+    }
+
+    // the counts come from the file, so they are checked against its size before allocating
+    struct stat st;
+    uint64_t expected = sizeof(header) + (uint64_t)header.index_count * (sizeof(uint32_t) + SHA256_DIGEST_LENGTH) +
+                        (uint64_t)header.hash_count * SHA256_DIGEST_LENGTH;
+    if (fstat(fileno(file), &st) != 0 || (uint64_t)st.st_size != expected)
+    {
+        fprintf(stderr, "Truncated multi-proof file: %s\n", file_path);
+        fclose(file);
+        return NULL;
+    }
+
+    MerkleProof *proof = merkle_proof_alloc(header.index_count, header.hash_count);
+    if (!proof)
+    {
+        fclose(file);
+        return NULL;
+    }
+    proof->header = header;
+    bool ok = fread(proof->indices, sizeof(uint32_t), header.index_count, file) == header.index_count &&
+              fread(proof->leaves, SHA256_DIGEST_LENGTH, header.index_count, file) == header.index_count &&
+              fread(proof->hashes, SHA256_DIGEST_LENGTH, header.hash_count, file) == header.hash_count;
+    fclose(file);
+    if (!ok)
+    {
+        free_merkle_proof(proof);
+        return NULL;
+    }
+    return proof;
+}
+
+// Fan-out of the volume trees, chosen when the filesystem was created
+int merkle_fanout(void)
+{
+    return sb.merkle_fanout >= 2 && sb.merkle_fanout <= MERKLE_MAX_FANOUT ? sb.merkle_fanout : 2;
+}
+
+int get_number_of_blocks(char *volume_path)
+{
+    return DATA_BLOCKS_PER_VOLUME;
+}
+
+// Leaf hash of a stored block, plaintext leaves have to decrypt the block
+void get_block_hash(int block_index, unsigned char *hash)
+{
+    printf("merkle: Getting block hash\n");
+
+    if (sb.merkle_leaf_format == MERKLE_LEAF_RECORD)
+    {
+        unsigned char nonce[crypto_aead_aes256gcm_NPUBBYTES];
+        unsigned char tag[crypto_aead_aes256gcm_ABYTES];
+        if (!read_volume_block_tag(block_index, nonce, tag))
+        {
+            memset(hash, 0, SHA256_DIGEST_LENGTH);
+            return;
+        }
+        compute_record_leaf(nonce, tag, hash);
+        return;
+    }
+
+    char block_data[BLOCK_SIZE];
+    read_volume_block_no_check(block_index, block_data);
+    compute_hash(block_data, BLOCK_SIZE, hash);
+}
+
+// Leaf over the nonce and GCM tag of a stored block, the tag already authenticates the ciphertext
+void compute_record_leaf(const unsigned char *nonce, const unsigned char *tag, unsigned char *hash)
+{
+    unsigned char record[crypto_aead_aes256gcm_NPUBBYTES + crypto_aead_aes256gcm_ABYTES];
+    memcpy(record, nonce, crypto_aead_aes256gcm_NPUBBYTES);
+    memcpy(record + crypto_aead_aes256gcm_NPUBBYTES, tag, crypto_aead_aes256gcm_ABYTES);
+    compute_hash(record, sizeof(record), hash);
+}
+
+// No block of a new volume is written yet, so its tree starts empty
+MerkleTree *initialize_merkle_tree_for_volume(char *volume_path)
+{
+    printf("merkle: Initializing merkle tree\n");
+    return create_empty_merkle_tree(get_number_of_blocks(volume_path), merkle_fanout());
+}
+
+typedef struct merkle_leaf_job
+{
+    int volume_index;              // Volume whose blocks are hashed
+    bitmap_t *bmp;                 // Allocation bitmap of the volume
+    unsigned char **block_hashes;  // Leaf hash of each block
+} merkle_leaf_job_t;
+
+static void hash_volume_leaf(void *arg, int i)
+{
+    merkle_leaf_job_t *job = arg;
+    if (is_bit_free(job->bmp->datablock_bmp, i))
+    {
+        memset(job->block_hashes[i], 0, SHA256_DIGEST_LENGTH); // Unused blocks are empty leaves
+    }
+    else
+    {
+        get_block_hash(job->volume_index * DATA_BLOCKS_PER_VOLUME + i, job->block_hashes[i]);
+    }
+}
+
+// Recompute every leaf from the stored blocks of the volume and rebuild the tree
+MerkleTree *rebuild_merkle_tree_for_volume(int volume_index)
+{
+    printf("merkle: Rebuilding merkle tree for volume %d\n", volume_index);
+
+    char volume_id[12];
+    snprintf(volume_id, sizeof(volume_id), "%d", volume_index);
+    bitmap_t bmp;
+    memset(&bmp, 0, sizeof(bmp));
+    read_bitmap(volume_id, &bmp);
+
+    int num_blocks = get_number_of_blocks(sb.volumes[volume_index].volume_path);
+    unsigned char **block_hashes = malloc(num_blocks * sizeof(unsigned char *));
+    for (int i = 0; i < num_blocks; i++)
+    {
+        block_hashes[i] = malloc(SHA256_DIGEST_LENGTH);
+    }
+
+    // every leaf decrypts its own block, so the leaves are hashed in parallel
+    merkle_leaf_job_t job = {volume_index, &bmp, block_hashes};
+    merkle_parallel_for(num_blocks, hash_volume_leaf, &job);
+
+    MerkleTree *tree = build_merkle_tree(block_hashes, num_blocks, merkle_fanout());
+    if (tree)
+    {
+        tree->volume = volume_index;
+    }
+
+    for (int i = 0; i < num_blocks; i++)
+    {
+        free(block_hashes[i]);
+    }
+    free(block_hashes);
+
+    return tree;
+}
+
+// Load the tree of a volume, upgrading trees stored in the legacy text format
+MerkleTree *load_merkle_tree_for_volume(int volume_index)
+{
+    const char *merkle_path = sb.volumes[volume_index].merkle_path;
+    MerkleTree *tree = load_merkle_tree_from_file(merkle_path);
+    if (tree && tree->fd < 0)
+    {
+        // text format leaves hashed the block only up to its first NUL byte
+        MerkleTree *rebuilt = rebuild_merkle_tree_for_volume(volume_index);
+        if (rebuilt)
+        {
+            free_merkle_tree(tree);
+            tree = rebuilt;
+            save_merkle_tree_to_file(tree, merkle_path);
+        }
+    }
+    if (tree)
+    {
+        tree->volume = volume_index;
+        __atomic_store_n(&volume_files_dirty[volume_index], tree->file_dirty, __ATOMIC_RELEASE);
+    }
+    return tree;
+}
+
+// Volumes whose stored tree did not match the superblock, their blocks fail to read until rebuilt
+static int rejected_volume_trees[NUMVOLUMES];
+
+// Refuse the tree of a volume, e.g. once its recorded root is found to be wrong
+void reject_volume_tree(int volume_index)
+{
+    __atomic_store_n(&rejected_volume_trees[volume_index], 1, __ATOMIC_RELEASE);
+}
+
+bool volume_tree_rejected(int volume_index)
+{
+    return volume_index >= 0 && volume_index < NUMVOLUMES && __atomic_load_n(&rejected_volume_trees[volume_index], __ATOMIC_ACQUIRE);
+}
+
+// Load the tree of a volume into the superblock and check it against the recorded root. A tree
+// whose root does not match is not published, a stored tree rewritten to fit replayed blocks
+// would otherwise verify them.
+static void load_volume_tree(void *arg, int i)
+{
+    (void)arg;
+    if (volume_tree_rejected(i))
+    {
+        return;
+    }
+
+    MerkleTree *tree = load_merkle_tree_for_volume(i);
+    if (tree && sb.merkle_roots_valid && !compare_hashes(merkle_root_hash(tree), sb.volume_roots[i]))
+    {
+        printf("merkle: Root of volume %d does not match the superblock, its blocks cannot be read until the trees are rebuilt\n", i);
+        free_merkle_tree(tree);
+        reject_volume_tree(i);
+        return;
+    }
+    publish_merkle_tree(i, tree);
+}
+
+// Load the trees of the first volume_count volumes concurrently
+void load_merkle_trees(int volume_count)
+{
+    merkle_parallel_for(volume_count, load_volume_tree, NULL);
+}
+
+static void rebuild_volume_tree(void *arg, int i)
+{
+    (void)arg;
+    MerkleTree *tree = rebuild_merkle_tree_for_volume(i);
+    if (!tree)
+    {
+        return;
+    }
+
+    // snapshots keep the nodes the rebuild replaces
+    MerkleTree *old = sb.volumes[i].merkle_tree ? sb.volumes[i].merkle_tree : load_merkle_tree_from_file(sb.volumes[i].merkle_path);
+    if (old && old->node_count == tree->node_count)
+    {
+        for (int j = 0; j < tree->node_count; j++)
+        {
+            if (!compare_hashes(old->nodes[j].hash, tree->nodes[j].hash))
+            {
+                snapshot_preserve_node(i, j, old->nodes[j].hash);
+            }
+        }
+    }
+    if (old != sb.volumes[i].merkle_tree)
+    {
+        free_merkle_tree(old);
+    }
+    // the old tree maps the file rewritten below, so its readers have to be gone first
+    publish_merkle_tree(i, tree);
+    merkle_rcu_synchronize();
+    save_merkle_tree_to_file(tree, sb.volumes[i].merkle_path);
+    checkpoint_merkle_tree(tree, sb.volumes[i].merkle_path);
+    // the caller records the rebuilt root in the superblock
+    __atomic_store_n(&rejected_volume_trees[i], 0, __ATOMIC_RELEASE);
+}
+
+// Rebuild the trees of the first volume_count volumes from their blocks concurrently,
+// used to recover trees that were not checkpointed before a crash
+void rebuild_merkle_trees(int volume_count)
+{
+    printf("merkle: Rebuilding merkle trees of %d volumes\n", volume_count);
+    // rebuilt trees use record leaves, which moves older filesystems off plaintext leaves
+    sb.merkle_leaf_format = MERKLE_LEAF_RECORD;
+    merkle_parallel_for(volume_count, rebuild_volume_tree, NULL);
+
+    // the root of roots is updated on this thread, the volume root tree is shared
+    for (int i = 0; i < volume_count; i++)
+    {
+        set_volume_root(i);
+    }
+    write_superblock_roots(&sb);
+}
+
+// Checkpoint and release the least recently used volume trees until at most max_resident remain
+void evict_merkle_trees(int max_resident)
+{
+    for (;;)
+    {
+        int resident = 0;
+        int victim = -1;
+        for (int i = 0; i < NUMVOLUMES; i++)
+        {
+            MerkleTree *tree = sb.volumes[i].merkle_tree;
+            if (tree)
+            {
+                resident++;
+                if (victim < 0 || __atomic_load_n(&tree->last_access, __ATOMIC_RELAXED) <
+                                      __atomic_load_n(&sb.volumes[victim].merkle_tree->last_access, __ATOMIC_RELAXED))
+                {
+                    victim = i;
+                }
+            }
+        }
+        if (resident <= max_resident)
+        {
+            return;
+        }
+
+        printf("merkle: Evicting merkle tree of volume %d\n", victim);
+        checkpoint_merkle_tree(sb.volumes[victim].merkle_tree, sb.volumes[victim].merkle_path);
+        publish_merkle_tree(victim, NULL);
+        report_merkle_memory();
+    }
+}
+
+// Release a tree with its arena and file mapping in bulk, the tree file is closed
+void free_merkle_tree(MerkleTree *tree)
+{
+    if (!tree)
+    {
+        return;
+    }
+    if (tree->map)
+    {
+        munmap(tree->map, tree->map_size);
+    }
+    munmap(tree->arena.base, tree->arena.size);
+    if (tree->fd >= 0)
+    {
+        close(tree->fd);
+    }
+    reset_merkle_pages(&tree->pages);
+    free(tree->version);
+    free(tree);
+}
+
+// Bytes of address space held by a tree and how many of them are mapped into memory. The page table
+// entries are read from /proc/self/pagemap, mincore would also count file pages that are only cached.
+void merkle_tree_footprint(MerkleTree *tree, size_t *reserved, size_t *resident)
+{
+    *reserved = 0;
+    *resident = 0;
+    if (!tree)
+    {
+        return;
+    }
+
+    long page_size = sysconf(_SC_PAGESIZE);
+    int pagemap = open("/proc/self/pagemap", O_RDONLY);
+    unsigned char *regions[2] = {tree->arena.base, tree->map};
+    size_t sizes[2] = {tree->arena.size, tree->map_size};
+    for (int r = 0; r < 2; r++)
+    {
+        if (!regions[r])
+        {
+            continue;
+        }
+        *reserved += sizes[r];
+
+        size_t pages = (sizes[r] + page_size - 1) / page_size;
+        uint64_t *entries = malloc(pages * sizeof(uint64_t));
+        off_t offset = (uintptr_t)regions[r] / page_size * sizeof(uint64_t);
+        if (entries && pagemap >= 0 && pread(pagemap, entries, pages * sizeof(uint64_t), offset) == (ssize_t)(pages * sizeof(uint64_t)))
+        {
+            for (size_t i = 0; i < pages; i++)
+            {
+                *resident += (entries[i] >> 63) ? page_size : 0; // Present bit
+            }
+        }
+        free(entries);
+    }
+    if (pagemap >= 0)
+    {
+        close(pagemap);
+    }
+}
+
+static void release_merkle_mapping(void *map, size_t size)
+{
+    munmap(map, size);
+}
+
+void save_merkle_tree_to_file(MerkleTree *tree, const char *file_path)
+{
+    printf("merkle: Saving merkle tree to file\n");
+
+    printf("merkle: File path: %s\n", file_path);
+
+    if (!tree)
+    {
+        fprintf(stderr, "No merkle tree to save: %s\n", file_path);
+        return;
+    }
+
+    merkle_file_header_t header = {0};
+    memcpy(header.magic, MERKLE_FILE_MAGIC, sizeof(header.magic));
+    header.version = MERKLE_FILE_VERSION;
+    header.digest_size = SHA256_DIGEST_LENGTH;
+    header.leaf_count = tree->num_leaves;
+    header.level_count = tree->level_count;
+    header.node_count = tree->node_count;
+    header.fanout = tree->fanout;
+    header.hash_algorithm = get_hash_algorithm();
+
+    // the nodes are stored exactly as they are laid out in memory
+    size_t nodes_size = (size_t)tree->node_count * sizeof(MerkleNode);
+
+    // the file stays open so later updates can be written in place
+    if (tree->fd < 0)
+    {
+        tree->fd = open(file_path, O_RDWR | O_CREAT, 0644);
+    }
+    if (tree->fd < 0)
+    {
+        fprintf(stderr, "Failed to open file for writing: %s\n", file_path);
+        return;
+    }
+
+    // a tree mapped from this file moves its nodes into the arena, they may move within the file
+    if (tree->map)
+    {
+        MerkleNode *mapped = tree->nodes;
+        merkle_tree_alloc_nodes(tree);
+        for (int i = 0; i < tree->node_count; i++)
+        {
+            if (!merkle_node_is_empty(mapped[i].hash))
+            {
+                memcpy(tree->nodes[i].hash, mapped[i].hash, SHA256_DIGEST_LENGTH);
+            }
+        }
+        // lock-free readers may still walk the old mapping
+        merkle_rcu_retire(tree->map, tree->map_size, release_merkle_mapping);
+        tree->map = NULL;
+        tree->map_size = 0;
+    }
+    tree->data_offset = sizeof(header);
+
+    // empty nodes are left as holes, truncating first drops the old contents
+    bool ok = ftruncate(tree->fd, 0) == 0 && ftruncate(tree->fd, sizeof(header) + nodes_size) == 0 &&
+              pwrite(tree->fd, &header, sizeof(header), 0) == sizeof(header);
+    for (int i = 0; ok && i < tree->node_count;)
+    {
+        if (merkle_node_is_empty(tree->nodes[i].hash))
+        {
+            i++;
+            continue;
+        }
+        int run = 1;
+        while (i + run < tree->node_count && !merkle_node_is_empty(tree->nodes[i + run].hash))
+        {
+            run++;
+        }
+        size_t len = run * sizeof(MerkleNode);
+        ok = pwrite(tree->fd, &tree->nodes[i], len, sizeof(header) + (off_t)i * sizeof(MerkleNode)) == (ssize_t)len;
+        i += run;
+    }
+    if (!ok)
+    {
+        fprintf(stderr, "Failed to write merkle tree file: %s\n", file_path);
+    }
+    clear_merkle_dirty(tree);
+    tree->file_dirty = false;
+
+    // the nodes are read back through a private mapping, so the lower levels can be paged
+    size_t map_size = sizeof(header) + nodes_size;
+    void *data = ok ? mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, tree->fd, 0) : MAP_FAILED;
+    if (data != MAP_FAILED)
+    {
+        madvise(tree->arena.base, merkle_arena_align(nodes_size), MADV_DONTNEED); // Releases the arena copy
+        tree->map = data;
+        tree->map_size = map_size;
+        tree->nodes = (MerkleNode *)(tree->map + tree->data_offset);
+        reset_merkle_pages(&tree->pages);
+        pin_merkle_levels(tree);
+    }
+
+    printf("Merkle tree saved to file\n");
+}
+
+// Remember a node for the next sync, the bitmap keeps each node in the list once
+static void mark_merkle_node_dirty(MerkleTree *tree, int index)
+{
+    if (tree->dirty_map[index / 8] & (1 << (index % 8)))
+    {
+        return;
+    }
+    tree->dirty[tree->dirty_count++] = index;
+    tree->dirty_map[index / 8] |= 1 << (index % 8);
+}
+
+static void clear_merkle_dirty(MerkleTree *tree)
+{
+    for (int i = 0; i < tree->dirty_count; i++)
+    {
+        tree->dirty_map[tree->dirty[i] / 8] &= ~(1 << (tree->dirty[i] % 8));
+    }
+    tree->dirty_count = 0;
+}
+
+// Remember the nodes on the path from a leaf to the root for the next sync
+void mark_merkle_path_dirty(MerkleTree *tree, int block_index)
+{
+    int pos = block_index;
+    for (int l = 0; l < tree->level_count; l++, pos /= tree->fanout)
+    {
+        mark_merkle_node_dirty(tree, tree->level_offset[l] + pos);
+    }
+}
+
+static int compare_ints(const void *a, const void *b)
+{
+    int x = *(const int *)a;
+    int y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+// Set MERKLE_FILE_DIRTY in the tree file before it is changed, checkpoint_merkle_tree clears it
+static void set_merkle_file_dirty(MerkleTree *tree)
+{
+    if (tree->fd < 0 || tree->file_dirty)
+    {
+        return;
+    }
+    uint32_t flags = MERKLE_FILE_DIRTY;
+    pwrite(tree->fd, &flags, sizeof(flags), offsetof(merkle_file_header_t, flags));
+    tree->file_dirty = true;
+    if (tree->volume >= 0)
+    {
+        __atomic_store_n(&volume_files_dirty[tree->volume], 1, __ATOMIC_RELEASE);
+    }
+}
+
+// Write the dirty slots into the tree file instead of rewriting the whole tree
+void sync_merkle_tree(MerkleTree *tree, const char *file_path)
+{
+    printf("merkle: Syncing %d dirty merkle nodes\n", tree ? tree->dirty_count : 0);
+
+    if (!tree)
+    {
+        return;
+    }
+
+    if (tree->fd < 0)
+    {
+        // the file was never written in the binary format
+        save_merkle_tree_to_file(tree, file_path);
+        return;
+    }
+
+    if (tree->dirty_count == 0)
+    {
+        return;
+    }
+
+    set_merkle_file_dirty(tree);
+
+    // adjacent nodes, like the leaves of one batch, go out in a single write
+    qsort(tree->dirty, tree->dirty_count, sizeof(int), compare_ints);
+    for (int i = 0; i < tree->dirty_count;)
+    {
+        int run = 1;
+        while (i + run < tree->dirty_count && tree->dirty[i + run] == tree->dirty[i] + run)
+        {
+            run++;
+        }
+        size_t len = run * sizeof(MerkleNode);
+        off_t offset = tree->data_offset + (off_t)tree->dirty[i] * sizeof(MerkleNode);
+        if (pwrite(tree->fd, &tree->nodes[tree->dirty[i]], len, offset) != (ssize_t)len)
+        {
+            fprintf(stderr, "Failed to update merkle tree file: %s\n", file_path);
+        }
+        i += run;
+    }
+    clear_merkle_dirty(tree);
+}
+
+// Flush outstanding updates and mark the tree file consistent, called on unmount
+void checkpoint_merkle_tree(MerkleTree *tree, const char *file_path)
+{
+    printf("merkle: Checkpointing merkle tree %s\n", file_path);
+
+    if (!tree)
+    {
+        return;
+    }
+
+    sync_merkle_tree(tree, file_path);
+    // leaves still queued for the updater are not in the file yet
+    bool pending = tree->volume >= 0 && merkle_updater_pending(tree->volume);
+    if (tree->fd >= 0 && tree->file_dirty && !pending)
+    {
+        uint32_t flags = 0;
+        pwrite(tree->fd, &flags, sizeof(flags), offsetof(merkle_file_header_t, flags));
+        tree->file_dirty = false;
+        if (tree->volume >= 0)
+        {
+            __atomic_store_n(&volume_files_dirty[tree->volume], 0, __ATOMIC_RELEASE);
+        }
+    }
+    if (tree->fd >= 0)
+    {
+        fsync(tree->fd);
+    }
+}
+
+// Legacy text format loader, kept so that trees written before the binary format still mount.
+// Only the leaves are taken from the file, the interior nodes are recomputed.
+static MerkleTree *load_merkle_tree_text(FILE *file)
+{
+    char line[128];
+    unsigned char **block_hashes = NULL;
+    int num_blocks = 0;
+
+    while (fgets(line, sizeof(line), file))
+    {
+        char hash[66];
+        int block_index;
+        if (sscanf(line, "%65s %d", hash, &block_index) != 2 || block_index < 0)
+        {
+            continue; // interior node or left/right/null marker
+        }
+        if (block_index >= num_blocks)
+        {
+            unsigned char **grown = realloc(block_hashes, (block_index + 1) * sizeof(unsigned char *));
+            if (!grown)
+            {
+                break;
+            }
+            block_hashes = grown;
+            for (int i = num_blocks; i <= block_index; i++)
+            {
+                block_hashes[i] = NULL;
+            }
+            num_blocks = block_index + 1;
+        }
+        if (strlen(hash) < 2 * SHA256_DIGEST_LENGTH)
+        {
+            continue;
+        }
+        free(block_hashes[block_index]);
+        block_hashes[block_index] = malloc(SHA256_DIGEST_LENGTH);
+        if (block_hashes[block_index])
+        {
+            hex_to_hash(hash, block_hashes[block_index], SHA256_DIGEST_LENGTH);
+        }
+    }
+
+    MerkleTree *tree = NULL;
+    bool complete = num_blocks > 0;
+    for (int i = 0; i < num_blocks; i++)
+    {
+        complete = complete && block_hashes[i];
+    }
+    if (complete)
+    {
+        tree = build_merkle_tree(block_hashes, num_blocks, 2); // text trees were binary
+    }
+    else
+    {
+        fprintf(stderr, "Failed to read node data.\n");
+    }
+
+    for (int i = 0; i < num_blocks; i++)
+    {
+        free(block_hashes[i]);
+    }
+    free(block_hashes);
+    return tree;
+}
+
+// Use the nodes of a mapped binary file in place
+static MerkleTree *load_merkle_tree_binary(unsigned char *data, size_t size)
+{
+    const merkle_file_header_t *header = (const merkle_file_header_t *)data;
+    if (header->version < 1 || header->version > MERKLE_FILE_VERSION || header->digest_size != sizeof(MerkleNode) ||
+        header->leaf_count == 0 || header->leaf_count > INT32_MAX)
+    {
+        fprintf(stderr, "Unsupported merkle tree file version %u\n", header->version);
+        return NULL;
+    }
+
+    // version 1 files are binary trees with a shorter header
+    size_t header_size = header->version == 1 ? MERKLE_FILE_V1_HEADER_SIZE : sizeof(*header);
+    uint32_t fanout = header->version == 1 ? 2 : header->fanout;
+    if (size < header_size || fanout < 2 || fanout > MERKLE_MAX_FANOUT)
+    {
+        fprintf(stderr, "Corrupt merkle tree file header\n");
+        return NULL;
+    }
+    uint32_t algorithm = header->version == 1 ? HASH_SHA256 : header->hash_algorithm;
+    if (algorithm != (uint32_t)get_hash_algorithm())
+    {
+        fprintf(stderr, "Merkle tree file uses %s, the filesystem uses %s\n", hash_algorithm_name(algorithm),
+                hash_algorithm_name(get_hash_algorithm()));
+        return NULL;
+    }
+
+    MerkleTree *tree = merkle_tree_alloc(header->leaf_count, fanout);
+    if (!tree)
+    {
+        return NULL;
+    }
+    if (header->level_count != (uint32_t)tree->level_count || header->node_count != (uint32_t)tree->node_count ||
+        size < header_size + (size_t)tree->node_count * sizeof(MerkleNode))
+    {
+        fprintf(stderr, "Corrupt merkle tree file header\n");
+        free_merkle_tree(tree);
+        return NULL;
+    }
+
+    tree->nodes = (MerkleNode *)(data + header_size);
+    tree->data_offset = header_size;
+    tree->map = data;
+    tree->map_size = size;
+    pin_merkle_levels(tree);
+
+    tree->file_dirty = (header->flags & MERKLE_FILE_DIRTY) != 0;
+    if (tree->file_dirty)
+    {
+        printf("merkle: Tree file was not checkpointed, updates may be missing, run rebuild to recover\n");
+    }
+    return tree;
+}
+
+MerkleTree *load_merkle_tree_from_file(const char *file_path)
+{
+    printf("merkle: Loading merkle tree from file\n");
+    int fd = open(file_path, O_RDWR);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Failed to open file for reading: %s\n", file_path);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= MERKLE_FILE_V1_HEADER_SIZE)
+    {
+        // private mapping: pages are read on first touch and updates reach the file through sync_merkle_tree
+        void *data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED)
+        {
+            if (memcmp(((merkle_file_header_t *)data)->magic, MERKLE_FILE_MAGIC, sizeof(MERKLE_FILE_MAGIC)) == 0)
+            {
+                MerkleTree *tree = load_merkle_tree_binary(data, st.st_size);
+                if (tree)
+                {
+                    tree->fd = fd;
+                }
+                else
+                {
+                    munmap(data, st.st_size);
+                    close(fd);
+                }
+                return tree;
+            }
+            munmap(data, st.st_size);
+        }
+    }
+
+    // not a binary tree file, fall back to the text format
+    FILE *file = fdopen(fd, "rb");
+    if (!file)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    // the first sync rewrites the tree in the binary format
+    MerkleTree *tree = load_merkle_tree_text(file);
+    fclose(file);
+
+    return tree;
+}
+
+// Serializes tree lookups, updates and verification between FUSE operations and the scrubber.
+// Reads that verify against a published version do not take it.
+static pthread_mutex_t merkle_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Orders tree accesses for eviction, advanced by locked and lock-free accesses
+static unsigned long merkle_access_clock = 0;
+
+static void note_merkle_tree_access(MerkleTree *tree)
+{
+    __atomic_store_n(&tree->last_access, __atomic_add_fetch(&merkle_access_clock, 1, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+}
+
+static void release_merkle_version(void *version, size_t size)
+{
+    (void)size;
+    free(version);
+}
+
+static void release_merkle_tree(void *tree, size_t size)
+{
+    (void)size;
+    free_merkle_tree(tree);
+}
+
+// Publish the current root of a tree for lock-free readers. The version it replaces is released
+// once no reader can hold it.
+static void publish_merkle_version(MerkleTree *tree)
+{
+    merkle_version_t *version = malloc(sizeof(merkle_version_t));
+    if (!version)
+    {
+        return; // readers keep the old version, their mismatches are checked under merkle_lock
+    }
+    memcpy(version->root, merkle_root_hash(tree), SHA256_DIGEST_LENGTH);
+    version->generation = tree->version ? tree->version->generation + 1 : 1;
+    merkle_version_t *old = __atomic_exchange_n(&tree->version, version, __ATOMIC_ACQ_REL);
+    merkle_rcu_retire(old, sizeof(merkle_version_t), release_merkle_version);
+}
+
+// Make tree the tree of a volume, NULL unloads it. The replaced tree is released once no
+// lock-free reader can still use it.
+void publish_merkle_tree(int volume_index, MerkleTree *tree)
+{
+    if (tree)
+    {
+        publish_merkle_version(tree);
+    }
+    MerkleTree *old = __atomic_exchange_n(&sb.volumes[volume_index].merkle_tree, tree, __ATOMIC_ACQ_REL);
+    if (old != tree)
+    {
+        merkle_rcu_retire(old, 0, release_merkle_tree);
+    }
+}
+
+MerkleTree *get_merkle_tree_for_volume(char *volume_id)
+{
+    printf("merkle: Getting merkle tree for volume %s\n", volume_id);
+    extern superblock_t sb;
+
+    // volume id is the index of the volume in the superblock
+    int volume_index = atoi(volume_id);
+    if (volume_index < 0 || volume_index >= sb.volume_count || volume_index >= NUMVOLUMES)
+    {
+        return NULL;
+    }
+    if (!sb.volumes[volume_index].merkle_tree)
+    {
+        // trees are loaded on first access, idle ones make room. A tree that does not match the
+        // superblock is refused by load_volume_tree and stays unloaded.
+        evict_merkle_trees(MERKLE_MAX_RESIDENT_TREES - 1);
+        load_volume_tree(NULL, volume_index);
+    }
+
+    MerkleTree *tree = sb.volumes[volume_index].merkle_tree;
+    if (tree)
+    {
+        note_merkle_tree_access(tree);
+    }
+    printf("merkle: Volume tree: %p\n", tree);
+    return tree;
+}
+
+// Leaves are the first num_leaves nodes, so the lookup is a bounds check
+MerkleNode *find_leaf_node_in_tree(MerkleTree *tree, int block_index)
+{
+    printf("merkle: Finding leaf node in tree\n");
+
+    if (!tree || block_index < 0 || block_index >= tree->num_leaves)
+    {
+        return NULL;
+    }
+
+    return &tree->nodes[block_index];
+}
+
+void update_merkle_node_for_block(char *volume_id, int block_index, const void *block_data)
+{
+    extern superblock_t sb;
+    printf("merkle: Updating merkle node for block\n");
+
+    pthread_mutex_lock(&merkle_lock);
+    MerkleTree *tree = get_merkle_tree_for_volume(volume_id);
+    MerkleNode *leaf_node = find_leaf_node_in_tree(tree, block_index);
+
+    if (leaf_node)
+    {
+        unsigned char new_hash[1][SHA256_DIGEST_LENGTH];
+        compute_hash(block_data, BLOCK_SIZE, new_hash[0]);
+        page_merkle_path(tree, block_index, block_index);
+        update_merkle_leaves(tree, &block_index, new_hash, 1);
+    }
+
+    printf("merkle: Syncing merkle tree to file\n");
+    // write only the updated path to file
+    sync_merkle_tree(tree, sb.volumes[atoi(volume_id)].merkle_path);
+    trim_merkle_pages(tree);
+    set_volume_root(atoi(volume_id));
+    write_superblock_roots(&sb);
+    pthread_mutex_unlock(&merkle_lock);
+}
+
+// Apply the leaf hashes of blocks written together, one batch and one sync per volume
+void update_merkle_nodes_for_blocks(const int *block_indices, unsigned char (*block_hashes)[SHA256_DIGEST_LENGTH], int count)
+{
+    extern superblock_t sb;
+    printf("merkle: Updating merkle nodes for %d blocks\n", count);
+
+    int *indices = malloc(count * sizeof(int));
+    unsigned char(*hashes)[SHA256_DIGEST_LENGTH] = malloc(count * sizeof(*hashes));
+    bool *done = calloc(count, sizeof(bool));
+    if (!indices || !hashes || !done)
+    {
+        free(indices);
+        free(hashes);
+        free(done);
+        return;
+    }
+
+    pthread_mutex_lock(&merkle_lock);
+    for (int i = 0; i < count; i++)
+    {
+        if (done[i])
+        {
+            continue;
+        }
+
+        int volume_id_int = block_indices[i] / DATA_BLOCKS_PER_VOLUME;
+        int n = 0;
+        for (int j = i; j < count; j++)
+        {
+            if (!done[j] && block_indices[j] / DATA_BLOCKS_PER_VOLUME == volume_id_int)
+            {
+                indices[n] = block_indices[j] % DATA_BLOCKS_PER_VOLUME;
+                memcpy(hashes[n], block_hashes[j], SHA256_DIGEST_LENGTH);
+                n++;
+                done[j] = true;
+            }
+        }
+
+        char volume_id[12];
+        snprintf(volume_id, sizeof(volume_id), "%d", volume_id_int);
+        MerkleTree *tree = get_merkle_tree_for_volume(volume_id);
+        if (tree)
+        {
+            for (int j = 0; j < n; j++)
+            {
+                page_merkle_path(tree, indices[j], indices[j]);
+            }
+            update_merkle_leaves(tree, indices, hashes, n);
+            sync_merkle_tree(tree, sb.volumes[volume_id_int].merkle_path);
+            trim_merkle_pages(tree);
+            set_volume_root(volume_id_int);
+        }
+    }
+    write_superblock_roots(&sb);
+    pthread_mutex_unlock(&merkle_lock);
+
+    free(indices);
+    free(hashes);
+    free(done);
+}
+
+// Mark the tree file of a volume as not checkpointed before a leaf of it is queued. A crash before
+// the updater applies the leaf then leaves the flag set, and loading the tree asks for a rebuild.
+void mark_volume_tree_dirty(int volume_index)
+{
+    if (volume_index < 0 || volume_index >= NUMVOLUMES || __atomic_load_n(&volume_files_dirty[volume_index], __ATOMIC_ACQUIRE))
+    {
+        return;
+    }
+
+    char volume_id[12];
+    snprintf(volume_id, sizeof(volume_id), "%d", volume_index);
+    pthread_mutex_lock(&merkle_lock);
+    MerkleTree *tree = get_merkle_tree_for_volume(volume_id);
+    if (tree && tree->fd >= 0 && !tree->file_dirty)
+    {
+        set_merkle_file_dirty(tree);
+        fdatasync(tree->fd); // the flag reaches the disk before the leaf can be lost
+    }
+    pthread_mutex_unlock(&merkle_lock);
+}
+
+// Root the blocks of a volume are verified against, the one recorded in the superblock. Superblocks
+// from before the roots were recorded only have the root of the loaded tree.
+void get_root_hash(char *volume_id, unsigned char *root_hash)
+{
+    int volume_index = atoi(volume_id);
+    if (sb.merkle_roots_valid && volume_index >= 0 && volume_index < NUMVOLUMES)
+    {
+        memcpy(root_hash, sb.volume_roots[volume_index], SHA256_DIGEST_LENGTH);
+        return;
+    }
+
+    MerkleTree *tree = get_merkle_tree_for_volume(volume_id);
+    if (tree)
+    {
+        memcpy(root_hash, merkle_root_hash(tree), SHA256_DIGEST_LENGTH);
+    }
+    else
+    {
+        memset(root_hash, 0, SHA256_DIGEST_LENGTH);
+    }
+}
+
+// Tree over the root hashes of all volumes, one leaf per volume slot, unused slots are zero
+static MerkleTree *volume_root_tree = NULL;
+
+static MerkleTree *get_volume_root_tree(void)
+{
+    if (!volume_root_tree)
+    {
+        unsigned char *roots[NUMVOLUMES];
+        for (int i = 0; i < NUMVOLUMES; i++)
+        {
+            roots[i] = sb.volume_roots[i];
+        }
+        volume_root_tree = build_merkle_tree(roots, NUMVOLUMES, 2);
+    }
+    return volume_root_tree;
+}
+
+// Total footprint of the loaded volume trees and the volume root tree
+void report_merkle_memory(void)
+{
+    size_t reserved_total = 0;
+    size_t resident_total = 0;
+    int trees = 0;
+    for (int i = 0; i <= NUMVOLUMES; i++)
+    {
+        MerkleTree *tree = i < NUMVOLUMES ? sb.volumes[i].merkle_tree : volume_root_tree;
+        if (tree)
+        {
+            size_t reserved, resident;
+            merkle_tree_footprint(tree, &reserved, &resident);
+            reserved_total += reserved;
+            resident_total += resident;
+            trees++;
+        }
+    }
+    printf("merkle: %d trees reserve %zu KB, %zu KB resident\n", trees, reserved_total / 1024, resident_total / 1024);
+}
+
+// Release every loaded tree, callers checkpoint the volume trees first
+void free_merkle_trees(void)
+{
+    for (int i = 0; i < NUMVOLUMES; i++)
+    {
+        publish_merkle_tree(i, NULL);
+    }
+    merkle_rcu_synchronize();
+    // rebuilt from the superblock roots on next use
+    free_merkle_tree(volume_root_tree);
+    volume_root_tree = NULL;
+}
+
+// Record the current root of a volume tree in the superblock and update the root of roots
+void set_volume_root(int volume_index)
+{
+    MerkleTree *tree = sb.volumes[volume_index].merkle_tree;
+    MerkleTree *roots = get_volume_root_tree();
+    if (!tree || !roots)
+    {
+        return;
+    }
+
+    publish_merkle_version(tree);
+    unsigned char root_hash[1][SHA256_DIGEST_LENGTH];
+    memcpy(root_hash[0], merkle_root_hash(tree), SHA256_DIGEST_LENGTH);
+    memcpy(sb.volume_roots[volume_index], root_hash[0], SHA256_DIGEST_LENGTH);
+    update_merkle_leaves(roots, &volume_index, root_hash, 1);
+    memcpy(sb.root_of_roots, merkle_root_hash(roots), SHA256_DIGEST_LENGTH);
+    sb.merkle_roots_valid = 1;
+}
+
+// One comparison confirms that the recorded volume roots belong to the stored root of roots.
+// This is a consistency check, not an authentication: the root of roots is an unkeyed hash in the
+// superblock, which is stored in the clear, so whoever can write the superblock can replace the
+// volume roots and recompute it, or clear merkle_roots_valid to have them recorded again. It
+// catches a damaged or partly written superblock and trees that do not match it, and the roots
+// are only as trustworthy as the superblock file they are read from.
+bool verify_root_of_roots(void)
+{
+    MerkleTree *roots = get_volume_root_tree();
+    return sb.merkle_roots_valid && roots && compare_hashes(merkle_root_hash(roots), sb.root_of_roots);
+}
+
+// Verify the stored block against the volume root
+bool verify_block_integrity(int block_index)
+{
+    printf("merkle: Verifying block integrity\n");
+
+    // read the hash from the block
+    unsigned char block_hash[SHA256_DIGEST_LENGTH];
+    get_block_hash(block_index, block_hash);
+
+    return verify_block_leaf(block_index, block_hash);
+}
+
+// Verify count adjacent leaves of a volume tree from first against the version published last,
+// without merkle_lock. A writer may change the path while it is read, the nodes are read with
+// load_merkle_hash so that is a race on atomics, and only a match is final. Callers verify again
+// under the lock otherwise.
+static bool verify_published_leaves(int volume_index, int first, int count, unsigned char (*leaf_hashes)[SHA256_DIGEST_LENGTH])
+{
+    if (volume_index >= NUMVOLUMES || count <= 0 || !merkle_rcu_read_begin())
+    {
+        return false;
+    }
+
+    MerkleTree *tree = __atomic_load_n(&sb.volumes[volume_index].merkle_tree, __ATOMIC_ACQUIRE);
+    merkle_version_t *version = tree ? __atomic_load_n(&tree->version, __ATOMIC_ACQUIRE) : NULL;
+    bool verified = false;
+    bool logged = true;
+    if (version && first + count <= tree->num_leaves)
+    {
+        verified = verify_merkle_leaves(tree, first, count, leaf_hashes, version->root, true);
+        if (verified)
+        {
+            printf("merkle: Verified against version %lu without locking\n", (unsigned long)version->generation);
+            note_merkle_tree_access(tree);
+            logged = visit_merkle_path_pages(tree, first, first + count - 1, log_merkle_page);
+        }
+    }
+    merkle_rcu_read_end();
+
+    if (!logged)
+    {
+        // the log is full, the paths are listed under the lock and the log is emptied
+        pthread_mutex_lock(&merkle_lock);
+        tree = sb.volumes[volume_index].merkle_tree;
+        if (tree && first + count <= tree->num_leaves)
+        {
+            page_merkle_path(tree, first, first + count - 1);
+            trim_merkle_pages(tree);
+        }
+        pthread_mutex_unlock(&merkle_lock);
+    }
+    return verified;
+}
+
+// Verify a leaf hash the caller computed from the block it already read
+bool verify_block_leaf(int block_index, const unsigned char *block_hash)
+{
+    // a leaf still queued for the updater is checked against the digest of the last write
+    unsigned char queued_hash[SHA256_DIGEST_LENGTH];
+    if (merkle_updater_lookup(block_index, queued_hash))
+    {
+        return compare_hashes(block_hash, queued_hash);
+    }
+
+    unsigned char leaf_hash[1][SHA256_DIGEST_LENGTH];
+    memcpy(leaf_hash[0], block_hash, SHA256_DIGEST_LENGTH);
+    if (verify_published_leaves(block_index / DATA_BLOCKS_PER_VOLUME, block_index % DATA_BLOCKS_PER_VOLUME, 1, leaf_hash))
+    {
+        return true;
+    }
+
+    char volume_id[12];
+    int volume_id_int = block_index / DATA_BLOCKS_PER_VOLUME;
+    snprintf(volume_id, sizeof(volume_id), "%d", volume_id_int);
+
+    int block_index_in_volume = block_index % DATA_BLOCKS_PER_VOLUME;
+
+    pthread_mutex_lock(&merkle_lock);
+    MerkleTree *tree = get_merkle_tree_for_volume(volume_id);
+    MerkleNode *leaf_node = find_leaf_node_in_tree(tree, block_index_in_volume);
+    bool verified = false;
+    if (leaf_node)
+    {
+        unsigned char expected_root_hash[SHA256_DIGEST_LENGTH];
+        get_root_hash(volume_id, expected_root_hash);
+        page_merkle_path(tree, block_index_in_volume, block_index_in_volume);
+        verified = verify_merkle_path(tree, block_index_in_volume, expected_root_hash, block_hash);
+        trim_merkle_pages(tree);
+    }
+    pthread_mutex_unlock(&merkle_lock);
+
+    return verified;
+}
+
+// Copy the leaf hash the volume tree holds for a block, true if its path verified up to the root
+bool read_block_leaf(int block_index, unsigned char *block_hash)
+{
+    // a leaf still queued for the updater is newer than the one in the tree
+    if (merkle_updater_lookup(block_index, block_hash))
+    {
+        return true;
+    }
+
+    char volume_id[12];
+    int volume_id_int = block_index / DATA_BLOCKS_PER_VOLUME;
+    snprintf(volume_id, sizeof(volume_id), "%d", volume_id_int);
+
+    int block_index_in_volume = block_index % DATA_BLOCKS_PER_VOLUME;
+
+    pthread_mutex_lock(&merkle_lock);
+    MerkleTree *tree = get_merkle_tree_for_volume(volume_id);
+    MerkleNode *leaf_node = find_leaf_node_in_tree(tree, block_index_in_volume);
+    bool verified = false;
+    if (leaf_node)
+    {
+        unsigned char expected_root_hash[SHA256_DIGEST_LENGTH];
+        get_root_hash(volume_id, expected_root_hash);
+        page_merkle_path(tree, block_index_in_volume, block_index_in_volume);
+        memcpy(block_hash, leaf_node->hash, SHA256_DIGEST_LENGTH);
+        verified = verify_merkle_path(tree, block_index_in_volume, expected_root_hash, block_hash);
+        trim_merkle_pages(tree);
+    }
+    pthread_mutex_unlock(&merkle_lock);
+
+    return verified;
+}
+
+// Verify the leaf hashes of count adjacent blocks of one volume, starting at block_index
+bool verify_block_range(int block_index, int count, unsigned char (*block_hashes)[SHA256_DIGEST_LENGTH])
+{
+    char volume_id[12];
+    int volume_id_int = block_index / DATA_BLOCKS_PER_VOLUME;
+    snprintf(volume_id, sizeof(volume_id), "%d", volume_id_int);
+
+    int block_index_in_volume = block_index % DATA_BLOCKS_PER_VOLUME;
+
+    // the range is checked against the tree, so leaves still queued are applied first
+    merkle_updater_wait(block_index, count);
+    if (verify_published_leaves(volume_id_int, block_index_in_volume, count, block_hashes))
+    {
+        return true;
+    }
+
+    pthread_mutex_lock(&merkle_lock);
+    MerkleTree *tree = get_merkle_tree_for_volume(volume_id);
+    bool verified = false;
+    if (tree)
+    {
+        unsigned char expected_root_hash[SHA256_DIGEST_LENGTH];
+        get_root_hash(volume_id, expected_root_hash);
+        if (count > 0 && block_index_in_volume + count <= tree->num_leaves)
+        {
+            page_merkle_path(tree, block_index_in_volume, block_index_in_volume + count - 1);
+        }
+        verified = verify_merkle_range(tree, block_index_in_volume, count, block_hashes, expected_root_hash);
+        trim_merkle_pages(tree);
+    }
+    pthread_mutex_unlock(&merkle_lock);
+
+    return verified;
+}
+
+// Verify a leaf of an older version of a volume tree against the root recorded for it. Nodes changed
+// since then are looked up with read_node, the others are read from the live tree.
+bool verify_snapshot_leaf(int block_index, const unsigned char *block_hash, const unsigned char *expected_root_hash, merkle_node_reader_t read_node, void *ctx)
+{
+    char volume_id[12];
+    int volume_id_int = block_index / DATA_BLOCKS_PER_VOLUME;
+    snprintf(volume_id, sizeof(volume_id), "%d", volume_id_int);
+
+    pthread_mutex_lock(&merkle_lock);
+    MerkleTree *tree = get_merkle_tree_for_volume(volume_id);
+    int pos = block_index % DATA_BLOCKS_PER_VOLUME;
+    bool verified = false;
+    if (tree && pos < tree->num_leaves)
+    {
+        page_merkle_path(tree, pos, pos);
+        unsigned char hash[SHA256_DIGEST_LENGTH];
+        memcpy(hash, block_hash, SHA256_DIGEST_LENGTH);
+        for (int l = 0; l < tree->level_count - 1; l++, pos /= tree->fanout)
+        {
+            int first = pos - pos % tree->fanout;
+            int children = merkle_child_count(tree, l + 1, pos / tree->fanout);
+            if (children == 1)
+            {
+                continue; // No sibling, the hash is promoted unchanged
+            }
+
+            unsigned char concat_hash[MERKLE_MAX_FANOUT * SHA256_DIGEST_LENGTH];
+            for (int c = 0; c < children; c++)
+            {
+                unsigned char *child = concat_hash + c * SHA256_DIGEST_LENGTH;
+                if (first + c == pos)
+                {
+                    memcpy(child, hash, SHA256_DIGEST_LENGTH);
+                }
+                else if (!read_node(ctx, tree->level_offset[l] + first + c, child))
+                {
+                    memcpy(child, merkle_node_at(tree, l, first + c)->hash, SHA256_DIGEST_LENGTH);
+                }
+            }
+            merkle_hash_children(concat_hash, children, hash);
+        }
+        verified = compare_hashes(hash, expected_root_hash);
+        trim_merkle_pages(tree);
+    }
+    pthread_mutex_unlock(&merkle_lock);
+
+    return verified;
+}
+
+// Copy the recorded volume roots and root of roots, consistent with the trees at the time of the call
+void get_volume_roots(unsigned char (*volume_roots)[SHA256_DIGEST_LENGTH], unsigned char *root_of_roots)
+{
+    pthread_mutex_lock(&merkle_lock);
+    memcpy(volume_roots, sb.volume_roots, sizeof(sb.volume_roots));
+    memcpy(root_of_roots, sb.root_of_roots, SHA256_DIGEST_LENGTH);
+    pthread_mutex_unlock(&merkle_lock);
+}
@@ -0,0 +1,167 @@
+// File: merkle_rcu.c
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "merkle_rcu.h"
+
+// Epoch a reader entered with, 0 while it is outside a read section. Each slot has its own cache
+// line, so readers on different cores do not share one.
+typedef struct merkle_reader
+{
+    uint64_t epoch;
+    int claimed;
+    char padding[64 - sizeof(uint64_t) - sizeof(int)];
+} merkle_reader_t;
+
+static merkle_reader_t readers[MERKLE_RCU_MAX_READERS];
+static uint64_t merkle_epoch = 1;
+
+// Slot of the calling thread, claimed on its first read section and freed when the thread exits
+static __thread int reader_slot = -1;
+static pthread_key_t reader_key;
+static pthread_once_t reader_key_once = PTHREAD_ONCE_INIT;
+
+// Guards the retired list, writers retire with or without merkle_lock held
+static pthread_mutex_t retire_lock = PTHREAD_MUTEX_INITIALIZER;
+static merkle_retired_t *retired = NULL;
+
+static void release_reader_slot(void *slot)
+{
+    __atomic_store_n(&readers[(intptr_t)slot - 1].claimed, 0, __ATOMIC_RELEASE);
+}
+
+static void create_reader_key(void)
+{
+    pthread_key_create(&reader_key, release_reader_slot);
+}
+
+static bool claim_reader_slot(void)
+{
+    pthread_once(&reader_key_once, create_reader_key);
+    for (int i = 0; i < MERKLE_RCU_MAX_READERS; i++)
+    {
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&readers[i].claimed, &expected, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            reader_slot = i;
+            pthread_setspecific(reader_key, (void *)(intptr_t)(i + 1));
+            return true;
+        }
+    }
+    return false;
+}
+
+// Enter a read section, pointers published before it stay valid until merkle_rcu_read_end. False
+// if every reader slot is taken, the caller then reads under merkle_lock instead.
+bool merkle_rcu_read_begin(void)
+{
+    if (reader_slot < 0 && !claim_reader_slot())
+    {
+        return false;
+    }
+    __atomic_store_n(&readers[reader_slot].epoch, __atomic_load_n(&merkle_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+    // published pointers are only loaded after the epoch is visible to writers
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return true;
+}
+
+void merkle_rcu_read_end(void)
+{
+    __atomic_store_n(&readers[reader_slot].epoch, 0, __ATOMIC_RELEASE);
+}
+
+// Oldest epoch of the readers inside a read section, UINT64_MAX if there are none
+static uint64_t oldest_reader_epoch(void)
+{
+    uint64_t oldest = UINT64_MAX;
+    for (int i = 0; i < MERKLE_RCU_MAX_READERS; i++)
+    {
+        uint64_t epoch = __atomic_load_n(&readers[i].epoch, __ATOMIC_SEQ_CST);
+        if (epoch && epoch < oldest)
+        {
+            oldest = epoch;
+        }
+    }
+    return oldest;
+}
+
+// Release ptr once no reader can still use it, called after it was unpublished
+void merkle_rcu_retire(void *ptr, size_t size, void (*release)(void *ptr, size_t size))
+{
+    if (!ptr)
+    {
+        return;
+    }
+    merkle_retired_t *entry = malloc(sizeof(merkle_retired_t));
+    if (!entry)
+    {
+        merkle_rcu_synchronize(); // no room to defer it, wait for the readers instead
+        release(ptr, size);
+        return;
+    }
+    entry->ptr = ptr;
+    entry->size = size;
+    entry->release = release;
+    entry->epoch = __atomic_add_fetch(&merkle_epoch, 1, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_lock(&retire_lock);
+    entry->next = retired;
+    retired = entry;
+    pthread_mutex_unlock(&retire_lock);
+
+    merkle_rcu_reclaim();
+}
+
+// Release the retired memory no reader inside a read section can still use, without waiting
+void merkle_rcu_reclaim(void)
+{
+    // readers are scanned after the entries were added, a reader that entered later cannot
+    // have loaded what they unpublished
+    pthread_mutex_lock(&retire_lock);
+    uint64_t oldest = oldest_reader_epoch();
+    merkle_retired_t *done = NULL;
+    for (merkle_retired_t **link = &retired; *link;)
+    {
+        merkle_retired_t *entry = *link;
+        if (entry->epoch <= oldest)
+        {
+            *link = entry->next;
+            entry->next = done;
+            done = entry;
+        }
+        else
+        {
+            link = &entry->next;
+        }
+    }
+    pthread_mutex_unlock(&retire_lock);
+
+    while (done)
+    {
+        merkle_retired_t *next = done->next;
+        done->release(done->ptr, done->size);
+        free(done);
+        done = next;
+    }
+}
+
+// Wait until every read section that started before the call has ended and release all retired
+// memory. Must not be called inside a read section or while a reader waits for a lock the caller holds.
+void merkle_rcu_synchronize(void)
+{
+    uint64_t epoch = __atomic_add_fetch(&merkle_epoch, 1, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < MERKLE_RCU_MAX_READERS; i++)
+    {
+        for (;;)
+        {
+            uint64_t reader = __atomic_load_n(&readers[i].epoch, __ATOMIC_SEQ_CST);
+            if (reader == 0 || reader >= epoch)
+            {
+                break;
+            }
+            sched_yield();
+        }
+    }
+    merkle_rcu_reclaim();
+}
@@ -0,0 +1,333 @@
+// File: merkle_updater.c
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "merkle_updater.h"
+#include "merkle.h"
+#include "constants.h"
+
+// Open addressing table of the queued leaves, kept at most half full so probes stay short
+#define MERKLE_UPDATE_SLOTS (2 * MERKLE_UPDATE_QUEUE_SIZE)
+
+static pthread_t updater_thread;
+static bool updater_running = false;
+static bool updater_stop_requested = false;
+static unsigned int updater_lag_ms = MERKLE_UPDATE_DEFAULT_LAG_MS;
+
+// Guards the queue. Writers take it without holding merkle_lock, the updater releases it while
+// it applies a batch.
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_changed; // Signals the updater about new entries, flushes and stop
+static pthread_cond_t queue_applied; // Signals writers waiting for room and flushes after a batch
+
+static merkle_update_t queue[MERKLE_UPDATE_SLOTS];
+static int queue_count = 0;           // Used slots in queue
+static int volume_queued[NUMVOLUMES]; // Used slots per volume, their tree files are marked dirty
+static uint64_t next_seq = 1;         // Seq of the next queued digest
+static uint64_t applied_seq = 0;      // Every digest up to this seq is in the trees
+static uint64_t flush_seq = 0;        // A flush waits for the digests up to this seq
+static struct timespec first_queued;  // When the oldest entry of the next batch was queued
+
+// Only the updater thread uses the batch
+static int batch_indices[MERKLE_UPDATE_QUEUE_SIZE];
+static uint64_t batch_seqs[MERKLE_UPDATE_QUEUE_SIZE];
+static unsigned char batch_hashes[MERKLE_UPDATE_QUEUE_SIZE][SHA256_DIGEST_LENGTH];
+
+static void add_ms(struct timespec *ts, unsigned int ms)
+{
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (long)(ms % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000)
+    {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+static int merkle_update_home(int block_index)
+{
+    return ((uint32_t)block_index * 2654435761u) & (MERKLE_UPDATE_SLOTS - 1);
+}
+
+// Slot of the block, or the free slot where it would be inserted
+static merkle_update_t *find_merkle_update(int block_index)
+{
+    for (int i = merkle_update_home(block_index);; i = (i + 1) & (MERKLE_UPDATE_SLOTS - 1))
+    {
+        if (queue[i].block_index < 0 || queue[i].block_index == block_index)
+        {
+            return &queue[i];
+        }
+    }
+}
+
+// Free a slot and move later entries of its probe run back, so lookups never meet a gap
+static void remove_merkle_update(merkle_update_t *entry)
+{
+    const int mask = MERKLE_UPDATE_SLOTS - 1;
+    int hole = entry - queue;
+    int entry_volume = entry->block_index / DATA_BLOCKS_PER_VOLUME;
+    for (int i = (hole + 1) & mask; queue[i].block_index >= 0; i = (i + 1) & mask)
+    {
+        int home = merkle_update_home(queue[i].block_index);
+        if (((i - home) & mask) >= ((i - hole) & mask))
+        {
+            queue[hole] = queue[i];
+            hole = i;
+        }
+    }
+    volume_queued[entry_volume]--;
+    queue[hole].block_index = -1;
+    queue_count--;
+}
+
+// Take every queued leaf, apply them in one update per volume and drop the entries that were
+// not written again meanwhile. Called and returns with queue_lock held.
+static void apply_merkle_updates(void)
+{
+    int n = 0;
+    for (int i = 0; i < MERKLE_UPDATE_SLOTS; i++)
+    {
+        if (queue[i].block_index >= 0)
+        {
+            batch_indices[n] = queue[i].block_index;
+            batch_seqs[n] = queue[i].seq;
+            memcpy(batch_hashes[n], queue[i].digest, SHA256_DIGEST_LENGTH);
+            n++;
+        }
+    }
+    uint64_t batch_seq = next_seq - 1;
+
+    // readers keep using the queued digests until the trees have them
+    pthread_mutex_unlock(&queue_lock);
+    update_merkle_nodes_for_blocks(batch_indices, batch_hashes, n);
+    pthread_mutex_lock(&queue_lock);
+
+    for (int i = 0; i < n; i++)
+    {
+        merkle_update_t *entry = find_merkle_update(batch_indices[i]);
+        if (entry->block_index >= 0 && entry->seq == batch_seqs[i])
+        {
+            remove_merkle_update(entry);
+        }
+    }
+    applied_seq = batch_seq;
+    if (queue_count > 0)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &first_queued); // written again during the batch
+    }
+    pthread_cond_broadcast(&queue_applied);
+}
+
+static void *merkle_updater_main(void *arg)
+{
+    (void)arg;
+    printf("merkle_updater: Started, %u ms maximum lag\n", updater_lag_ms);
+
+    pthread_mutex_lock(&queue_lock);
+    while (!updater_stop_requested || queue_count > 0)
+    {
+        if (queue_count == 0)
+        {
+            pthread_cond_wait(&queue_changed, &queue_lock);
+            continue;
+        }
+
+        // more writes are coalesced until the oldest queued leaf reaches the lag
+        struct timespec deadline = first_queued;
+        add_ms(&deadline, updater_lag_ms);
+        while (!updater_stop_requested && flush_seq <= applied_seq && queue_count < MERKLE_UPDATE_BATCH)
+        {
+            if (pthread_cond_timedwait(&queue_changed, &queue_lock, &deadline) == ETIMEDOUT)
+            {
+                break;
+            }
+        }
+
+        apply_merkle_updates();
+    }
+    pthread_mutex_unlock(&queue_lock);
+
+    printf("merkle_updater: Stopped\n");
+    return NULL;
+}
+
+// Start the updater thread. Written leaves are then queued and reach the trees within lag_ms, or
+// sooner once MERKLE_UPDATE_BATCH blocks are queued. With a lag of 0 only leaves queued in the
+// background wait for the thread, which applies them at once.
+void merkle_updater_start(unsigned int lag_ms)
+{
+    if (updater_running)
+    {
+        return;
+    }
+
+    for (int i = 0; i < MERKLE_UPDATE_SLOTS; i++)
+    {
+        queue[i].block_index = -1;
+    }
+    queue_count = 0;
+    memset(volume_queued, 0, sizeof(volume_queued));
+    updater_lag_ms = lag_ms;
+    updater_stop_requested = false;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&queue_changed, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_cond_init(&queue_applied, NULL);
+
+    if (pthread_create(&updater_thread, NULL, merkle_updater_main, NULL) != 0)
+    {
+        printf("merkle_updater: Unable to start the updater thread, trees are updated on write\n");
+        return;
+    }
+    updater_running = true;
+}
+
+// Apply every queued leaf and stop the updater thread, later writes update the trees directly
+void merkle_updater_stop(void)
+{
+    if (!updater_running)
+    {
+        return;
+    }
+    pthread_mutex_lock(&queue_lock);
+    updater_stop_requested = true;
+    pthread_cond_signal(&queue_changed);
+    pthread_mutex_unlock(&queue_lock);
+    pthread_join(updater_thread, NULL);
+    updater_running = false;
+}
+
+// Queue the leaf hashes of written blocks for the updater, or update the trees at once when it is
+// not running. A lag of 0 also updates them at once, unless the caller does not need them in the
+// trees on return and passes in_background. Waits while the queue is full.
+void merkle_updater_queue(const int *block_indices, unsigned char (*block_hashes)[SHA256_DIGEST_LENGTH], int count, bool in_background)
+{
+    if (!updater_running || (updater_lag_ms == 0 && !in_background))
+    {
+        update_merkle_nodes_for_blocks(block_indices, block_hashes, count);
+        return;
+    }
+
+    // a crash loses the queued leaves, the flag in the tree file tells the next mount
+    for (int i = 0; i < count; i++)
+    {
+        mark_volume_tree_dirty(block_indices[i] / DATA_BLOCKS_PER_VOLUME);
+    }
+
+    pthread_mutex_lock(&queue_lock);
+    bool wake = false;
+    for (int i = 0; i < count; i++)
+    {
+        merkle_update_t *entry = find_merkle_update(block_indices[i]);
+        while (entry->block_index < 0 && queue_count >= MERKLE_UPDATE_QUEUE_SIZE)
+        {
+            pthread_cond_signal(&queue_changed);
+            pthread_cond_wait(&queue_applied, &queue_lock);
+            entry = find_merkle_update(block_indices[i]); // the table changed while waiting
+        }
+        if (entry->block_index < 0)
+        {
+            if (queue_count == 0)
+            {
+                clock_gettime(CLOCK_MONOTONIC, &first_queued);
+                wake = true;
+            }
+            entry->block_index = block_indices[i];
+            volume_queued[block_indices[i] / DATA_BLOCKS_PER_VOLUME]++;
+            queue_count++;
+        }
+        entry->seq = next_seq++;
+        memcpy(entry->digest, block_hashes[i], SHA256_DIGEST_LENGTH);
+    }
+    // the updater sleeps until the first entry arrives and then until the lag or a full batch
+    if (wake || queue_count >= MERKLE_UPDATE_BATCH)
+    {
+        pthread_cond_signal(&queue_changed);
+    }
+    pthread_mutex_unlock(&queue_lock);
+}
+
+// Copy the queued leaf hash of a block, false if the trees already hold its last write
+bool merkle_updater_lookup(int block_index, unsigned char *digest)
+{
+    if (!updater_running)
+    {
+        return false;
+    }
+
+    pthread_mutex_lock(&queue_lock);
+    merkle_update_t *entry = find_merkle_update(block_index);
+    bool queued = entry->block_index >= 0;
+    if (queued)
+    {
+        memcpy(digest, entry->digest, SHA256_DIGEST_LENGTH);
+    }
+    pthread_mutex_unlock(&queue_lock);
+    return queued;
+}
+
+// Wait until the trees hold the last write of count blocks from block_index, without waiting
+// for the lag when one of them is queued
+void merkle_updater_wait(int block_index, int count)
+{
+    if (!updater_running)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&queue_lock);
+    bool queued = false;
+    for (int i = 0; i < count && !queued; i++)
+    {
+        queued = find_merkle_update(block_index + i)->block_index >= 0;
+    }
+    pthread_mutex_unlock(&queue_lock);
+
+    if (queued)
+    {
+        merkle_updater_flush();
+    }
+}
+
+// True while leaves of the volume are queued, its tree file then has to stay marked dirty
+bool merkle_updater_pending(int volume_index)
+{
+    if (!updater_running)
+    {
+        return false;
+    }
+
+    pthread_mutex_lock(&queue_lock);
+    bool pending = volume_queued[volume_index] > 0;
+    pthread_mutex_unlock(&queue_lock);
+    return pending;
+}
+
+// Wait until every leaf queued before the call is in the trees
+void merkle_updater_flush(void)
+{
+    if (!updater_running)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&queue_lock);
+    uint64_t target = next_seq - 1;
+    if (flush_seq < target)
+    {
+        flush_seq = target;
+    }
+    pthread_cond_signal(&queue_changed);
+    while (applied_seq < target)
+    {
+        pthread_cond_wait(&queue_applied, &queue_lock);
+    }
+    pthread_mutex_unlock(&queue_lock);
+}
@@ -0,0 +1,269 @@
+// File: scrub.c
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "scrub.h"
+#include "volume.h"
+#include "bitmap.h"
+#include "constants.h"
+#include "crypto.h"
+
+static pthread_t scrub_thread;
+static bool scrub_running = false;
+static volatile sig_atomic_t scrub_stop_requested = 0;
+static volatile sig_atomic_t scrub_paused = 0;
+static volatile uint64_t scrub_rate = 0;
+
+static pthread_mutex_t progress_lock = PTHREAD_MUTEX_INITIALIZER;
+static scrub_progress_t progress;
+
+// Bytes read from the volume files for one block
+#define SCRUB_RECORD_SIZE (crypto_aead_aes256gcm_NPUBBYTES + BLOCK_SIZE + crypto_aead_aes256gcm_ABYTES)
+
+static void load_scrub_progress(void)
+{
+    FILE *file = fopen(SCRUB_PROGRESS_PATH, "rb");
+    if (file)
+    {
+        if (fread(&progress, sizeof(progress), 1, file) == 1 &&
+            memcmp(progress.magic, SCRUB_PROGRESS_MAGIC, sizeof(SCRUB_PROGRESS_MAGIC)) == 0)
+        {
+            fclose(file);
+            printf("scrub: Resuming at volume %u block %u\n", progress.volume, progress.block);
+            return;
+        }
+        fclose(file);
+    }
+    memset(&progress, 0, sizeof(progress));
+    memcpy(progress.magic, SCRUB_PROGRESS_MAGIC, sizeof(progress.magic));
+}
+
+static void save_scrub_progress(void)
+{
+    pthread_mutex_lock(&progress_lock);
+    progress.paused = scrub_paused;
+    scrub_progress_t copy = progress;
+    pthread_mutex_unlock(&progress_lock);
+
+    FILE *file = fopen(SCRUB_PROGRESS_PATH, "wb");
+    if (!file)
+    {
+        printf("scrub: Unable to save progress to %s\n", SCRUB_PROGRESS_PATH);
+        return;
+    }
+    fwrite(&copy, sizeof(copy), 1, file);
+    fclose(file);
+}
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Sleep in short steps so stop and pause requests are noticed, false if a stop was requested
+static bool scrub_sleep(double seconds)
+{
+    while (seconds > 0 && !scrub_stop_requested)
+    {
+        double step = seconds < 0.1 ? seconds : 0.1;
+        struct timespec ts = {(time_t)step, (long)((step - (time_t)step) * 1e9)};
+        nanosleep(&ts, NULL);
+        seconds -= step;
+    }
+    return !scrub_stop_requested;
+}
+
+// A block written while it is scrubbed can pair a new record with the old tree, so a failure is
+// only reported when a second read fails as well
+static bool scrub_block(int block_index)
+{
+    unsigned char block_data[BLOCK_SIZE];
+    return read_volume_block_checked(block_index, block_data) || read_volume_block_checked(block_index, block_data);
+}
+
+static void *scrub_main(void *arg)
+{
+    (void)arg;
+    printf("scrub: Started, %lu bytes per second\n", (unsigned long)scrub_rate);
+
+    // budget_bytes were read since budget_start, the rate limit sleeps until they fit the budget
+    double budget_start = now_seconds();
+    uint64_t budget_bytes = 0;
+    int loaded_volume = -1;
+    bitmap_t bmp;
+    int unsaved = 0;
+
+    while (!scrub_stop_requested)
+    {
+        if (scrub_paused)
+        {
+            scrub_sleep(0.5);
+            budget_start = now_seconds();
+            budget_bytes = 0;
+            continue;
+        }
+
+        if (progress.volume >= (uint32_t)sb.volume_count)
+        {
+            pthread_mutex_lock(&progress_lock);
+            printf("scrub: Pass %u done, %lu blocks checked, %lu failed\n", progress.passes + 1,
+                   (unsigned long)progress.blocks_checked, (unsigned long)progress.errors);
+            progress.passes++;
+            progress.last_errors = progress.errors;
+            progress.errors = 0;
+            progress.blocks_checked = 0;
+            progress.volume = 0;
+            progress.block = 0;
+            pthread_mutex_unlock(&progress_lock);
+            save_scrub_progress();
+            loaded_volume = -1;
+
+            scrub_sleep(SCRUB_PASS_INTERVAL);
+            budget_start = now_seconds();
+            budget_bytes = 0;
+            continue;
+        }
+
+        if (progress.block >= DATA_BLOCKS_PER_VOLUME)
+        {
+            pthread_mutex_lock(&progress_lock);
+            progress.volume++;
+            progress.block = 0;
+            pthread_mutex_unlock(&progress_lock);
+            continue;
+        }
+
+        // the allocation bitmap is read once per volume
+        if (loaded_volume != (int)progress.volume)
+        {
+            char volume_id[12];
+            snprintf(volume_id, sizeof(volume_id), "%u", progress.volume);
+            memset(&bmp, 0, sizeof(bmp));
+            read_bitmap(volume_id, &bmp);
+            loaded_volume = progress.volume;
+        }
+
+        // block 0 of every volume after the first is reserved and never written
+        bool reserved = progress.volume > 0 && progress.block == 0;
+        if (!reserved && !is_bit_free(bmp.datablock_bmp, progress.block))
+        {
+            int block_index = progress.volume * DATA_BLOCKS_PER_VOLUME + progress.block;
+            bool intact = scrub_block(block_index);
+
+            pthread_mutex_lock(&progress_lock);
+            progress.blocks_checked++;
+            if (!intact)
+            {
+                progress.errors++;
+                printf("scrub: Integrity check failed for block %d in volume %u\n", block_index, progress.volume);
+            }
+            pthread_mutex_unlock(&progress_lock);
+
+            budget_bytes += SCRUB_RECORD_SIZE;
+            uint64_t rate = scrub_rate;
+            if (rate > 0)
+            {
+                double ahead = (double)budget_bytes / rate - (now_seconds() - budget_start);
+                if (ahead > 0)
+                {
+                    scrub_sleep(ahead);
+                }
+            }
+        }
+
+        pthread_mutex_lock(&progress_lock);
+        progress.block++;
+        pthread_mutex_unlock(&progress_lock);
+
+        if (++unsaved >= SCRUB_CHECKPOINT_BLOCKS)
+        {
+            save_scrub_progress();
+            unsaved = 0;
+        }
+    }
+
+    save_scrub_progress();
+    printf("scrub: Stopped at volume %u block %u\n", progress.volume, progress.block);
+    return NULL;
+}
+
+static void scrub_signal(int sig)
+{
+    scrub_paused = sig == SIGUSR1;
+}
+
+// Start the scrub thread, it continues from the saved progress. SIGUSR1 pauses and SIGUSR2 resumes it.
+void scrub_start(uint64_t bytes_per_sec)
+{
+    if (scrub_running)
+    {
+        return;
+    }
+
+    load_scrub_progress();
+    scrub_paused = progress.paused;
+    scrub_rate = bytes_per_sec;
+    scrub_stop_requested = 0;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = scrub_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+    sigaction(SIGUSR2, &sa, NULL);
+
+    if (pthread_create(&scrub_thread, NULL, scrub_main, NULL) != 0)
+    {
+        printf("scrub: Unable to start the scrub thread\n");
+        return;
+    }
+    scrub_running = true;
+}
+
+// Stop the scrub thread and save where it stopped
+void scrub_stop(void)
+{
+    if (!scrub_running)
+    {
+        return;
+    }
+    scrub_stop_requested = 1;
+    pthread_join(scrub_thread, NULL);
+    scrub_running = false;
+}
+
+// Pause or resume the scrub thread, the state is saved so it holds after a remount
+void scrub_pause(void)
+{
+    scrub_paused = 1;
+    printf("scrub: Paused\n");
+    if (scrub_running)
+    {
+        save_scrub_progress();
+    }
+}
+
+void scrub_resume(void)
+{
+    scrub_paused = 0;
+    printf("scrub: Resumed\n");
+    if (scrub_running)
+    {
+        save_scrub_progress();
+    }
+}
+
+// Copy of the current position and counts, including whether scrubbing is paused
+void scrub_get_progress(scrub_progress_t *out)
+{
+    pthread_mutex_lock(&progress_lock);
+    *out = progress;
+    out->paused = scrub_paused;
+    pthread_mutex_unlock(&progress_lock);
+}
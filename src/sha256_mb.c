@@ -0,0 +1,261 @@
+// File: sha256_mb.c
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <openssl/sha.h>
+
+#include "sha256_mb.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SHA256_MB_X86 1
+#endif
+
+// Kernels available for multi-buffer hashing
+typedef enum sha256_mb_kernel
+{
+    SHA256_MB_UNKNOWN, // Not detected yet
+    SHA256_MB_SCALAR,  // One OpenSSL SHA256 call per message
+    SHA256_MB_AVX2     // Eight messages per call in the lanes of AVX2 registers
+} sha256_mb_kernel_t;
+
+static sha256_mb_kernel_t kernel = SHA256_MB_UNKNOWN;
+
+// Messages up to this length are cheaper in half empty lanes than in separate SHA256 calls
+#define SHA256_MB_SHORT_LEN 256
+
+#ifdef SHA256_MB_X86
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+static const uint32_t sha256_h0[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+#define ROTR(x, n) _mm256_or_si256(_mm256_srli_epi32((x), (n)), _mm256_slli_epi32((x), 32 - (n)))
+#define SHR(x, n) _mm256_srli_epi32((x), (n))
+#define XOR3(a, b, c) _mm256_xor_si256(_mm256_xor_si256((a), (b)), (c))
+#define ADD(a, b) _mm256_add_epi32((a), (b))
+
+// Turn eight rows of eight words into eight columns, row i becomes word i of every lane
+__attribute__((target("avx2"))) static void transpose_8x8(__m256i r[8])
+{
+    __m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]);
+    __m256i t1 = _mm256_unpackhi_epi32(r[0], r[1]);
+    __m256i t2 = _mm256_unpacklo_epi32(r[2], r[3]);
+    __m256i t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+    __m256i t4 = _mm256_unpacklo_epi32(r[4], r[5]);
+    __m256i t5 = _mm256_unpackhi_epi32(r[4], r[5]);
+    __m256i t6 = _mm256_unpacklo_epi32(r[6], r[7]);
+    __m256i t7 = _mm256_unpackhi_epi32(r[6], r[7]);
+
+    __m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+    __m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+    __m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+    __m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+    __m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+    __m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+    __m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+    __m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+
+    r[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+    r[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+    r[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+    r[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+    r[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+    r[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+    r[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+    r[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+}
+
+__attribute__((target("avx2"))) static __m256i byteswap_32(__m256i x)
+{
+    const __m256i mask = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                          3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    return _mm256_shuffle_epi8(x, mask);
+}
+
+// Run the compression function on one 64 byte block of each lane
+__attribute__((target("avx2"))) static void sha256_x8_block(__m256i state[8], const unsigned char *const blocks[SHA256_MB_LANES])
+{
+    __m256i w[16];
+    for (int half = 0; half < 2; half++)
+    {
+        __m256i rows[8];
+        for (int i = 0; i < SHA256_MB_LANES; i++)
+        {
+            rows[i] = _mm256_loadu_si256((const __m256i *)(blocks[i] + 32 * half));
+        }
+        transpose_8x8(rows);
+        for (int i = 0; i < 8; i++)
+        {
+            w[8 * half + i] = byteswap_32(rows[i]);
+        }
+    }
+
+    __m256i a = state[0], b = state[1], c = state[2], d = state[3];
+    __m256i e = state[4], f = state[5], g = state[6], h = state[7];
+
+    for (int t = 0; t < 64; t++)
+    {
+        if (t >= 16)
+        {
+            __m256i w15 = w[(t - 15) & 15];
+            __m256i w2 = w[(t - 2) & 15];
+            __m256i s0 = XOR3(ROTR(w15, 7), ROTR(w15, 18), SHR(w15, 3));
+            __m256i s1 = XOR3(ROTR(w2, 17), ROTR(w2, 19), SHR(w2, 10));
+            w[t & 15] = ADD(ADD(w[t & 15], s0), ADD(w[(t - 7) & 15], s1));
+        }
+
+        __m256i big_s1 = XOR3(ROTR(e, 6), ROTR(e, 11), ROTR(e, 25));
+        __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+        __m256i t1 = ADD(ADD(ADD(h, big_s1), ADD(ch, _mm256_set1_epi32(sha256_k[t]))), w[t & 15]);
+        __m256i big_s0 = XOR3(ROTR(a, 2), ROTR(a, 13), ROTR(a, 22));
+        __m256i maj = XOR3(_mm256_and_si256(a, b), _mm256_and_si256(a, c), _mm256_and_si256(b, c));
+        __m256i t2 = ADD(big_s0, maj);
+
+        h = g;
+        g = f;
+        f = e;
+        e = ADD(d, t1);
+        d = c;
+        c = b;
+        b = a;
+        a = ADD(t1, t2);
+    }
+
+    state[0] = ADD(state[0], a);
+    state[1] = ADD(state[1], b);
+    state[2] = ADD(state[2], c);
+    state[3] = ADD(state[3], d);
+    state[4] = ADD(state[4], e);
+    state[5] = ADD(state[5], f);
+    state[6] = ADD(state[6], g);
+    state[7] = ADD(state[7], h);
+}
+
+// Hash eight messages of len bytes at once
+__attribute__((target("avx2"))) static void sha256_x8(const unsigned char *const *inputs, size_t len, unsigned char *const *outputs)
+{
+    __m256i state[8];
+    for (int i = 0; i < 8; i++)
+    {
+        state[i] = _mm256_set1_epi32(sha256_h0[i]);
+    }
+
+    const unsigned char *blocks[SHA256_MB_LANES];
+    size_t full_blocks = len / 64;
+    for (size_t n = 0; n < full_blocks; n++)
+    {
+        for (int i = 0; i < SHA256_MB_LANES; i++)
+        {
+            blocks[i] = inputs[i] + 64 * n;
+        }
+        sha256_x8_block(state, blocks);
+    }
+
+    // padding: 0x80, zeros, then the bit length in the last 8 bytes of one or two blocks
+    unsigned char tail[SHA256_MB_LANES][128];
+    size_t rest = len % 64;
+    size_t tail_len = (rest + 9 <= 64) ? 64 : 128;
+    uint64_t bit_len = (uint64_t)len * 8;
+    for (int i = 0; i < SHA256_MB_LANES; i++)
+    {
+        memset(tail[i], 0, tail_len);
+        memcpy(tail[i], inputs[i] + 64 * full_blocks, rest);
+        tail[i][rest] = 0x80;
+        for (int j = 0; j < 8; j++)
+        {
+            tail[i][tail_len - 1 - j] = (unsigned char)(bit_len >> (8 * j));
+        }
+    }
+    for (size_t offset = 0; offset < tail_len; offset += 64)
+    {
+        for (int i = 0; i < SHA256_MB_LANES; i++)
+        {
+            blocks[i] = tail[i] + offset;
+        }
+        sha256_x8_block(state, blocks);
+    }
+
+    transpose_8x8(state);
+    for (int i = 0; i < SHA256_MB_LANES; i++)
+    {
+        _mm256_storeu_si256((__m256i *)outputs[i], byteswap_32(state[i]));
+    }
+}
+
+#endif // SHA256_MB_X86
+
+static void sha256_mb_detect(void)
+{
+    kernel = SHA256_MB_SCALAR;
+#ifdef SHA256_MB_X86
+    // OpenSSL uses the SHA extensions when present, but its per call overhead dominates
+    // the 64 byte node inputs, so eight lanes win on every AVX2 CPU
+    if (__builtin_cpu_supports("avx2"))
+    {
+        kernel = SHA256_MB_AVX2;
+    }
+#endif
+    printf("sha256_mb: Using %s kernel\n", sha256_mb_kernel_name());
+}
+
+const char *sha256_mb_kernel_name(void)
+{
+    switch (kernel)
+    {
+    case SHA256_MB_AVX2:
+        return "avx2 x8";
+    case SHA256_MB_SCALAR:
+        return "scalar";
+    default:
+        return "undetected";
+    }
+}
+
+void sha256_mb(const unsigned char *const *inputs, size_t len, int count, unsigned char *const *outputs)
+{
+    if (kernel == SHA256_MB_UNKNOWN)
+    {
+        sha256_mb_detect();
+    }
+
+    int i = 0;
+#ifdef SHA256_MB_X86
+    if (kernel == SHA256_MB_AVX2)
+    {
+        for (; i + SHA256_MB_LANES <= count; i += SHA256_MB_LANES)
+        {
+            sha256_x8(inputs + i, len, outputs + i);
+        }
+    }
+    // short leftovers still go through the lanes, the unused lanes repeat the last message
+    if (kernel == SHA256_MB_AVX2 && i < count && len <= SHA256_MB_SHORT_LEN)
+    {
+        const unsigned char *lane_inputs[SHA256_MB_LANES];
+        unsigned char lane_digests[SHA256_MB_LANES][SHA256_DIGEST_LENGTH];
+        unsigned char *lane_outputs[SHA256_MB_LANES];
+        for (int lane = 0; lane < SHA256_MB_LANES; lane++)
+        {
+            int n = (i + lane < count) ? i + lane : count - 1;
+            lane_inputs[lane] = inputs[n];
+            lane_outputs[lane] = (i + lane < count) ? outputs[n] : lane_digests[lane];
+        }
+        sha256_x8(lane_inputs, len, lane_outputs);
+        i = count;
+    }
+#endif
+    // leftover messages that do not fill all lanes
+    for (; i < count; i++)
+    {
+        SHA256(inputs[i], len, outputs[i]);
+    }
+}
@@ -0,0 +1,552 @@
+// File: snapshot.c
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "snapshot.h"
+#include "volume.h"
+#include "merkle.h"
+#include "merkle_updater.h"
+#include "constants.h"
+#include "crypto.h"
+
+// Bytes of a block as stored in the volume file, nonce then ciphertext and tag
+#define SNAPSHOT_BLOCK_RECORD_SIZE (crypto_aead_aes256gcm_NPUBBYTES + BLOCK_SIZE + crypto_aead_aes256gcm_ABYTES)
+
+// Position of a preserved value in a snapshot file, offset 0 marks a free slot of the index
+typedef struct snapshot_entry
+{
+    uint32_t key; // Record type in the top bit, node or block index below
+    off_t offset; // File offset of the preserved value, after its record header
+} snapshot_entry_t;
+
+// Open snapshot file of one volume with an index of the values it holds, so memory grows with
+// the changed nodes and blocks and not with the size of the volume
+typedef struct snapshot_file
+{
+    int fd;                    // -1 until the file is opened and indexed
+    off_t size;                // End of the last complete record
+    snapshot_entry_t *entries; // Open addressing table of capacity slots
+    int capacity;              // Slots in entries, a power of two
+    int count;                 // Used slots in entries
+} snapshot_file_t;
+
+// Guards the snapshot table and files. Taken after merkle_lock when trees are updated or read.
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Writers hold it shared from their first block write until their leaves are queued, and a snapshot
+// applies the queue before reading the roots, so it is only taken when the volumes and trees agree
+static pthread_rwlock_t snapshot_write_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static snapshot_file_t files[MAX_SNAPSHOTS][NUMVOLUMES];
+static bool files_initialized = false;
+
+static uint32_t snapshot_key(uint32_t type, uint32_t index)
+{
+    return type << 31 | index;
+}
+
+static size_t snapshot_value_size(uint32_t type)
+{
+    return type == SNAPSHOT_NODE ? SHA256_DIGEST_LENGTH : SNAPSHOT_BLOCK_RECORD_SIZE;
+}
+
+static void init_snapshot_files(void)
+{
+    if (files_initialized)
+    {
+        return;
+    }
+    for (int s = 0; s < MAX_SNAPSHOTS; s++)
+    {
+        for (int v = 0; v < NUMVOLUMES; v++)
+        {
+            files[s][v].fd = -1;
+        }
+    }
+    files_initialized = true;
+}
+
+static snapshot_entry_t *find_snapshot_entry(snapshot_file_t *file, uint32_t key)
+{
+    if (file->capacity == 0)
+    {
+        return NULL;
+    }
+    uint32_t mask = file->capacity - 1;
+    for (uint32_t i = (key * 2654435761u) & mask;; i = (i + 1) & mask)
+    {
+        if (file->entries[i].offset == 0 || file->entries[i].key == key)
+        {
+            return &file->entries[i];
+        }
+    }
+}
+
+static bool insert_snapshot_entry(snapshot_file_t *file, uint32_t key, off_t offset)
+{
+    // the table is kept at most half full so probes stay short
+    if (2 * (file->count + 1) > file->capacity)
+    {
+        int capacity = file->capacity ? 2 * file->capacity : 64;
+        snapshot_entry_t *entries = calloc(capacity, sizeof(snapshot_entry_t));
+        if (!entries)
+        {
+            return false;
+        }
+        snapshot_file_t grown = {file->fd, file->size, entries, capacity, 0};
+        for (int i = 0; i < file->capacity; i++)
+        {
+            if (file->entries[i].offset)
+            {
+                *find_snapshot_entry(&grown, file->entries[i].key) = file->entries[i];
+            }
+        }
+        free(file->entries);
+        file->entries = entries;
+        file->capacity = capacity;
+    }
+
+    snapshot_entry_t *entry = find_snapshot_entry(file, key);
+    if (entry->offset == 0)
+    {
+        file->count++;
+    }
+    entry->key = key;
+    entry->offset = offset;
+    return true;
+}
+
+static void close_snapshot_file(snapshot_file_t *file)
+{
+    if (file->fd >= 0)
+    {
+        close(file->fd);
+    }
+    free(file->entries);
+    memset(file, 0, sizeof(*file));
+    file->fd = -1;
+}
+
+// Open the file of a snapshot slot and volume and index the records it holds. A record cut short
+// by a crash is ignored and overwritten by the next one.
+static snapshot_file_t *open_snapshot_file(int slot, int volume)
+{
+    init_snapshot_files();
+    snapshot_file_t *file = &files[slot][volume];
+    if (file->fd >= 0)
+    {
+        return file;
+    }
+
+    char path[MAX_PATH_LENGTH];
+    snprintf(path, sizeof(path), SNAPSHOT_PATH_FORMAT, sb.snapshots[slot].id, volume);
+    file->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (file->fd < 0)
+    {
+        printf("snapshot: Unable to open %s\n", path);
+        return NULL;
+    }
+
+    snapshot_record_t record;
+    off_t offset = 0;
+    off_t end = lseek(file->fd, 0, SEEK_END);
+    while (pread(file->fd, &record, sizeof(record), offset) == sizeof(record) && record.type <= SNAPSHOT_BLOCK)
+    {
+        off_t value = offset + sizeof(record);
+        if (value + (off_t)snapshot_value_size(record.type) > end)
+        {
+            break;
+        }
+        insert_snapshot_entry(file, snapshot_key(record.type, record.index), value);
+        offset = value + snapshot_value_size(record.type);
+    }
+    file->size = offset;
+    return file;
+}
+
+// Append a value to a snapshot file unless it already holds one for the same node or block
+static void append_snapshot_value(snapshot_file_t *file, uint32_t type, uint32_t index, const void *value)
+{
+    uint32_t key = snapshot_key(type, index);
+    snapshot_entry_t *entry = find_snapshot_entry(file, key);
+    if (entry && entry->offset)
+    {
+        return;
+    }
+
+    snapshot_record_t record = {type, index};
+    size_t size = snapshot_value_size(type);
+    if (pwrite(file->fd, &record, sizeof(record), file->size) != sizeof(record) ||
+        pwrite(file->fd, value, size, file->size + sizeof(record)) != (ssize_t)size)
+    {
+        printf("snapshot: Unable to preserve %s %u\n", type == SNAPSHOT_NODE ? "node" : "block", index);
+        return;
+    }
+    insert_snapshot_entry(file, key, file->size + sizeof(record));
+    file->size += sizeof(record) + size;
+}
+
+// 1 while a snapshot exists, 0 if none does and -1 until the table was looked at. Lets tree
+// updates skip snapshot_lock when there is nothing to preserve.
+static int snapshots_exist = -1;
+
+// Slot of the most recent snapshot, -1 if there is none
+static int newest_snapshot_slot(void)
+{
+    int newest = -1;
+    for (int s = 0; s < MAX_SNAPSHOTS; s++)
+    {
+        if (sb.snapshots[s].id && (newest < 0 || sb.snapshots[s].id > sb.snapshots[newest].id))
+        {
+            newest = s;
+        }
+    }
+    return newest;
+}
+
+// Slots of the snapshots from id on, oldest first. A snapshot reads a value from the first of
+// them that preserved it, newer snapshots saw it unchanged.
+static int snapshot_chain(uint32_t id, int *slots)
+{
+    int count = 0;
+    for (int s = 0; s < MAX_SNAPSHOTS; s++)
+    {
+        if (sb.snapshots[s].id >= id && sb.snapshots[s].id)
+        {
+            int i = count++;
+            for (; i > 0 && sb.snapshots[slots[i - 1]].id > sb.snapshots[s].id; i--)
+            {
+                slots[i] = slots[i - 1];
+            }
+            slots[i] = s;
+        }
+    }
+    return count;
+}
+
+// Read the value a snapshot holds for a node or block, false if it is unchanged since then
+static bool read_snapshot_value(uint32_t id, int volume, uint32_t type, uint32_t index, void *value)
+{
+    int slots[MAX_SNAPSHOTS];
+    int count = snapshot_chain(id, slots);
+    for (int i = 0; i < count; i++)
+    {
+        snapshot_file_t *file = open_snapshot_file(slots[i], volume);
+        snapshot_entry_t *entry = file ? find_snapshot_entry(file, snapshot_key(type, index)) : NULL;
+        if (entry && entry->offset)
+        {
+            size_t size = snapshot_value_size(type);
+            return pread(file->fd, value, size, entry->offset) == (ssize_t)size;
+        }
+    }
+    return false;
+}
+
+const snapshot_info_t *snapshot_find(uint32_t id)
+{
+    for (int s = 0; s < MAX_SNAPSHOTS && id; s++)
+    {
+        if (sb.snapshots[s].id == id)
+        {
+            return &sb.snapshots[s];
+        }
+    }
+    return NULL;
+}
+
+// Record the current roots as a new snapshot and return its id, -1 if the table is full. Nothing
+// is copied, writers in progress are only waited for.
+int snapshot_create(void)
+{
+    pthread_rwlock_wrlock(&snapshot_write_lock);
+    merkle_updater_flush();
+    snapshot_info_t info;
+    memset(&info, 0, sizeof(info));
+    get_volume_roots(info.volume_roots, info.root_of_roots);
+
+    pthread_mutex_lock(&snapshot_lock);
+    int slot = -1;
+    for (int s = 0; s < MAX_SNAPSHOTS && slot < 0; s++)
+    {
+        if (sb.snapshots[s].id == 0)
+        {
+            slot = s;
+        }
+    }
+    if (slot < 0)
+    {
+        pthread_mutex_unlock(&snapshot_lock);
+        pthread_rwlock_unlock(&snapshot_write_lock);
+        printf("snapshot: Snapshot table is full\n");
+        return -1;
+    }
+
+    info.id = sb.snapshot_next_id ? sb.snapshot_next_id : 1;
+    for (int v = 0; v < NUMVOLUMES; v++)
+    {
+        // left behind if a crash came before the superblock recorded the id as used
+        char path[MAX_PATH_LENGTH];
+        snprintf(path, sizeof(path), SNAPSHOT_PATH_FORMAT, info.id, v);
+        unlink(path);
+    }
+    info.volume_count = sb.volume_count;
+    info.created = time(NULL);
+    sb.snapshot_next_id = info.id + 1;
+    sb.snapshots[slot] = info;
+    write_superblock_roots(&sb);
+    __atomic_store_n(&snapshots_exist, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&snapshot_lock);
+    pthread_rwlock_unlock(&snapshot_write_lock);
+
+    printf("snapshot: Created snapshot %u\n", info.id);
+    return info.id;
+}
+
+// Drop a snapshot. The values it preserved are still needed by the next older snapshot, which
+// saw them unchanged, so the ones that snapshot does not hold yet are moved to it.
+bool snapshot_delete(uint32_t id)
+{
+    pthread_mutex_lock(&snapshot_lock);
+    const snapshot_info_t *info = snapshot_find(id);
+    if (!info)
+    {
+        pthread_mutex_unlock(&snapshot_lock);
+        printf("snapshot: Snapshot %u does not exist\n", id);
+        return false;
+    }
+    int slot = info - sb.snapshots;
+
+    int older = -1;
+    for (int s = 0; s < MAX_SNAPSHOTS; s++)
+    {
+        if (sb.snapshots[s].id && sb.snapshots[s].id < id && (older < 0 || sb.snapshots[s].id > sb.snapshots[older].id))
+        {
+            older = s;
+        }
+    }
+
+    unsigned char value[SNAPSHOT_BLOCK_RECORD_SIZE];
+    for (uint32_t v = 0; v < info->volume_count; v++)
+    {
+        snapshot_file_t *file = open_snapshot_file(slot, v);
+        snapshot_file_t *target = older >= 0 && v < sb.snapshots[older].volume_count ? open_snapshot_file(older, v) : NULL;
+        for (int i = 0; file && target && i < file->capacity; i++)
+        {
+            snapshot_entry_t entry = file->entries[i];
+            uint32_t type = entry.key >> 31;
+            size_t size = snapshot_value_size(type);
+            if (entry.offset && pread(file->fd, value, size, entry.offset) == (ssize_t)size)
+            {
+                append_snapshot_value(target, type, entry.key & 0x7fffffff, value);
+            }
+        }
+
+        char path[MAX_PATH_LENGTH];
+        snprintf(path, sizeof(path), SNAPSHOT_PATH_FORMAT, id, v);
+        close_snapshot_file(&files[slot][v]);
+        unlink(path);
+    }
+
+    memset(&sb.snapshots[slot], 0, sizeof(snapshot_info_t));
+    write_superblock_roots(&sb);
+    __atomic_store_n(&snapshots_exist, newest_snapshot_slot() >= 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&snapshot_lock);
+
+    printf("snapshot: Deleted snapshot %u\n", id);
+    return true;
+}
+
+void snapshot_write_begin(void)
+{
+    pthread_rwlock_rdlock(&snapshot_write_lock);
+}
+
+void snapshot_write_end(void)
+{
+    pthread_rwlock_unlock(&snapshot_write_lock);
+}
+
+// False only when it is known that no snapshot exists, reading the table takes snapshot_lock
+static bool snapshots_may_exist(void)
+{
+    return __atomic_load_n(&snapshots_exist, __ATOMIC_ACQUIRE) != 0;
+}
+
+// Newest snapshot slot, called with snapshot_lock held. Notes whether there is one for the
+// unlocked check in snapshots_may_exist.
+static int locked_newest_snapshot_slot(void)
+{
+    int slot = newest_snapshot_slot();
+    __atomic_store_n(&snapshots_exist, slot >= 0, __ATOMIC_RELEASE);
+    return slot;
+}
+
+// Called before a node of a volume tree is overwritten, keeps its value for the newest snapshot
+void snapshot_preserve_node(int volume, int index, const unsigned char *hash)
+{
+    if (!snapshots_may_exist())
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&snapshot_lock);
+    int slot = locked_newest_snapshot_slot();
+    if (slot >= 0 && (uint32_t)volume < sb.snapshots[slot].volume_count)
+    {
+        snapshot_file_t *file = open_snapshot_file(slot, volume);
+        if (file)
+        {
+            append_snapshot_value(file, SNAPSHOT_NODE, index, hash);
+        }
+    }
+    pthread_mutex_unlock(&snapshot_lock);
+}
+
+// Called before a block is overwritten, keeps the stored record for the newest snapshot
+void snapshot_preserve_block(int block_index)
+{
+    int volume = block_index / DATA_BLOCKS_PER_VOLUME;
+    int index = block_index % DATA_BLOCKS_PER_VOLUME;
+    if (!snapshots_may_exist())
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&snapshot_lock);
+    int slot = locked_newest_snapshot_slot();
+    snapshot_file_t *file = NULL;
+    if (slot >= 0 && (uint32_t)volume < sb.snapshots[slot].volume_count)
+    {
+        file = open_snapshot_file(slot, volume);
+    }
+    snapshot_entry_t *entry = file ? find_snapshot_entry(file, snapshot_key(SNAPSHOT_BLOCK, index)) : NULL;
+    if (file && !(entry && entry->offset))
+    {
+        // a block never written before has no record, its leaf in the snapshot is empty
+        unsigned char record[SNAPSHOT_BLOCK_RECORD_SIZE] = {0};
+        if (read_volume_record(block_index, record, record + crypto_aead_aes256gcm_NPUBBYTES))
+        {
+            append_snapshot_value(file, SNAPSHOT_BLOCK, index, record);
+        }
+    }
+    pthread_mutex_unlock(&snapshot_lock);
+}
+
+typedef struct snapshot_reader
+{
+    uint32_t id; // Snapshot whose nodes are read
+    int volume;  // Volume of the tree
+} snapshot_reader_t;
+
+static bool read_snapshot_node(void *ctx, int index, unsigned char *hash)
+{
+    snapshot_reader_t *reader = ctx;
+    pthread_mutex_lock(&snapshot_lock);
+    bool found = read_snapshot_value(reader->id, reader->volume, SNAPSHOT_NODE, index, hash);
+    pthread_mutex_unlock(&snapshot_lock);
+    return found;
+}
+
+// Drop the indexes so they are read again, another process may have appended to the files
+static void reload_snapshot_files(void)
+{
+    pthread_mutex_lock(&snapshot_lock);
+    __atomic_store_n(&snapshots_exist, -1, __ATOMIC_RELEASE); // the table is read again as well
+    init_snapshot_files();
+    for (int s = 0; s < MAX_SNAPSHOTS; s++)
+    {
+        for (int v = 0; v < NUMVOLUMES; v++)
+        {
+            close_snapshot_file(&files[s][v]);
+        }
+    }
+    pthread_mutex_unlock(&snapshot_lock);
+}
+
+static bool read_snapshot_block_once(const snapshot_info_t *info, int block_index, void *buf)
+{
+    int volume = block_index / DATA_BLOCKS_PER_VOLUME;
+    int index = block_index % DATA_BLOCKS_PER_VOLUME;
+    unsigned char record[SNAPSHOT_BLOCK_RECORD_SIZE];
+    unsigned char *nonce = record;
+    unsigned char *encrypted_data = record + crypto_aead_aes256gcm_NPUBBYTES;
+
+    pthread_mutex_lock(&snapshot_lock);
+    bool preserved = read_snapshot_value(info->id, volume, SNAPSHOT_BLOCK, index, record);
+    pthread_mutex_unlock(&snapshot_lock);
+    bool stored = preserved || read_volume_record(block_index, nonce, encrypted_data);
+
+    snapshot_reader_t reader = {info->id, volume};
+    unsigned long long decrypted_len;
+    if (stored && decrypt_aes_gcm(buf, &decrypted_len, encrypted_data, BLOCK_SIZE + crypto_aead_aes256gcm_ABYTES, nonce, key) == 0)
+    {
+        unsigned char block_hash[SHA256_DIGEST_LENGTH];
+        if (sb.merkle_leaf_format == MERKLE_LEAF_RECORD)
+        {
+            compute_record_leaf(nonce, encrypted_data + BLOCK_SIZE, block_hash);
+        }
+        else
+        {
+            compute_hash(buf, BLOCK_SIZE, block_hash);
+        }
+        if (verify_snapshot_leaf(block_index, block_hash, info->volume_roots[volume], read_snapshot_node, &reader))
+        {
+            return true;
+        }
+    }
+
+    // a block not written when the snapshot was taken reads as zeros, its empty leaf is verified too
+    unsigned char empty_hash[SHA256_DIGEST_LENGTH] = {0};
+    if (verify_snapshot_leaf(block_index, empty_hash, info->volume_roots[volume], read_snapshot_node, &reader))
+    {
+        memset(buf, 0, BLOCK_SIZE);
+        return true;
+    }
+    return false;
+}
+
+// Read and decrypt a block as it was when the snapshot was taken, true if it verified against
+// the volume root recorded for the snapshot
+bool snapshot_read_block(uint32_t id, int block_index, void *buf)
+{
+    pthread_mutex_lock(&snapshot_lock);
+    const snapshot_info_t *found = snapshot_find(id);
+    snapshot_info_t info;
+    if (found)
+    {
+        info = *found;
+    }
+    pthread_mutex_unlock(&snapshot_lock);
+
+    if (!found || block_index / DATA_BLOCKS_PER_VOLUME >= (int)info.volume_count)
+    {
+        printf("snapshot: Block %d is not in snapshot %u\n", block_index, id);
+        return false;
+    }
+
+    // a write racing the read can preserve the old value between the lookup and the live read,
+    // the second attempt finds it
+    if (read_snapshot_block_once(&info, block_index, buf))
+    {
+        return true;
+    }
+    reload_snapshot_files();
+    if (read_snapshot_block_once(&info, block_index, buf))
+    {
+        return true;
+    }
+    printf("snapshot: Integrity check failed for block %d in snapshot %u\n", block_index, id);
+    return false;
+}
+
+// Close the snapshot files and release their indexes
+void snapshot_close(void)
+{
+    reload_snapshot_files();
+}
@@ -5,9 +5,20 @@
 #include "merkle.h"
 #include "constants.h"
 #include "crypto.h"
+#include "hash.h"
+#include "snapshot.h"
+#include "merkle_updater.h"
+#include "merkle_rcu.h"
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/file.h>
 #include <curl/curl.h>
 #include "cloud_storage.h"
 
@@ -17,6 +28,192 @@ char superblock_path[MAX_PATH_LENGTH];
 
 char remote_superblock_path[MAX_PATH_LENGTH];
 
+// Open descriptor of each volume file plus one, 0 until the file is first used
+static int volume_fds[NUMVOLUMES][VOLUME_FILE_KINDS];
+static pthread_mutex_t volume_fds_lock = PTHREAD_MUTEX_INITIALIZER;
+static const char *volume_file_formats[VOLUME_FILE_KINDS] = {"volume_%d.bin", "inodes_%d.bin", "bmp_%d.bin"};
+
+// Read-only mapping of the records a volume file held when it was mapped
+typedef struct volume_mapping
+{
+    unsigned char *base;
+    size_t size; // Whole records only
+} volume_mapping_t;
+
+static bool mmap_reads = false;
+static volume_mapping_t *volume_maps[NUMVOLUMES]; // Published for lock-free readers, NULL until first read
+static const size_t volume_record_size = crypto_aead_aes256gcm_NPUBBYTES + BLOCK_SIZE + crypto_aead_aes256gcm_ABYTES;
+
+// Descriptor of a volume file, opened on first use and kept until close_volume_files. Positional
+// reads and writes on it need no seek, so threads can share it. -1 if the file does not exist.
+int volume_file_fd(int volume_index, volume_file_kind kind)
+{
+    if (volume_index < 0 || volume_index >= NUMVOLUMES)
+    {
+        return -1;
+    }
+    int fd = __atomic_load_n(&volume_fds[volume_index][kind], __ATOMIC_ACQUIRE) - 1;
+    if (fd >= 0)
+    {
+        return fd;
+    }
+
+    pthread_mutex_lock(&volume_fds_lock);
+    fd = volume_fds[volume_index][kind] - 1;
+    if (fd < 0)
+    {
+        char filename[256];
+        sprintf(filename, volume_file_formats[kind], volume_index);
+        fd = open(filename, O_RDWR);
+        if (fd < 0)
+        {
+            printf("Error: File %s not found.\n", filename);
+        }
+        else
+        {
+            __atomic_store_n(&volume_fds[volume_index][kind], fd + 1, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&volume_fds_lock);
+    return fd;
+}
+
+static void release_volume_mapping(void *ptr, size_t size)
+{
+    (void)size;
+    volume_mapping_t *mapping = ptr;
+    munmap(mapping->base, mapping->size);
+    free(mapping);
+}
+
+// Unpublish the mapping of a volume, true if it had one. It is unmapped once its readers are done.
+static bool drop_volume_mapping(int volume_index)
+{
+    pthread_mutex_lock(&volume_fds_lock);
+    volume_mapping_t *mapping = volume_maps[volume_index];
+    __atomic_store_n(&volume_maps[volume_index], NULL, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&volume_fds_lock);
+
+    merkle_rcu_retire(mapping, 0, release_volume_mapping);
+    return mapping != NULL;
+}
+
+// Map the volume file again once it holds the records up to end, which writes past the old
+// mapping added. False if the file is still shorter than that.
+static bool remap_volume_file(int volume_index, size_t end)
+{
+    int fd = volume_file_fd(volume_index, VOLUME_DATA_FILE);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    pthread_mutex_lock(&volume_fds_lock);
+    volume_mapping_t *old = volume_maps[volume_index];
+    struct stat st;
+    if (old && old->size >= end)
+    {
+        pthread_mutex_unlock(&volume_fds_lock);
+        return true;
+    }
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < end)
+    {
+        pthread_mutex_unlock(&volume_fds_lock);
+        return false;
+    }
+
+    volume_mapping_t *mapping = malloc(sizeof(volume_mapping_t));
+    size_t size = st.st_size - st.st_size % volume_record_size;
+    void *base = mapping ? mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (base == MAP_FAILED)
+    {
+        printf("volume: Unable to map volume %d, reading it with pread\n", volume_index);
+        free(mapping);
+        pthread_mutex_unlock(&volume_fds_lock);
+        return false;
+    }
+    mapping->base = base;
+    mapping->size = size;
+    __atomic_store_n(&volume_maps[volume_index], mapping, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&volume_fds_lock);
+
+    merkle_rcu_retire(old, 0, release_volume_mapping);
+    return true;
+}
+
+// Nonce of the first of count adjacent stored records from block_index inside the volume mapping,
+// followed by the others. NULL when mmap reads are off or the records cannot be mapped, the caller
+// then reads them with pread. Otherwise the mapping stays valid until end_volume_records.
+static const unsigned char *map_volume_records(int block_index, int count)
+{
+    int volume_index = block_index / DATA_BLOCKS_PER_VOLUME;
+    size_t offset = (size_t)(block_index % DATA_BLOCKS_PER_VOLUME) * volume_record_size;
+    size_t end = offset + count * volume_record_size;
+    if (!mmap_reads || volume_index >= NUMVOLUMES)
+    {
+        return NULL;
+    }
+
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        if (!merkle_rcu_read_begin())
+        {
+            return NULL;
+        }
+        volume_mapping_t *mapping = __atomic_load_n(&volume_maps[volume_index], __ATOMIC_ACQUIRE);
+        if (mapping && mapping->size >= end)
+        {
+            return mapping->base + offset;
+        }
+        // remapping retires the old mapping, which must not happen inside a read section
+        merkle_rcu_read_end();
+        if (attempt == 0 && !remap_volume_file(volume_index, end))
+        {
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+static void end_volume_records(void)
+{
+    merkle_rcu_read_end();
+}
+
+// Read blocks straight from a mapping of the volume files instead of copying them with pread
+void volume_mmap_reads_enable(bool enabled)
+{
+    mmap_reads = enabled;
+}
+
+// Close the volume files at unmount, before they are uploaded
+void close_volume_files(void)
+{
+    bool mapped = false;
+    for (int i = 0; i < NUMVOLUMES; i++)
+    {
+        mapped = drop_volume_mapping(i) || mapped;
+    }
+    if (mapped)
+    {
+        merkle_rcu_synchronize();
+    }
+
+    pthread_mutex_lock(&volume_fds_lock);
+    for (int i = 0; i < NUMVOLUMES; i++)
+    {
+        for (int kind = 0; kind < VOLUME_FILE_KINDS; kind++)
+        {
+            if (volume_fds[i][kind] > 0)
+            {
+                close(volume_fds[i][kind] - 1);
+                volume_fds[i][kind] = 0;
+            }
+        }
+    }
+    pthread_mutex_unlock(&volume_fds_lock);
+}
+
 // Initialize a volume with default paths and settings
 void init_volume(volume_info_t *volume, const char *path, volume_type type, int volume_id)
 {
@@ -29,6 +226,98 @@ void init_volume(volume_info_t *volume, const char *path, volume_type type, int
     volume->merkle_tree = NULL;
 }
 
+// Check the root of roots at mount, one comparison confirms the recorded volume roots agree with it
+// and the volume trees are loaded on first access. It is not keyed, see verify_root_of_roots.
+static void load_volume_trees(superblock_t *sb)
+{
+    set_hash_algorithm(sb->hash_algorithm);
+    for (int i = 0; i < NUMVOLUMES; i++)
+    {
+        sb->volumes[i].merkle_tree = NULL; // the stored pointers are stale
+    }
+
+    if (sb->merkle_roots_valid)
+    {
+        if (verify_root_of_roots())
+        {
+            printf("volume: Root of roots matches the volume roots\n");
+        }
+        else
+        {
+            // the recorded volume roots cannot be trusted, so neither can any tree checked against them
+            printf("volume: Root of roots does not match the volume roots, volume trees are refused until they are rebuilt\n");
+            for (int i = 0; i < sb->volume_count; i++)
+            {
+                reject_volume_tree(i);
+            }
+        }
+    }
+
+    if (!sb->merkle_roots_valid)
+    {
+        // older superblocks have no roots yet, every tree is loaded once to record them
+        load_merkle_trees(sb->volume_count);
+        printf("volume: Recording merkle roots in the superblock\n");
+        for (int i = 0; i < sb->volume_count; i++)
+        {
+            set_volume_root(i);
+        }
+        write_superblock(sb);
+        evict_merkle_trees(MERKLE_MAX_RESIDENT_TREES);
+    }
+}
+
+// Take an exclusive lock on the superblock file for the rest of the process, false if another
+// process holds it. A mount keeps it, so offline commands that change the superblock refuse to run
+// against a mounted filesystem instead of having their changes overwritten by it.
+bool lock_superblock(const char *path)
+{
+    static int lock_fd = -1;
+    if (lock_fd >= 0)
+    {
+        return true;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || flock(fd, LOCK_EX | LOCK_NB) != 0)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return false;
+    }
+    lock_fd = fd; // the lock is inherited by the daemon FUSE forks off
+    return true;
+}
+
+// Rewrite the whole superblock file
+void write_superblock(superblock_t *sb)
+{
+    FILE *file = fopen(superblock_path, "wb+");
+    if (file)
+    {
+        fwrite(sb, sizeof(superblock_t), 1, file);
+        fclose(file);
+    }
+}
+
+// Write the merkle roots in place, the rest of the superblock does not change on block writes
+void write_superblock_roots(superblock_t *sb)
+{
+    int fd = open(superblock_path, O_WRONLY);
+    if (fd < 0)
+    {
+        printf("volume: Unable to open superblock %s\n", superblock_path);
+        return;
+    }
+    size_t offset = offsetof(superblock_t, merkle_roots_valid);
+    if (pwrite(fd, (char *)sb + offset, sizeof(superblock_t) - offset, offset) != (ssize_t)(sizeof(superblock_t) - offset))
+    {
+        printf("volume: Unable to write merkle roots to superblock\n");
+    }
+    close(fd);
+}
+
 void load_or_create_superblock(const char *path, superblock_t *sb)
 {
     FILE *file = fopen(path, "rb+");
@@ -44,6 +333,12 @@ void load_or_create_superblock(const char *path, superblock_t *sb)
         sb->block_size = BLOCK_SIZE;
         sb->inode_size = sizeof(inode);
         sb->vtype = LOCAL;
+        sb->merkle_leaf_format = MERKLE_LEAF_RECORD;
+        if (sb->merkle_fanout == 0)
+        {
+            sb->merkle_fanout = MERKLE_DEFAULT_FANOUT;
+        }
+        set_hash_algorithm(sb->hash_algorithm);
         create_volume_files_local(0, sb);
         // Create the root directory inode
         inode root_inode;
@@ -57,11 +352,9 @@ void load_or_create_superblock(const char *path, superblock_t *sb)
     }
     else
     {
+        memset(sb, 0, sizeof(superblock_t)); // superblocks written before the merkle roots are shorter
         fread(sb, sizeof(superblock_t), 1, file);
-        for (int i = 0; i < sb->volume_count; i++)
-        {
-            sb->volumes[i].merkle_tree = load_merkle_tree_from_file(sb->volumes[i].merkle_path);
-        }
+        load_volume_trees(sb);
     }
     fclose(file);
 
@@ -163,6 +456,12 @@ void load_or_create_remote_superblock(const char *path, superblock_t *sb)
             sb->block_size = BLOCK_SIZE;
             sb->inode_size = sizeof(inode);
             sb->vtype = GDRIVE;
+            sb->merkle_leaf_format = MERKLE_LEAF_RECORD;
+            if (sb->merkle_fanout == 0)
+            {
+                sb->merkle_fanout = MERKLE_DEFAULT_FANOUT;
+            }
+            set_hash_algorithm(sb->hash_algorithm);
             create_volume_files_local(0, sb);
             // Create the root directory inode
             inode root_inode;
@@ -187,6 +486,7 @@ void load_or_create_remote_superblock(const char *path, superblock_t *sb)
 
         strcpy(superblock_path, filename);
 
+        memset(sb, 0, sizeof(superblock_t)); // superblocks written before the merkle roots are shorter
         fread(sb, sizeof(superblock_t), 1, file);
 
         printf("volume: Superblock loaded\n");
@@ -194,8 +494,8 @@ void load_or_create_remote_superblock(const char *path, superblock_t *sb)
         for (int i = 0; i < sb->volume_count; i++)
         {
             //  download all the volume files
-            char *volume_id = (char *)malloc(9);
-            sprintf(volume_id, "%d", i);
+            char *volume_id = (char *)malloc(12);
+            snprintf(volume_id, 12, "%d", i);
             char *inodes_path = (char *)malloc(MAX_PATH_LENGTH);
             char *bitmap_path = (char *)malloc(MAX_PATH_LENGTH);
             char *volume_path = (char *)malloc(MAX_PATH_LENGTH);
@@ -231,10 +531,7 @@ void load_or_create_remote_superblock(const char *path, superblock_t *sb)
             }
         }
 
-        for (int i = 0; i < sb->volume_count; i++)
-        {
-            sb->volumes[i].merkle_tree = load_merkle_tree_from_file(sb->volumes[i].merkle_path);
-        }
+        load_volume_trees(sb);
     }
 }
 
@@ -242,6 +539,18 @@ void create_volume_files_local(int i, superblock_t *sb)
 {
     printf("volume: Creating volume files for volume %d\n", i);
 
+    // a volume created again replaces its old tree and mapping, whose readers have to be gone before
+    // its file is truncated
+    bool mapped = drop_volume_mapping(i);
+    if (sb->volumes[i].merkle_tree)
+    {
+        publish_merkle_tree(i, NULL);
+    }
+    if (sb->volumes[i].merkle_tree || mapped)
+    {
+        merkle_rcu_synchronize();
+    }
+
     FILE *inodes_file = fopen(sb->volumes[i].inodes_path, "w");
     fclose(inodes_file);
     FILE *bitmap_file = fopen(sb->volumes[i].bitmap_path, "w");
@@ -255,82 +564,231 @@ void create_volume_files_local(int i, superblock_t *sb)
     if (!merkle_file)
     {
         printf("volume: Merkle file not found, creating a new one.\n");
-        MerkleTree *merkle_tree = initialize_merkle_tree_for_volume(sb->volumes[i].volume_path);
-        save_merkle_tree_to_file(merkle_tree, sb->volumes[i].merkle_path);
-        sb->volumes[i].merkle_tree = merkle_tree;
     }
     else
     {
-        MerkleTree *merkle_tree = initialize_merkle_tree_for_volume(sb->volumes[i].volume_path);
-        save_merkle_tree_to_file(merkle_tree, sb->volumes[i].merkle_path);
-        sb->volumes[i].merkle_tree = merkle_tree;
+        fclose(merkle_file);
     }
+
+    MerkleTree *merkle_tree = initialize_merkle_tree_for_volume(sb->volumes[i].volume_path);
+    merkle_tree->volume = i;
+    save_merkle_tree_to_file(merkle_tree, sb->volumes[i].merkle_path);
+    publish_merkle_tree(i, merkle_tree);
+    // callers write the superblock after creating the volume
+    set_volume_root(i);
 }
 
-void read_volume_block_no_check(int block_index, void *buf)
+// Read the nonce and the encrypted block with its GCM tag as stored in the volume file
+bool read_volume_record(int block_index, unsigned char *nonce, unsigned char *encrypted_data)
 {
-    printf("volume: Reading block %d\n", block_index);
-    char volume_id[9] = "0";
     int volume_id_int = block_index / DATA_BLOCKS_PER_VOLUME;
-    sprintf(volume_id, "%d", volume_id_int);
 
     int block_index_in_volume = block_index % DATA_BLOCKS_PER_VOLUME;
 
     printf("volume: Reading block %d with volume %d\n", block_index_in_volume, volume_id_int);
 
-    char volume_filename[256];
-    sprintf(volume_filename, "volume_%s.bin", volume_id);
-    FILE *file = fopen(volume_filename, "rb");
+    int fd = volume_file_fd(volume_id_int, VOLUME_DATA_FILE);
+    if (fd < 0)
+    {
+        return false;
+    }
 
-    unsigned char encrypted_data[BLOCK_SIZE + crypto_aead_aes256gcm_ABYTES];
-    unsigned char nonce[crypto_aead_aes256gcm_NPUBBYTES];
+    struct iovec record[2] = {{nonce, crypto_aead_aes256gcm_NPUBBYTES},
+                              {encrypted_data, BLOCK_SIZE + crypto_aead_aes256gcm_ABYTES}};
+    off_t offset = (off_t)block_index_in_volume * (BLOCK_SIZE + crypto_aead_aes256gcm_ABYTES + crypto_aead_aes256gcm_NPUBBYTES);
+    return preadv(fd, record, 2, offset) == crypto_aead_aes256gcm_NPUBBYTES + BLOCK_SIZE + crypto_aead_aes256gcm_ABYTES;
+}
+
+// Decrypt a stored block, false if the GCM tag does not authenticate it
+static bool decrypt_volume_record(int block_index, const unsigned char *nonce, const unsigned char *encrypted_data, void *buf)
+{
     unsigned long long decrypted_len;
+    if (decrypt_aes_gcm(buf, &decrypted_len, encrypted_data, BLOCK_SIZE + crypto_aead_aes256gcm_ABYTES, nonce, key) != 0)
+    {
+        printf("volume: Decryption failed for block %d in volume %d\n", block_index % DATA_BLOCKS_PER_VOLUME,
+               block_index / DATA_BLOCKS_PER_VOLUME);
+        return false;
+    }
+    return true;
+}
 
-    if (file)
+// Decrypt count adjacent stored records from block_index into buf and compute their merkle leaves,
+// true if all decrypted. A block that fails to decrypt does not keep the others from being returned.
+static bool decrypt_volume_records(int block_index, int count, const unsigned char *records, void *buf, unsigned char (*block_hashes)[SHA256_DIGEST_LENGTH])
+{
+    bool intact = true;
+    for (int i = 0; i < count; i++)
     {
-        fseek(file, block_index_in_volume * (BLOCK_SIZE + crypto_aead_aes256gcm_ABYTES + sizeof(nonce)), SEEK_SET);
-        fread(nonce, sizeof(nonce), 1, file);
-        fread(encrypted_data, sizeof(encrypted_data), 1, file);
-        fclose(file);
-        if (decrypt_aes_gcm(buf, &decrypted_len, encrypted_data, sizeof(encrypted_data), nonce, key) != 0)
+        const unsigned char *nonce = records + i * volume_record_size;
+        const unsigned char *encrypted_data = nonce + crypto_aead_aes256gcm_NPUBBYTES;
+        unsigned char *block = (unsigned char *)buf + (size_t)i * BLOCK_SIZE;
+        intact = decrypt_volume_record(block_index + i, nonce, encrypted_data, block) && intact;
+
+        if (sb.merkle_leaf_format == MERKLE_LEAF_RECORD)
+        {
+            compute_record_leaf(nonce, encrypted_data + BLOCK_SIZE, block_hashes[i]);
+        }
+        else
         {
-            printf("volume: Decryption failed for block %d in volume %s\n", block_index_in_volume, volume_id);
+            compute_hash(block, BLOCK_SIZE, block_hashes[i]);
         }
     }
+    return intact;
+}
+
+void read_volume_block_no_check(int block_index, void *buf)
+{
+    printf("volume: Reading block %d\n", block_index);
+
+    const unsigned char *mapped = map_volume_records(block_index, 1);
+    if (mapped)
+    {
+        decrypt_volume_record(block_index, mapped, mapped + crypto_aead_aes256gcm_NPUBBYTES, buf);
+        end_volume_records();
+        return;
+    }
+
+    unsigned char encrypted_data[BLOCK_SIZE + crypto_aead_aes256gcm_ABYTES];
+    unsigned char nonce[crypto_aead_aes256gcm_NPUBBYTES];
+    if (read_volume_record(block_index, nonce, encrypted_data))
+    {
+        decrypt_volume_record(block_index, nonce, encrypted_data, buf);
+    }
+}
+
+// Read only the nonce and GCM tag of a stored block, enough for its merkle leaf without the key
+bool read_volume_block_tag(int block_index, unsigned char *nonce, unsigned char *tag)
+{
+    int fd = volume_file_fd(block_index / DATA_BLOCKS_PER_VOLUME, VOLUME_DATA_FILE);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    off_t record = (off_t)(block_index % DATA_BLOCKS_PER_VOLUME) * (BLOCK_SIZE + crypto_aead_aes256gcm_ABYTES + crypto_aead_aes256gcm_NPUBBYTES);
+    return pread(fd, nonce, crypto_aead_aes256gcm_NPUBBYTES, record) == crypto_aead_aes256gcm_NPUBBYTES &&
+           pread(fd, tag, crypto_aead_aes256gcm_ABYTES, record + crypto_aead_aes256gcm_NPUBBYTES + BLOCK_SIZE) == crypto_aead_aes256gcm_ABYTES;
+}
+
+// Read, decrypt and verify a block, true if it decrypted and its merkle leaf verified. The block
+// is read and decrypted once, the merkle leaf is computed from the same copy.
+bool read_volume_block_checked(int block_index, void *buf)
+{
+    unsigned char encrypted_data[BLOCK_SIZE + crypto_aead_aes256gcm_ABYTES];
+    unsigned char nonce[crypto_aead_aes256gcm_NPUBBYTES];
+    unsigned char block_hash[SHA256_DIGEST_LENGTH];
+
+    const unsigned char *mapped = map_volume_records(block_index, 1);
+    if (mapped)
+    {
+        bool intact = decrypt_volume_records(block_index, 1, mapped, buf, &block_hash);
+        end_volume_records();
+        return verify_block_leaf(block_index, block_hash) && intact;
+    }
+
+    // nothing was read, so there is no leaf to compute or verify
+    if (!read_volume_record(block_index, nonce, encrypted_data))
+    {
+        printf("volume: Unable to read block %d\n", block_index);
+        return false;
+    }
+    bool intact = decrypt_volume_record(block_index, nonce, encrypted_data, buf);
+
+    if (sb.merkle_leaf_format == MERKLE_LEAF_RECORD)
+    {
+        compute_record_leaf(nonce, encrypted_data + BLOCK_SIZE, block_hash);
+    }
     else
     {
-        printf("Error: File %s not found.\n", volume_filename);
+        compute_hash(buf, BLOCK_SIZE, block_hash);
     }
+
+    return verify_block_leaf(block_index, block_hash) && intact;
 }
 
 void read_volume_block(int block_index, void *buf)
 {
     printf("volume: Reading block %d\n", block_index);
-    char volume_id[9] = "0";
-    int volume_id_int = block_index / DATA_BLOCKS_PER_VOLUME;
-    sprintf(volume_id, "%d", volume_id_int);
 
-    read_volume_block_no_check(block_index, buf);
+    if (!read_volume_block_checked(block_index, buf))
+    {
+        printf("volume: Integrity check failed for block %d in volume %d\n", block_index,
+               block_index / DATA_BLOCKS_PER_VOLUME);
+    }
+}
+
+// Read and decrypt count adjacent blocks of one volume starting at block_index and compute their
+// merkle leaves, true if all were read and decrypted. The records are read with one call, or
+// decrypted in place from the volume mapping when mmap reads are on.
+bool read_volume_blocks_hashed(int block_index, int count, void *buf, unsigned char (*block_hashes)[SHA256_DIGEST_LENGTH])
+{
+    int block_index_in_volume = block_index % DATA_BLOCKS_PER_VOLUME;
 
-    if (!verify_block_integrity(block_index))
+    const unsigned char *mapped = map_volume_records(block_index, count);
+    if (mapped)
     {
-        printf("volume: Integrity check failed for block %d in volume %s\n", block_index, volume_id);
+        bool intact = decrypt_volume_records(block_index, count, mapped, buf, block_hashes);
+        end_volume_records();
+        return intact;
     }
+
+    unsigned char *records = malloc(count * volume_record_size);
+    if (!records)
+    {
+        return false;
+    }
+
+    int fd = volume_file_fd(block_index / DATA_BLOCKS_PER_VOLUME, VOLUME_DATA_FILE);
+    bool read_ok = fd >= 0 && pread(fd, records, count * volume_record_size, (off_t)block_index_in_volume * volume_record_size) == (ssize_t)(count * volume_record_size);
+    bool intact = read_ok && decrypt_volume_records(block_index, count, records, buf, block_hashes);
+
+    free(records);
+    return intact;
 }
 
-void write_volume_block(int block_index, const void *buf, size_t buf_size)
+// Read, decrypt and verify count adjacent blocks of one volume starting at block_index, true if
+// all decrypted and their leaves verified. The leaves are checked together, so the tree levels
+// above the run are hashed once instead of per block.
+bool read_volume_blocks_checked(int block_index, int count, void *buf)
+{
+    unsigned char(*block_hashes)[SHA256_DIGEST_LENGTH] = malloc(count * SHA256_DIGEST_LENGTH);
+    if (!block_hashes)
+    {
+        return false;
+    }
+
+    bool verified = read_volume_blocks_hashed(block_index, count, buf, block_hashes) &&
+                    verify_block_range(block_index, count, block_hashes);
+    free(block_hashes);
+    return verified;
+}
+
+// Read count adjacent blocks of one volume, checked like read_volume_block
+void read_volume_blocks(int block_index, int count, void *buf)
+{
+    printf("volume: Reading %d blocks from %d\n", count, block_index);
+
+    if (!read_volume_blocks_checked(block_index, count, buf))
+    {
+        printf("volume: Integrity check failed for blocks %d to %d in volume %d\n", block_index,
+               block_index + count - 1, block_index / DATA_BLOCKS_PER_VOLUME);
+    }
+}
+
+// Encrypt and store a block without touching the merkle tree, the leaf hash
+// of the stored block is returned so callers can batch the tree updates
+void write_volume_block_no_update(int block_index, const void *buf, size_t buf_size, unsigned char *block_hash)
 {
     printf("volume: Writing block %d\n", block_index);
 
-    char volume_id[9] = "0";
+    char volume_id[12];
     int volume_id_int = block_index / DATA_BLOCKS_PER_VOLUME;
-    sprintf(volume_id, "%d", volume_id_int);
+    snprintf(volume_id, sizeof(volume_id), "%d", volume_id_int);
 
     int block_index_in_volume = block_index % DATA_BLOCKS_PER_VOLUME;
 
     printf("volume: Writing block %d with volume %d\n", block_index_in_volume, volume_id_int);
 
-    char volume_filename[256];
     unsigned char block_buffer[BLOCK_SIZE];
     unsigned char encrypted_data[BLOCK_SIZE + crypto_aead_aes256gcm_ABYTES];
     unsigned char nonce[crypto_aead_aes256gcm_NPUBBYTES];
@@ -351,27 +809,47 @@ void write_volume_block(int block_index, const void *buf, size_t buf_size)
     }
 
     // Prepare file and encryption
-    sprintf(volume_filename, "volume_%s.bin", volume_id);
-    FILE *file = fopen(volume_filename, "r+b");
+    int fd = volume_file_fd(volume_id_int, VOLUME_DATA_FILE);
     generate_nonce(nonce);
+    if (encrypt_aes_gcm(encrypted_data, &ciphertext_len, block_buffer, BLOCK_SIZE, nonce, key) != 0)
+    {
+        printf("volume: Encryption failed for block %d in volume %s\n", block_index_in_volume, volume_id);
+    }
 
-    if (file)
+    if (fd >= 0)
     {
-        fseek(file, block_index_in_volume * (BLOCK_SIZE + crypto_aead_aes256gcm_ABYTES + sizeof(nonce)), SEEK_SET);
-        fwrite(nonce, sizeof(nonce), 1, file);
-        if (encrypt_aes_gcm(encrypted_data, &ciphertext_len, block_buffer, BLOCK_SIZE, nonce, key) != 0)
+        // the record being replaced may still belong to a snapshot
+        snapshot_preserve_block(block_index);
+        // nonce and ciphertext go out with one call, no stdio buffer holds half a record
+        struct iovec record[2] = {{nonce, sizeof(nonce)}, {encrypted_data, BLOCK_SIZE + crypto_aead_aes256gcm_ABYTES}};
+        off_t offset = (off_t)block_index_in_volume * (BLOCK_SIZE + crypto_aead_aes256gcm_ABYTES + sizeof(nonce));
+        if (pwritev(fd, record, 2, offset) != (ssize_t)(sizeof(nonce) + BLOCK_SIZE + crypto_aead_aes256gcm_ABYTES))
         {
-            printf("volume: Encryption failed for block %d in volume %s\n", block_index_in_volume, volume_id);
+            printf("volume: Error: Unable to write block %d to volume %s.\n", block_index_in_volume, volume_id);
         }
-        fwrite(encrypted_data, BLOCK_SIZE + crypto_aead_aes256gcm_ABYTES, 1, file);
-        fclose(file);
     }
     else
     {
-        printf("volume: Error: Unable to write to file %s.\n", volume_filename);
+        printf("volume: Error: Unable to write to volume %s.\n", volume_id);
     }
 
-    update_merkle_node_for_block(volume_id, block_index_in_volume, block_buffer);
+    if (sb.merkle_leaf_format == MERKLE_LEAF_RECORD)
+    {
+        compute_record_leaf(nonce, encrypted_data + BLOCK_SIZE, block_hash); // the tag follows the ciphertext
+    }
+    else
+    {
+        compute_hash(block_buffer, BLOCK_SIZE, block_hash);
+    }
+}
+
+void write_volume_block(int block_index, const void *buf, size_t buf_size)
+{
+    unsigned char block_hash[1][SHA256_DIGEST_LENGTH];
+    snapshot_write_begin();
+    write_volume_block_no_update(block_index, buf, buf_size, block_hash[0]);
+    merkle_updater_queue(&block_index, block_hash, 1, false);
+    snapshot_write_end();
 }
 // Function to initialize a new superblock
 void init_superblock_local(superblock_t *sb)
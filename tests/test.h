@@ -0,0 +1,61 @@
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+
+// Checks shared by the test programs. A test prints every failed check to stderr and exits with
+// the number of failures, the library output on stdout is left to the caller to discard.
+static int test_failures = 0;
+static char test_dir[] = "/tmp/encryptfs_test_XXXXXX";
+
+#define CHECK(cond) \
+    do \
+    { \
+        if (!(cond)) \
+        { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            test_failures++; \
+        } \
+    } while (0)
+
+// Run the test in a new empty directory, the filesystem files are created relative to it
+static void test_enter_temp_dir(void)
+{
+    if (!mkdtemp(test_dir) || chdir(test_dir) != 0)
+    {
+        fprintf(stderr, "Unable to create a test directory\n");
+        exit(1);
+    }
+}
+
+// Run a subcommand of the encryptFS binary the test was given, its output is discarded
+__attribute__((unused)) static int test_run(const char *binary, const char *args)
+{
+    char command[1024];
+    snprintf(command, sizeof(command), "%s %s > /dev/null 2>&1", binary, args);
+    return system(command);
+}
+
+// Report the result and remove the test directory, the files are all created directly in it
+static int test_finish(const char *name)
+{
+    DIR *dir = opendir(test_dir);
+    struct dirent *entry;
+    while (dir && (entry = readdir(dir)))
+    {
+        unlink(entry->d_name);
+    }
+    if (dir)
+    {
+        closedir(dir);
+    }
+    rmdir(test_dir);
+    fprintf(stderr, "%s: %s\n", name, test_failures ? "FAILED" : "passed");
+    return test_failures;
+}
+
+#endif // TEST_H
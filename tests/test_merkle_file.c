@@ -0,0 +1,158 @@
+// File: test_merkle_file.c
+// Round trips of the tree file: the current binary format, version 1 files and the text format
+#include <fcntl.h>
+#include <stddef.h>
+
+#include "test.h"
+#include "merkle.h"
+
+#define LEAVES 37
+
+static void leaf_hash(int i, unsigned char *hash)
+{
+    compute_hash(&i, sizeof(i), hash);
+}
+
+static MerkleTree *build_test_tree(int num_leaves, int fanout)
+{
+    unsigned char *block_hashes[LEAVES];
+    for (int i = 0; i < num_leaves; i++)
+    {
+        block_hashes[i] = malloc(SHA256_DIGEST_LENGTH);
+        leaf_hash(i, block_hashes[i]);
+    }
+    MerkleTree *tree = build_merkle_tree(block_hashes, num_leaves, fanout);
+    for (int i = 0; i < num_leaves; i++)
+    {
+        free(block_hashes[i]);
+    }
+    return tree;
+}
+
+static bool same_nodes(MerkleTree *a, MerkleTree *b)
+{
+    if (a->node_count != b->node_count || a->num_leaves != b->num_leaves || a->fanout != b->fanout)
+    {
+        return false;
+    }
+    for (int i = 0; i < a->node_count; i++)
+    {
+        if (!compare_hashes(a->nodes[i].hash, b->nodes[i].hash))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void set_header_field(const char *path, size_t offset, uint32_t value)
+{
+    int fd = open(path, O_WRONLY);
+    CHECK(fd >= 0 && pwrite(fd, &value, sizeof(value), offset) == sizeof(value));
+    close(fd);
+}
+
+// Current format, including a sparse tree whose empty nodes are holes in the file
+static void test_binary_round_trip(void)
+{
+    for (int fanout = 2; fanout <= MERKLE_MAX_FANOUT; fanout += 3)
+    {
+        MerkleTree *tree = build_test_tree(LEAVES, fanout);
+        save_merkle_tree_to_file(tree, "tree.bin");
+        MerkleTree *loaded = load_merkle_tree_from_file("tree.bin");
+        CHECK(loaded && loaded->fd >= 0 && !loaded->file_dirty);
+        CHECK(loaded && same_nodes(tree, loaded));
+        free_merkle_tree(loaded);
+        free_merkle_tree(tree);
+    }
+
+    MerkleTree *sparse = create_empty_merkle_tree(LEAVES, 4);
+    int positions[3] = {1, 17, 36};
+    unsigned char hashes[3][SHA256_DIGEST_LENGTH];
+    for (int i = 0; i < 3; i++)
+    {
+        leaf_hash(positions[i], hashes[i]);
+    }
+    update_merkle_leaves(sparse, positions, hashes, 3);
+    save_merkle_tree_to_file(sparse, "sparse.bin");
+    MerkleTree *loaded = load_merkle_tree_from_file("sparse.bin");
+    CHECK(loaded && same_nodes(sparse, loaded));
+    CHECK(loaded && merkle_node_is_empty(loaded->nodes[0].hash) && !merkle_node_is_empty(merkle_root_hash(loaded)));
+    free_merkle_tree(loaded);
+    free_merkle_tree(sparse);
+
+    // the flag survives a remount, and versions from the future are refused
+    set_header_field("tree.bin", offsetof(merkle_file_header_t, flags), MERKLE_FILE_DIRTY);
+    loaded = load_merkle_tree_from_file("tree.bin");
+    CHECK(loaded && loaded->file_dirty);
+    free_merkle_tree(loaded);
+    set_header_field("tree.bin", offsetof(merkle_file_header_t, version), MERKLE_FILE_VERSION + 1);
+    CHECK(load_merkle_tree_from_file("tree.bin") == NULL);
+}
+
+// Version 1 files have a shorter header and are always binary trees
+static void test_version_1(void)
+{
+    MerkleTree *tree = build_test_tree(LEAVES, 2);
+    merkle_file_header_t header = {0};
+    memcpy(header.magic, MERKLE_FILE_MAGIC, sizeof(header.magic));
+    header.version = 1;
+    header.digest_size = SHA256_DIGEST_LENGTH;
+    header.leaf_count = tree->num_leaves;
+    header.level_count = tree->level_count;
+    header.node_count = tree->node_count;
+
+    FILE *file = fopen("tree_v1.bin", "wb");
+    fwrite(&header, MERKLE_FILE_V1_HEADER_SIZE, 1, file);
+    fwrite(tree->nodes, sizeof(MerkleNode), tree->node_count, file);
+    fclose(file);
+
+    MerkleTree *loaded = load_merkle_tree_from_file("tree_v1.bin");
+    CHECK(loaded && loaded->fanout == 2 && loaded->data_offset == MERKLE_FILE_V1_HEADER_SIZE);
+    CHECK(loaded && same_nodes(tree, loaded));
+
+    // saving upgrades the file to the current version
+    save_merkle_tree_to_file(loaded, "tree_v1.bin");
+    free_merkle_tree(loaded);
+    loaded = load_merkle_tree_from_file("tree_v1.bin");
+    CHECK(loaded && loaded->data_offset == sizeof(merkle_file_header_t) && same_nodes(tree, loaded));
+    free_merkle_tree(loaded);
+    free_merkle_tree(tree);
+}
+
+// Text files list the leaves as hex digest and block index, the interior nodes are recomputed
+static void test_text_migration(void)
+{
+    MerkleTree *tree = build_test_tree(LEAVES, 2);
+    FILE *file = fopen("tree.txt", "w");
+    char hex[2 * SHA256_DIGEST_LENGTH + 1];
+    hash_to_hex(merkle_root_hash(tree), hex, SHA256_DIGEST_LENGTH);
+    fprintf(file, "%s -1\n", hex);
+    for (int i = LEAVES - 1; i >= 0; i--)
+    {
+        hash_to_hex(tree->nodes[i].hash, hex, SHA256_DIGEST_LENGTH);
+        fprintf(file, "%s %d\nnull\n", hex, i);
+    }
+    fclose(file);
+
+    MerkleTree *loaded = load_merkle_tree_from_file("tree.txt");
+    CHECK(loaded && loaded->fd < 0);
+    CHECK(loaded && same_nodes(tree, loaded));
+
+    // the first save rewrites it in the binary format
+    save_merkle_tree_to_file(loaded, "tree.txt");
+    free_merkle_tree(loaded);
+    loaded = load_merkle_tree_from_file("tree.txt");
+    CHECK(loaded && loaded->fd >= 0 && same_nodes(tree, loaded));
+    free_merkle_tree(loaded);
+    free_merkle_tree(tree);
+}
+
+int main(void)
+{
+    test_enter_temp_dir();
+    test_binary_round_trip();
+    test_version_1();
+    test_text_migration();
+    return test_finish("test_merkle_file");
+}
@@ -0,0 +1,101 @@
+// File: test_merkle_kary.c
+// Roots of k-ary trees, built at once and updated leaf by leaf, against a straightforward reference
+#include <openssl/sha.h>
+
+#include "test.h"
+#include "merkle.h"
+
+#define MAX_LEAVES 300
+
+static const unsigned char zero_hash[SHA256_DIGEST_LENGTH];
+
+// Reference root: each level hashes the concatenated children of a node, a single child is
+// promoted unchanged and a node with only empty children stays empty
+static void reference_root(unsigned char (*leaves)[SHA256_DIGEST_LENGTH], int n, int fanout, unsigned char *root)
+{
+    unsigned char(*level)[SHA256_DIGEST_LENGTH] = malloc(n * SHA256_DIGEST_LENGTH);
+    memcpy(level, leaves, n * SHA256_DIGEST_LENGTH);
+    while (n > 1)
+    {
+        int parents = (n + fanout - 1) / fanout;
+        for (int p = 0; p < parents; p++)
+        {
+            int children = n - p * fanout < fanout ? n - p * fanout : fanout;
+            bool empty = true;
+            for (int c = 0; c < children; c++)
+            {
+                empty = empty && memcmp(level[p * fanout + c], zero_hash, SHA256_DIGEST_LENGTH) == 0;
+            }
+            unsigned char parent[SHA256_DIGEST_LENGTH];
+            if (children == 1)
+            {
+                memcpy(parent, level[p * fanout], SHA256_DIGEST_LENGTH);
+            }
+            else if (empty)
+            {
+                memset(parent, 0, SHA256_DIGEST_LENGTH);
+            }
+            else
+            {
+                SHA256(level[p * fanout], children * SHA256_DIGEST_LENGTH, parent);
+            }
+            memcpy(level[p], parent, SHA256_DIGEST_LENGTH); // p * fanout >= p, read before written
+        }
+        n = parents;
+    }
+    memcpy(root, level[0], SHA256_DIGEST_LENGTH);
+    free(level);
+}
+
+static void test_tree(int n, int fanout, bool sparse)
+{
+    static unsigned char leaves[MAX_LEAVES][SHA256_DIGEST_LENGTH];
+    unsigned char *block_hashes[MAX_LEAVES];
+    int positions[MAX_LEAVES];
+    for (int i = 0; i < n; i++)
+    {
+        int seed = i * 31 + fanout;
+        SHA256((unsigned char *)&seed, sizeof(seed), leaves[i]);
+        if (sparse && i % 3 != 1)
+        {
+            memset(leaves[i], 0, SHA256_DIGEST_LENGTH);
+        }
+        block_hashes[i] = leaves[i];
+        positions[i] = i;
+    }
+    unsigned char expected[SHA256_DIGEST_LENGTH];
+    reference_root(leaves, n, fanout, expected);
+
+    MerkleTree *built = build_merkle_tree(block_hashes, n, fanout);
+    CHECK(built && compare_hashes(merkle_root_hash(built), expected));
+    free_merkle_tree(built);
+
+    MerkleTree *batched = create_empty_merkle_tree(n, fanout);
+    update_merkle_leaves(batched, positions, leaves, n);
+    CHECK(compare_hashes(merkle_root_hash(batched), expected));
+
+    // changing single leaves afterwards keeps the tree equal to the reference
+    for (int i = 0; i < n; i += 1 + n / 5)
+    {
+        leaves[i][0] ^= 0x5a;
+        update_merkle_node(batched, i, leaves[i]);
+        reference_root(leaves, n, fanout, expected);
+        CHECK(compare_hashes(merkle_root_hash(batched), expected));
+    }
+    free_merkle_tree(batched);
+}
+
+int main(void)
+{
+    test_enter_temp_dir();
+    const int leaf_counts[] = {1, 2, 3, 7, 16, 17, 20, 100, 257, MAX_LEAVES};
+    for (int fanout = 2; fanout <= MERKLE_MAX_FANOUT; fanout++)
+    {
+        for (size_t i = 0; i < sizeof(leaf_counts) / sizeof(leaf_counts[0]); i++)
+        {
+            test_tree(leaf_counts[i], fanout, false);
+            test_tree(leaf_counts[i], fanout, true);
+        }
+    }
+    return test_finish("test_merkle_kary");
+}
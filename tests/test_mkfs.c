@@ -0,0 +1,36 @@
+// File: test_mkfs.c
+// A filesystem created by mkfs opens with its key and has a readable root directory
+#include <sodium.h>
+
+#include "test.h"
+#include "volume.h"
+#include "crypto.h"
+#include "inode.h"
+
+int main(int argc, char **argv)
+{
+    if (argc < 2 || sodium_init() == -1)
+    {
+        fprintf(stderr, "Usage: %s <encryptFS binary>\n", argv[0]);
+        return 1;
+    }
+    test_enter_temp_dir();
+
+    CHECK(test_run(argv[1], "keygen ./key.txt") == 0);
+    CHECK(test_run(argv[1], "mkfs ./superblock.bin") != 0); // the key is required
+    CHECK(access("./superblock.bin", F_OK) != 0);
+    CHECK(test_run(argv[1], "mkfs ./superblock.bin ./key.txt 4") == 0);
+    CHECK(test_run(argv[1], "mkfs ./superblock.bin ./key.txt") != 0); // an existing superblock is kept
+
+    CHECK(load_key(key, "key.txt") == 0);
+    strcpy(superblock_path, "./superblock.bin");
+    load_or_create_superblock(superblock_path, &sb);
+    CHECK(sb.merkle_fanout == 4);
+
+    inode root;
+    memset(&root, 0, sizeof(root));
+    read_inode(0, &root);
+    CHECK(root.valid && root.is_directory && strcmp(root.path, "/") == 0);
+
+    return test_finish("test_mkfs");
+}
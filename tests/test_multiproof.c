@@ -0,0 +1,108 @@
+// File: test_multiproof.c
+// Multi-proofs are accepted for the tree they were made from and refused once anything changed
+#include "test.h"
+#include "merkle.h"
+
+#define LEAVES 20
+
+static MerkleTree *build_test_tree(int fanout)
+{
+    unsigned char leaves[LEAVES][SHA256_DIGEST_LENGTH];
+    unsigned char *block_hashes[LEAVES];
+    for (int i = 0; i < LEAVES; i++)
+    {
+        compute_hash(&i, sizeof(i), leaves[i]);
+        block_hashes[i] = leaves[i];
+    }
+    return build_merkle_tree(block_hashes, LEAVES, fanout);
+}
+
+static void test_proof(MerkleTree *tree, const int *indices, int count)
+{
+    unsigned char *root = merkle_root_hash(tree);
+    MerkleProof *proof = create_merkle_multiproof(tree, indices, count);
+    CHECK(proof && proof->header.index_count == (uint32_t)count);
+    if (!proof)
+    {
+        return;
+    }
+    CHECK(verify_merkle_multiproof(proof, NULL, root));
+
+    // the leaves the caller computed have to match the proven ones
+    unsigned char(*leaves)[SHA256_DIGEST_LENGTH] = malloc(count * SHA256_DIGEST_LENGTH);
+    for (int i = 0; i < count; i++)
+    {
+        memcpy(leaves[i], tree->nodes[proof->indices[i]].hash, SHA256_DIGEST_LENGTH);
+    }
+    CHECK(verify_merkle_multiproof(proof, leaves, root));
+    leaves[count - 1][5] ^= 1;
+    CHECK(!verify_merkle_multiproof(proof, leaves, root));
+    free(leaves);
+
+    // another root, a changed leaf or a changed sibling is refused
+    unsigned char other_root[SHA256_DIGEST_LENGTH];
+    memcpy(other_root, root, SHA256_DIGEST_LENGTH);
+    other_root[0] ^= 1;
+    CHECK(!verify_merkle_multiproof(proof, NULL, other_root));
+    proof->leaves[0][0] ^= 1;
+    CHECK(!verify_merkle_multiproof(proof, NULL, root));
+    proof->leaves[0][0] ^= 1;
+    if (proof->header.hash_count > 0)
+    {
+        proof->hashes[proof->header.hash_count - 1][31] ^= 1;
+        CHECK(!verify_merkle_multiproof(proof, NULL, root));
+        proof->hashes[proof->header.hash_count - 1][31] ^= 1;
+    }
+
+    // the proof file reads back as the same proof
+    CHECK(save_merkle_proof(proof, "proof.bin"));
+    MerkleProof *loaded = load_merkle_proof("proof.bin");
+    CHECK(loaded && loaded->header.hash_count == proof->header.hash_count);
+    CHECK(loaded && verify_merkle_multiproof(loaded, NULL, root));
+    free_merkle_proof(loaded);
+    free_merkle_proof(proof);
+}
+
+int main(void)
+{
+    test_enter_temp_dir();
+
+    const int one[] = {7};
+    const int run[] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15};
+    const int scattered[] = {0, 5, 6, 13, 19};
+    const int unsorted[] = {19, 2, 2, 11};
+    int all[LEAVES];
+    for (int i = 0; i < LEAVES; i++)
+    {
+        all[i] = i;
+    }
+
+    for (int fanout = 2; fanout <= 4; fanout++)
+    {
+        MerkleTree *tree = build_test_tree(fanout);
+        test_proof(tree, one, 1);
+        test_proof(tree, run, 16);
+        test_proof(tree, scattered, 5);
+        test_proof(tree, all, LEAVES);
+
+        // duplicates are proven once and the indices come out ascending
+        MerkleProof *proof = create_merkle_multiproof(tree, unsorted, 4);
+        CHECK(proof && proof->header.index_count == 3 && proof->indices[0] == 2 && proof->indices[2] == 19);
+        CHECK(proof && verify_merkle_multiproof(proof, NULL, merkle_root_hash(tree)));
+        free_merkle_proof(proof);
+
+        // sibling digests shared by the paths are stored once, a proof of every leaf needs none
+        proof = create_merkle_multiproof(tree, all, LEAVES);
+        CHECK(proof && proof->header.hash_count == 0);
+        free_merkle_proof(proof);
+
+        // a proof of the tree before a leaf changed no longer verifies
+        proof = create_merkle_multiproof(tree, scattered, 5);
+        unsigned char changed[SHA256_DIGEST_LENGTH] = {1};
+        update_merkle_node(tree, 13, changed);
+        CHECK(proof && !verify_merkle_multiproof(proof, NULL, merkle_root_hash(tree)));
+        free_merkle_proof(proof);
+        free_merkle_tree(tree);
+    }
+    return test_finish("test_multiproof");
+}
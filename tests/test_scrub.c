@@ -0,0 +1,70 @@
+// File: test_scrub.c
+// The scrubber verifies every written block, and pausing it through the root attribute is reported and kept
+#include <sodium.h>
+
+#include "test.h"
+#include "volume.h"
+#include "crypto.h"
+#include "scrub.h"
+#include "fs_operations.h"
+
+// Wait up to ten seconds for the scrubber to finish a pass
+static bool wait_for_pass(scrub_progress_t *progress)
+{
+    for (int i = 0; i < 1000; i++)
+    {
+        scrub_get_progress(progress);
+        if (progress->passes > 0)
+        {
+            return true;
+        }
+        usleep(10000);
+    }
+    return false;
+}
+
+int main(void)
+{
+    if (sodium_init() == -1)
+    {
+        return 1;
+    }
+    test_enter_temp_dir();
+    generate_and_store_key("key.txt");
+    strcpy(superblock_path, "./superblock.bin");
+    load_or_create_superblock(superblock_path, &sb);
+
+    static unsigned char block[BLOCK_SIZE];
+    for (int i = 0; i < 8; i++)
+    {
+        block[0] = (unsigned char)i;
+        write_volume_block(i, block, BLOCK_SIZE);
+    }
+
+    scrub_progress_t progress;
+    scrub_start(0);
+    CHECK(wait_for_pass(&progress));
+    CHECK(progress.last_errors == 0 && !progress.paused);
+
+    CHECK(fs_setxattr("/", SCRUB_XATTR, "pause", 5, 0) == 0);
+    CHECK(fs_setxattr("/", SCRUB_XATTR, "halt", 4, 0) == -EINVAL);
+    char value[160];
+    int length = fs_getxattr("/", SCRUB_XATTR, NULL, 0);
+    CHECK(length > 0 && length < (int)sizeof(value));
+    CHECK(fs_getxattr("/", SCRUB_XATTR, value, sizeof(value)) == length);
+    value[length > 0 ? length : 0] = '\0';
+    CHECK(strstr(value, "passes=1 ") && strstr(value, "paused=1"));
+    CHECK(fs_getxattr("/", SCRUB_XATTR, value, 4) == -ERANGE);
+    scrub_stop();
+
+    // the pause holds after a restart until it is resumed
+    scrub_start(0);
+    scrub_get_progress(&progress);
+    CHECK(progress.paused && progress.passes == 1);
+    scrub_resume();
+    scrub_get_progress(&progress);
+    CHECK(!progress.paused);
+    scrub_stop();
+
+    return test_finish("test_scrub");
+}
@@ -0,0 +1,53 @@
+// File: test_sha256_mb.c
+// Multi-buffer SHA-256 against OpenSSL, for lengths around the block boundaries and partial lanes
+#include <openssl/sha.h>
+
+#include "test.h"
+#include "sha256_mb.h"
+
+#define MAX_MESSAGES (3 * SHA256_MB_LANES + 1)
+#define MAX_LEN 1100
+
+int main(void)
+{
+    test_enter_temp_dir();
+    static unsigned char messages[MAX_MESSAGES][MAX_LEN];
+    for (int m = 0; m < MAX_MESSAGES; m++)
+    {
+        for (int i = 0; i < MAX_LEN; i++)
+        {
+            messages[m][i] = (unsigned char)(i * 13 + m * 101 + i / 7);
+        }
+    }
+
+    const size_t lengths[] = {0, 1, 31, 32, 55, 56, 63, 64, 65, 119, 120, 127, 128, 129, 512, 1024, MAX_LEN};
+    for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++)
+    {
+        for (int count = 1; count <= MAX_MESSAGES; count++)
+        {
+            const unsigned char *inputs[MAX_MESSAGES];
+            unsigned char digests[MAX_MESSAGES][SHA256_DIGEST_LENGTH];
+            unsigned char *outputs[MAX_MESSAGES];
+            for (int m = 0; m < count; m++)
+            {
+                inputs[m] = messages[m];
+                outputs[m] = digests[m];
+            }
+            sha256_mb(inputs, lengths[l], count, outputs);
+
+            for (int m = 0; m < count; m++)
+            {
+                unsigned char expected[SHA256_DIGEST_LENGTH];
+                SHA256(messages[m], lengths[l], expected);
+                if (memcmp(digests[m], expected, SHA256_DIGEST_LENGTH) != 0)
+                {
+                    fprintf(stderr, "message %d of %d, length %zu\n", m, count, lengths[l]);
+                }
+                CHECK(memcmp(digests[m], expected, SHA256_DIGEST_LENGTH) == 0);
+            }
+        }
+    }
+
+    fprintf(stderr, "test_sha256_mb: %s kernel\n", sha256_mb_kernel_name());
+    return test_finish("test_sha256_mb");
+}
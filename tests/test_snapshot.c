@@ -0,0 +1,150 @@
+// File: test_snapshot.c
+// Blocks read back from a snapshot as they were when it was taken, after being overwritten
+#include <sodium.h>
+
+#include "test.h"
+#include "volume.h"
+#include "crypto.h"
+#include "snapshot.h"
+#include "fs_operations.h"
+
+static void fill(unsigned char *block, int seed)
+{
+    for (int i = 0; i < BLOCK_SIZE; i++)
+    {
+        block[i] = (unsigned char)(i * 7 + seed + i / 251);
+    }
+}
+
+static bool snapshot_block_is(uint32_t id, int block_index, const unsigned char *expected)
+{
+    unsigned char block[BLOCK_SIZE];
+    return snapshot_read_block(id, block_index, block) && memcmp(block, expected, BLOCK_SIZE) == 0;
+}
+
+static bool live_block_is(int block_index, const unsigned char *expected)
+{
+    unsigned char block[BLOCK_SIZE];
+    return read_volume_block_checked(block_index, block) && memcmp(block, expected, BLOCK_SIZE) == 0;
+}
+
+// A mount takes a snapshot itself while the offline command is refused, and writes after it do
+// not change the exported image
+static void test_mounted_snapshot(const char *binary)
+{
+    static unsigned char before[DATA_BLOCKS_PER_VOLUME][BLOCK_SIZE], after[BLOCK_SIZE];
+    for (int b = 0; b < DATA_BLOCKS_PER_VOLUME; b++)
+    {
+        fill(before[b], 10 + b);
+        write_volume_block(b, before[b], BLOCK_SIZE);
+    }
+
+    CHECK(lock_superblock(superblock_path));
+    CHECK(test_run(binary, "snapshot ./superblock.bin create") != 0);
+    CHECK(fs_setxattr("/", SNAPSHOT_XATTR, "create", 6, 0) == 0);
+    uint32_t id = sb.snapshot_next_id - 1;
+    CHECK(snapshot_find(id) != NULL);
+
+    for (int b = 0; b < DATA_BLOCKS_PER_VOLUME; b++)
+    {
+        fill(after, 50 + b);
+        write_volume_block(b, after, BLOCK_SIZE);
+    }
+    CHECK(live_block_is(DATA_BLOCKS_PER_VOLUME - 1, after));
+
+    char args[256];
+    snprintf(args, sizeof(args), "snapshot ./superblock.bin export %u 0 ./volume_0.img ./key.txt", id);
+    CHECK(test_run(binary, args) == 0);
+    FILE *image = fopen("volume_0.img", "rb");
+    static unsigned char exported[DATA_BLOCKS_PER_VOLUME][BLOCK_SIZE];
+    CHECK(image && fread(exported, BLOCK_SIZE, DATA_BLOCKS_PER_VOLUME, image) == DATA_BLOCKS_PER_VOLUME);
+    CHECK(memcmp(exported, before, sizeof(before)) == 0);
+    if (image)
+    {
+        fclose(image);
+    }
+
+    snprintf(args, sizeof(args), "snapshot ./superblock.bin delete %u", id);
+    CHECK(test_run(binary, args) != 0);
+    snprintf(args, sizeof(args), "delete %u", id);
+    CHECK(fs_setxattr("/", SNAPSHOT_XATTR, args, strlen(args), 0) == 0);
+    CHECK(snapshot_find(id) == NULL);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2 || sodium_init() == -1)
+    {
+        fprintf(stderr, "Usage: %s <encryptFS binary>\n", argv[0]);
+        return 1;
+    }
+    test_enter_temp_dir();
+    generate_and_store_key("key.txt");
+    strcpy(superblock_path, "./superblock.bin");
+    load_or_create_superblock(superblock_path, &sb);
+
+    static unsigned char a0[BLOCK_SIZE], a1[BLOCK_SIZE], b0[BLOCK_SIZE], c0[BLOCK_SIZE], b1[BLOCK_SIZE];
+    fill(a0, 1);
+    fill(a1, 2);
+    fill(b0, 3);
+    fill(c0, 4);
+    fill(b1, 5);
+    write_volume_block(0, a0, BLOCK_SIZE);
+    write_volume_block(1, a1, BLOCK_SIZE);
+
+    int first = snapshot_create();
+    CHECK(first > 0);
+
+    // only the first overwrite after the snapshot keeps the old block
+    write_volume_block(0, b0, BLOCK_SIZE);
+    write_volume_block(0, c0, BLOCK_SIZE);
+    CHECK(live_block_is(0, c0));
+    CHECK(snapshot_block_is(first, 0, a0));
+    CHECK(snapshot_block_is(first, 1, a1));
+
+    int second = snapshot_create();
+    CHECK(second > first);
+    write_volume_block(1, b1, BLOCK_SIZE);
+    CHECK(live_block_is(1, b1));
+    CHECK(snapshot_block_is(second, 0, c0));
+    CHECK(snapshot_block_is(second, 1, a1));
+    CHECK(snapshot_block_is(first, 0, a0));
+    CHECK(snapshot_block_is(first, 1, a1));
+
+    // the block kept for the newer snapshot is still needed by the older one
+    CHECK(snapshot_delete(second));
+    CHECK(snapshot_find(second) == NULL);
+    CHECK(snapshot_block_is(first, 0, a0));
+    CHECK(snapshot_block_is(first, 1, a1));
+
+    // a preserved block that was changed in the snapshot file fails verification
+    snapshot_close();
+    char path[MAX_PATH_LENGTH];
+    snprintf(path, sizeof(path), SNAPSHOT_PATH_FORMAT, (uint32_t)first, 0);
+    FILE *file = fopen(path, "r+b");
+    CHECK(file != NULL);
+    snapshot_record_t record;
+    while (file && fread(&record, sizeof(record), 1, file) == 1)
+    {
+        long size = record.type == SNAPSHOT_NODE ? SHA256_DIGEST_LENGTH : crypto_aead_aes256gcm_NPUBBYTES + BLOCK_SIZE + crypto_aead_aes256gcm_ABYTES;
+        if (record.type == SNAPSHOT_BLOCK && record.index == 0)
+        {
+            fseek(file, crypto_aead_aes256gcm_NPUBBYTES + 100, SEEK_CUR);
+            int c = fgetc(file);
+            fseek(file, -1, SEEK_CUR);
+            fputc(c ^ 1, file);
+            break;
+        }
+        fseek(file, size, SEEK_CUR);
+    }
+    if (file)
+    {
+        fclose(file);
+    }
+    CHECK(!snapshot_block_is(first, 0, a0));
+    CHECK(snapshot_block_is(first, 1, a1));
+    snapshot_close();
+
+    test_mounted_snapshot(argv[1]);
+    return test_finish("test_snapshot");
+}
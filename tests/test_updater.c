@@ -0,0 +1,96 @@
+// File: test_updater.c
+// The updater keeps one queued leaf per block with its newest digest and applies it once
+#include <sodium.h>
+#include <stddef.h>
+
+#include "test.h"
+#include "volume.h"
+#include "crypto.h"
+#include "merkle.h"
+#include "merkle_updater.h"
+
+static void digest(int seed, unsigned char *hash)
+{
+    compute_hash(&seed, sizeof(seed), hash);
+}
+
+static bool leaf_is(int block_index, const unsigned char *hash)
+{
+    MerkleTree *tree = get_merkle_tree_for_volume("0");
+    return tree && compare_hashes(tree->nodes[block_index].hash, hash);
+}
+
+static bool tree_file_dirty(void)
+{
+    merkle_file_header_t header;
+    FILE *file = fopen(sb.volumes[0].merkle_path, "rb");
+    bool dirty = file && fread(&header, sizeof(header), 1, file) == 1 && (header.flags & MERKLE_FILE_DIRTY);
+    if (file)
+    {
+        fclose(file);
+    }
+    return dirty;
+}
+
+int main(void)
+{
+    if (sodium_init() == -1)
+    {
+        return 1;
+    }
+    test_enter_temp_dir();
+    generate_and_store_key("key.txt");
+    strcpy(superblock_path, "./superblock.bin");
+    load_or_create_superblock(superblock_path, &sb);
+
+    static unsigned char block[BLOCK_SIZE];
+    for (int i = 0; i < 8; i++)
+    {
+        write_volume_block(i, block, BLOCK_SIZE);
+    }
+    unsigned char initial[SHA256_DIGEST_LENGTH];
+    memcpy(initial, get_merkle_tree_for_volume("0")->nodes[3].hash, SHA256_DIGEST_LENGTH);
+    checkpoint_merkle_tree(get_merkle_tree_for_volume("0"), sb.volumes[0].merkle_path);
+    CHECK(!tree_file_dirty());
+
+    // nothing reaches the trees before the lag unless a full batch is queued
+    merkle_updater_start(60000);
+    int blocks[1] = {3};
+    unsigned char hashes[1][SHA256_DIGEST_LENGTH];
+    unsigned char last[SHA256_DIGEST_LENGTH];
+    for (int i = 0; i < 2 * MERKLE_UPDATE_BATCH; i++)
+    {
+        digest(i, hashes[0]);
+        merkle_updater_queue(blocks, hashes, 1, false);
+    }
+    memcpy(last, hashes[0], SHA256_DIGEST_LENGTH);
+
+    // the rewrites of block 3 kept one entry, so no batch was started and it holds the last digest
+    unsigned char queued[SHA256_DIGEST_LENGTH];
+    CHECK(merkle_updater_lookup(3, queued) && compare_hashes(queued, last));
+    CHECK(!merkle_updater_lookup(4, queued));
+    CHECK(merkle_updater_pending(0));
+    CHECK(leaf_is(3, initial));
+    CHECK(tree_file_dirty());
+
+    // a flush applies the newest digest without waiting for the lag
+    int pair[2] = {4, 3};
+    unsigned char pair_hashes[2][SHA256_DIGEST_LENGTH];
+    digest(-1, pair_hashes[0]);
+    memcpy(pair_hashes[1], last, SHA256_DIGEST_LENGTH);
+    merkle_updater_queue(pair, pair_hashes, 2, false);
+    merkle_updater_flush();
+    CHECK(!merkle_updater_lookup(3, queued));
+    CHECK(!merkle_updater_pending(0));
+    CHECK(leaf_is(3, last));
+    CHECK(leaf_is(4, pair_hashes[0]));
+    CHECK(verify_block_leaf(3, last));
+
+    // stopping applies what is still queued
+    digest(-2, hashes[0]);
+    merkle_updater_queue(blocks, hashes, 1, false);
+    merkle_updater_stop();
+    CHECK(leaf_is(3, hashes[0]));
+
+    return test_finish("test_updater");
+}